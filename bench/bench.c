@@ -0,0 +1,547 @@
+/*
+
+Copyright 2017 technicianted
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <malloc.h>
+
+#include "ms_speech/ms_speech.h"
+#include "ms_speech_priv.h"
+#include "client_messages.h"
+#include "response_messages_priv.h"
+#include "ms_speech_guid.h"
+#include "ms_speech_timestamp.h"
+#include "ms_speech_telemetry.h"
+#include "ms_speech_latency.h"
+#include "ms_speech_memory.h"
+#include "compat.h"
+
+#define BENCH_AUDIO_SIZE 3200
+// responses recorded between telemetry resets, about one turn
+#define BENCH_MESSAGES_PER_TURN 32
+// nothing listens there, connects are refused right away
+#define BENCH_URI "ws://127.0.0.1:9/speech/recognition/interactive/cognitiveservices/v1"
+#define BENCH_CHURN_MAX_STEPS 100
+// connections churned before the leak check baseline is taken
+#define BENCH_LEAK_WARMUP 64
+// retained bytes per churned connection tolerated by the leak check
+#define BENCH_LEAK_BYTES_PER_ROUND 8
+
+// glibc entry points behind the counting wrappers below
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t num, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static int counting = 0;
+static unsigned long allocations = 0;
+static unsigned long allocated_bytes = 0;
+// heap in use by the whole process, for the leak check
+static long live_bytes = 0;
+
+void *malloc(size_t size)
+{
+	if (counting) {
+		allocations++;
+		allocated_bytes += size;
+	}
+	void *ptr = __libc_malloc(size);
+	if (ptr)
+		live_bytes += malloc_usable_size(ptr);
+	return ptr;
+}
+
+void *calloc(size_t num, size_t size)
+{
+	if (counting) {
+		allocations++;
+		allocated_bytes += num * size;
+	}
+	void *ptr = __libc_calloc(num, size);
+	if (ptr)
+		live_bytes += malloc_usable_size(ptr);
+	return ptr;
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	if (counting) {
+		allocations++;
+		allocated_bytes += size;
+	}
+	size_t previous = ptr ? malloc_usable_size(ptr) : 0;
+	void *result = __libc_realloc(ptr, size);
+	if (result || !size)
+		live_bytes += (result ? (long)malloc_usable_size(result) : 0) - (long)previous;
+	return result;
+}
+
+void free(void *ptr)
+{
+	if (ptr)
+		live_bytes -= malloc_usable_size(ptr);
+	__libc_free(ptr);
+}
+
+typedef struct {
+	const char *name;
+	void (*run)(long iterations);
+} benchmark_t;
+
+static ms_speech_context_t context = NULL;
+static ms_speech_connection_t connection = NULL;
+static unsigned char audio[BENCH_AUDIO_SIZE];
+static volatile int sink;
+
+static const char *hypothesis_message =
+	"Path: speech.hypothesis\r\n"
+	"X-RequestId: 5c2d8d6b09b44a5b9d0e6e0f3c1f2a7d\r\n"
+	"X-Timestamp: 2017-05-29T18:22:41.3542145Z\r\n"
+	"Content-Type: application/json; charset=utf-8\r\n"
+	"\r\n"
+	"{\"Text\":\"what is the weather like\",\"Offset\":12500000,\"Duration\":13700000}";
+
+static const char *detailed_phrase_message =
+	"Path: speech.phrase\r\n"
+	"X-RequestId: 5c2d8d6b09b44a5b9d0e6e0f3c1f2a7d\r\n"
+	"X-Timestamp: 2017-05-29T18:22:42.1182201Z\r\n"
+	"Content-Type: application/json; charset=utf-8\r\n"
+	"\r\n"
+	"{\"RecognitionStatus\":\"Success\",\"Offset\":12500000,\"Duration\":21800000,\"NBest\":["
+	"{\"Confidence\":0.9132455,\"Lexical\":\"what is the weather like in seattle today\",\"ITN\":\"what is the weather like in seattle today\",\"MaskedITN\":\"what is the weather like in seattle today\",\"Display\":\"What is the weather like in Seattle today?\"},"
+	"{\"Confidence\":0.8561021,\"Lexical\":\"what is the weather like in seattle to day\",\"ITN\":\"what is the weather like in seattle to day\",\"MaskedITN\":\"what is the weather like in seattle to day\",\"Display\":\"What is the weather like in Seattle to day?\"},"
+	"{\"Confidence\":0.7403113,\"Lexical\":\"what is the whether like in seattle today\",\"ITN\":\"what is the whether like in seattle today\",\"MaskedITN\":\"what is the whether like in seattle today\",\"Display\":\"What is the whether like in Seattle today?\"},"
+	"{\"Confidence\":0.6911987,\"Lexical\":\"what's the weather like in seattle today\",\"ITN\":\"what's the weather like in seattle today\",\"MaskedITN\":\"what's the weather like in seattle today\",\"Display\":\"What's the weather like in Seattle today?\"},"
+	"{\"Confidence\":0.5124306,\"Lexical\":\"what is the weather light in seattle today\",\"ITN\":\"what is the weather light in seattle today\",\"MaskedITN\":\"what is the weather light in seattle today\",\"Display\":\"What is the weather light in Seattle today?\"}"
+	"]}";
+
+static char scratch[8192];
+
+static size_t headers_length(const char *message)
+{
+	return strstr(message, "\r\n\r\n") - message + 2;
+}
+
+static void bench_serialize_audio(long iterations)
+{
+	ms_speech_message *message = ms_speech_create_new_message();
+	ms_speech_set_message_audio(connection, message, audio, sizeof(audio));
+	ms_speech_set_message_time(message, ms_speech_get_epoch_us());
+	strcpy(message->request_id, "5c2d8d6b09b44a5b9d0e6e0f3c1f2a7d");
+
+	counting = 1;
+	for (long i=0; i<iterations; i++) {
+		char *buffer;
+		sink += ms_speech_serialize_message(message, &buffer);
+	}
+	counting = 0;
+
+	ms_speech_destroy_message(message);
+}
+
+static void bench_serialize_config(long iterations)
+{
+	ms_speech_message *message = ms_speech_create_new_message();
+	ms_speech_set_message_speech_config(connection, message);
+	ms_speech_set_message_time(message, ms_speech_get_epoch_us());
+
+	counting = 1;
+	for (long i=0; i<iterations; i++) {
+		char *buffer;
+		sink += ms_speech_serialize_message(message, &buffer);
+	}
+	counting = 0;
+
+	ms_speech_destroy_message(message);
+}
+
+static void bench_set_message_audio(long iterations)
+{
+	ms_speech_message *message = ms_speech_create_new_message();
+
+	counting = 1;
+	for (long i=0; i<iterations; i++) {
+		ms_speech_set_message_audio(connection, message, audio, sizeof(audio));
+		free(message->body);
+		message->body = NULL;
+	}
+	counting = 0;
+
+	ms_speech_destroy_message(message);
+}
+
+static void bench_extract_headers(long iterations)
+{
+	size_t length = headers_length(detailed_phrase_message);
+
+	counting = 1;
+	for (long i=0; i<iterations; i++) {
+		// headers are split in place
+		memcpy(scratch, detailed_phrase_message, length);
+		ms_speech_header_t *headers;
+		int num_headers;
+		ms_speech_extract_headers(connection, scratch, length, &headers, &num_headers);
+		for (int h=0; h<num_headers; h++) {
+			free(headers[h].name);
+			free(headers[h].value);
+		}
+		free(headers);
+		sink += num_headers;
+	}
+	counting = 0;
+}
+
+static void bench_parse_payload(long iterations)
+{
+	const char *payload = detailed_phrase_message + headers_length(detailed_phrase_message) + 2;
+	size_t length = strlen(payload);
+
+	counting = 1;
+	for (long i=0; i<iterations; i++) {
+		memcpy(scratch, payload, length);
+		struct json_object *json = NULL;
+		ms_speech_parse_payload(connection, scratch, length, &json);
+		json_object_put(json);
+	}
+	counting = 0;
+}
+
+static void bench_handle_message(const char *message, long iterations)
+{
+	size_t length = strlen(message);
+
+	counting = 1;
+	for (long i=0; i<iterations; i++) {
+		if (i % BENCH_MESSAGES_PER_TURN == 0)
+			ms_speech_telemetry_reset(connection);
+		memcpy(scratch, message, length);
+		sink += ms_speech_handle_resonse_message(connection, scratch, length);
+	}
+	counting = 0;
+}
+
+static void bench_handle_hypothesis(long iterations)
+{
+	bench_handle_message(hypothesis_message, iterations);
+}
+
+static void bench_handle_detailed_phrase(long iterations)
+{
+	bench_handle_message(detailed_phrase_message, iterations);
+}
+
+static void bench_generate_guid(long iterations)
+{
+	char buffer[48];
+
+	counting = 1;
+	for (long i=0; i<iterations; i++)
+		sink += ms_speech_generate_guid(buffer, sizeof(buffer), 0);
+	counting = 0;
+}
+
+static void bench_generate_guids(long iterations)
+{
+	char buffers[16][MS_SPEECH_GUID_SIZE];
+
+	counting = 1;
+	for (long i=0; i<iterations; i+=16)
+		sink += ms_speech_generate_guids(buffers[0], sizeof(buffers[0]), 16, 0);
+	counting = 0;
+}
+
+static void bench_get_timestamp(long iterations)
+{
+	char buffer[32];
+
+	counting = 1;
+	for (long i=0; i<iterations; i++)
+		sink += ms_speech_get_timestamp(buffer, sizeof(buffer));
+	counting = 0;
+}
+
+static void bench_strnstr(long iterations)
+{
+	size_t length = strlen(detailed_phrase_message);
+
+	counting = 1;
+	for (long i=0; i<iterations; i++)
+		sink += compat_strnstr(detailed_phrase_message, "\r\n\r\n", length) != NULL;
+	counting = 0;
+}
+
+static void bench_strcasecmp(long iterations)
+{
+	// paths compared while dispatching a speech.phrase response
+	static const char *paths[] = {
+		"speech.startDetected", "speech.endDetected", "speech.hypothesis",
+		"speech.fragment", "speech.phrase"
+	};
+
+	counting = 1;
+	for (long i=0; i<iterations; i++)
+		sink += compat_strcasecmp(paths[i % 5], "speech.phrase");
+	counting = 0;
+}
+
+static void bench_telemetry_record(long iterations)
+{
+	ms_speech_parsed_message_t parsed_message;
+	memset(&parsed_message, 0, sizeof(parsed_message));
+	parsed_message.path = "speech.hypothesis";
+
+	counting = 1;
+	for (long i=0; i<iterations; i++) {
+		if (i % BENCH_MESSAGES_PER_TURN == 0)
+			ms_speech_telemetry_reset(connection);
+		ms_speech_telemetry_handle_response_message(connection, &parsed_message);
+	}
+	counting = 0;
+}
+
+static void bench_telemetry_message(long iterations)
+{
+	ms_speech_parsed_message_t parsed_message;
+	memset(&parsed_message, 0, sizeof(parsed_message));
+
+	// a turn worth of received messages
+	ms_speech_telemetry_reset(connection);
+	ms_speech_telemetry_handle_stream_start_request(connection);
+	parsed_message.path = "turn.start";
+	ms_speech_telemetry_handle_response_message(connection, &parsed_message);
+	parsed_message.path = "speech.hypothesis";
+	for (int i=0; i<BENCH_MESSAGES_PER_TURN - 3; i++)
+		ms_speech_telemetry_handle_response_message(connection, &parsed_message);
+	parsed_message.path = "speech.phrase";
+	ms_speech_telemetry_handle_response_message(connection, &parsed_message);
+	parsed_message.path = "turn.end";
+	ms_speech_telemetry_handle_response_message(connection, &parsed_message);
+	ms_speech_telemetry_handle_stream_stop_request(connection, 0);
+
+	counting = 1;
+	for (long i=0; i<iterations; i++) {
+		ms_speech_message *message = ms_speech_create_new_message();
+		ms_speech_telemetry_set_message(connection, message);
+		sink += (int)message->body_length;
+		ms_speech_destroy_message(message);
+	}
+	counting = 0;
+}
+
+// connects and disconnects, servicing until the connection is released
+static int churn_connection(void)
+{
+	ms_speech_client_callbacks_t callbacks;
+	memset(&callbacks, 0, sizeof(callbacks));
+	unsigned long in_use = context->connection_slab.in_use;
+
+	ms_speech_connection_t churned = NULL;
+	if (!ms_speech_connect(context, BENCH_URI, &callbacks, &churned))
+		ms_speech_disconnect(churned);
+	for (int i=0; i<BENCH_CHURN_MAX_STEPS && context->connection_slab.in_use > in_use; i++)
+		ms_speech_service_step(context, 10);
+
+	return context->connection_slab.in_use > in_use ? -1 : 0;
+}
+
+static void bench_connection_churn(long iterations)
+{
+	counting = 1;
+	for (long i=0; i<iterations; i++)
+		sink += churn_connection();
+	counting = 0;
+}
+
+static const benchmark_t benchmarks[] = {
+	{ "serialize_message/audio", &bench_serialize_audio },
+	{ "serialize_message/speech.config", &bench_serialize_config },
+	{ "set_message_audio", &bench_set_message_audio },
+	{ "extract_headers", &bench_extract_headers },
+	{ "parse_payload/detailed_phrase", &bench_parse_payload },
+	{ "handle_response/hypothesis", &bench_handle_hypothesis },
+	{ "handle_response/detailed_phrase", &bench_handle_detailed_phrase },
+	{ "generate_guid", &bench_generate_guid },
+	{ "generate_guids/16", &bench_generate_guids },
+	{ "get_timestamp", &bench_get_timestamp },
+	{ "compat_strnstr", &bench_strnstr },
+	{ "compat_strcasecmp", &bench_strcasecmp },
+	{ "telemetry/record", &bench_telemetry_record },
+	{ "telemetry/set_message", &bench_telemetry_message },
+	{ "connection/churn", &bench_connection_churn },
+	{ NULL, NULL }
+};
+
+static int min_time_ms = 500;
+static const char *filter = NULL;
+static long leak_check_rounds = 0;
+static int low_memory = 0;
+
+static uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void run_benchmark(const benchmark_t *benchmark)
+{
+	// grow the batch until it runs long enough to time
+	long iterations = 1;
+	uint64_t elapsed;
+	for (;;) {
+		allocations = 0;
+		allocated_bytes = 0;
+		uint64_t started = monotonic_ns();
+		benchmark->run(iterations);
+		elapsed = monotonic_ns() - started;
+		if (elapsed >= (uint64_t)min_time_ms * 1000000 || iterations >= (1L << 40))
+			break;
+
+		long next = elapsed ? (long)((double)iterations * min_time_ms * 1100000 / elapsed) : iterations * 100;
+		if (next > iterations * 100)
+			next = iterations * 100;
+		iterations = next > iterations ? next : iterations + 1;
+	}
+
+	printf("%s\t%ld\t%.1f\t%.2f\t%.1f\n",
+		   benchmark->name,
+		   iterations,
+		   (double)elapsed / iterations,
+		   (double)allocations / iterations,
+		   (double)allocated_bytes / iterations);
+	fflush(stdout);
+}
+
+static int parse_opt(int argc, char **argv)
+{
+	int key;
+	while ((key = getopt(argc, argv, "t:f:l:L")) != -1) {
+		switch (key) {
+			case 't':
+				min_time_ms = atoi(optarg);
+				break;
+
+			case 'f':
+				filter = optarg;
+				break;
+
+			case 'l':
+				leak_check_rounds = atol(optarg);
+				break;
+
+			case 'L':
+				low_memory = 1;
+				break;
+
+			default:
+				return -1;
+		}
+	}
+
+	return min_time_ms > 0 && leak_check_rounds >= 0 ? 0 : -1;
+}
+
+static int run_leak_check(long rounds)
+{
+	// slabs and lws internals grow to their working size first
+	for (int i=0; i<BENCH_LEAK_WARMUP; i++)
+		churn_connection();
+	long baseline = live_bytes;
+
+	long failures = 0;
+	for (long i=0; i<rounds; i++)
+		failures += churn_connection() != 0;
+	long retained = live_bytes - baseline;
+
+	printf("leak check: %ld connections, %ld not released, %ld bytes retained\n", rounds, failures, retained);
+	return failures || retained > rounds * BENCH_LEAK_BYTES_PER_ROUND;
+}
+
+// the low profile has to fit a streaming connection in its own budget
+static int check_low_memory(void)
+{
+	const ms_speech_memory_profile_t *memory = &context->memory;
+	size_t streaming = ms_speech_connection_get_memory(connection) +
+		LWS_PRE + memory->rx_buffer_size +
+		context->streaming_slab.object_size +
+		memory->latency_audio_chunks * sizeof(ms_speech_latency_chunk_t) +
+		MS_SPEECH_MEMORY_TOKENIZER_SIZE + memory->json_max_depth * MS_SPEECH_MEMORY_TOKENIZER_DEPTH_SIZE;
+
+	fprintf(stderr, "streaming connection memory: %zu of %zu bytes\n", streaming, memory->connection_budget);
+	return streaming > memory->connection_budget;
+}
+
+static void usage()
+{
+	printf("Usage: msspeech-bench [OPTION...]\n");
+	printf("  -t MS\t\t\tMinimum run time of each benchmark. Default is 500.\n");
+	printf("  -f TEXT\t\tOnly run benchmarks whose name contains TEXT.\n");
+	printf("  -l NUM\t\tInstead of benchmarking, churn NUM connections and\n\t\t\tfail if heap memory is retained.\n");
+	printf("  -L\t\t\tUse the low memory profile.\n");
+
+	exit(1);
+}
+
+int main(int argc, char * argv[])
+{
+	if (parse_opt(argc, argv))
+		usage();
+
+	for (size_t i=0; i<sizeof(audio); i++)
+		audio[i] = (unsigned char)(i * 31);
+
+	// a connection that never leaves this process
+	ms_speech_client_callbacks_t callbacks;
+	memset(&callbacks, 0, sizeof(callbacks));
+	ms_speech_context_options_t options;
+	memset(&options, 0, sizeof(options));
+	if (low_memory) {
+		ms_speech_memory_profile_t profile = MS_SPEECH_MEMORY_PROFILE_LOW;
+		options.memory = profile;
+	}
+	context = ms_speech_create_context_ex(&options);
+	if (ms_speech_connect(context, BENCH_URI, &callbacks, &connection)) {
+		printf("Unable to create connection\n");
+		return 1;
+	}
+	ms_speech_connection_abort(connection);
+	fprintf(stderr, "connection memory: %zu bytes\n", ms_speech_connection_get_memory(connection));
+	if (low_memory && check_low_memory()) {
+		printf("Low memory profile does not fit a streaming connection\n");
+		return 1;
+	}
+
+	if (leak_check_rounds) {
+		int r = run_leak_check(leak_check_rounds);
+		ms_speech_disconnect(connection);
+		ms_speech_destroy_context(context);
+		return r;
+	}
+
+	printf("name\titerations\tns_per_op\tallocs_per_op\tbytes_per_op\n");
+	for (const benchmark_t *benchmark = benchmarks; benchmark->name; benchmark++) {
+		if (!filter || strstr(benchmark->name, filter))
+			run_benchmark(benchmark);
+	}
+
+	ms_speech_disconnect(connection);
+	ms_speech_destroy_context(context);
+
+	return 0;
+}
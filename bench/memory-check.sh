@@ -0,0 +1,7 @@
+#!/bin/sh
+# Run by make check. Churns connections against a closed local port, so no
+# server is needed, under the default and the low memory profile.
+set -e
+
+./msspeech-bench -l 2000
+./msspeech-bench -L -l 2000
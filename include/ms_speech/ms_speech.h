@@ -21,6 +21,7 @@ all copies or substantial portions of the Software.
 extern "C" {
 #endif
 
+#include <stdint.h>
 #include <json-c/json.h>
 
 #include "ms_speech/response_messages.h"
@@ -30,9 +31,14 @@ extern const char * ms_speech_version;
 
 struct ms_speech_context_st;
 struct ms_speech_connection_st;
+struct ms_speech_pool_st;
+struct ms_speech_endpoint_set_st;
 
 typedef struct ms_speech_context_st * ms_speech_context_t;
 typedef struct ms_speech_connection_st * ms_speech_connection_t;
+typedef struct ms_speech_pool_st * ms_speech_pool_t;
+typedef struct ms_speech_endpoint_set_st * ms_speech_endpoint_set_t;
+typedef struct ms_speech_json_writer_st * ms_speech_json_writer_t;
 
 /**
  * \typedef ms_speech_audio_stream_callback
@@ -53,6 +59,20 @@ typedef struct ms_speech_connection_st * ms_speech_connection_t;
  */
 typedef int (*ms_speech_audio_stream_callback)(ms_speech_connection_t connection, unsigned char *buffer, int buffer_len, void *stream_user_data);
 
+/**
+ * \brief Called to fetch a fresh authentication token.
+ *
+ * Called from a background thread owned by the context, it may block on
+ * network I/O without stalling the service loop.
+ *
+ * \param header buffer to fill with the <header>: <value> authentication header.
+ * \param max_len size of the header buffer.
+ * \param expires_in_ms set to the token lifetime in milliseconds.
+ * \param user_data user data given to ms_speech_context_set_token_provider().
+ * \return nonzero on failure, the fetch is then retried with backoff.
+ */
+typedef int (*ms_speech_token_fetch_callback)(char *header, size_t max_len, int *expires_in_ms, void *user_data);
+
 /** 
  * \typedef ms_speech_user_message_type
  * \brief Enumeration for message type in user callback.
@@ -62,6 +82,105 @@ typedef enum {
 	MS_SPEECH_MESSAGE_SPEECH_CONFIG
 } ms_speech_user_message_type;
 
+/**
+ * \typedef ms_speech_timeout_t
+ * \brief Enumeration of connection timeouts.
+ */
+typedef enum {
+	// connection was not established in time
+	MS_SPEECH_TIMEOUT_CONNECT,
+	// request was not acknowledged with turn.start in time
+	MS_SPEECH_TIMEOUT_SPEECH_CONFIG,
+	// no result arrived in time after the request started
+	MS_SPEECH_TIMEOUT_FIRST_RESULT,
+	// no result arrived in time after the previous one
+	MS_SPEECH_TIMEOUT_RESULT_GAP,
+	// request did not complete with turn.end in time
+	MS_SPEECH_TIMEOUT_TOTAL
+} ms_speech_timeout_t;
+
+/**
+ * \typedef ms_speech_phase_t
+ * \brief Enumeration of latency phases.
+ *
+ * Connect phases are measured from the start of the connect, request phases
+ * from the start of the request. Only the first occurrence of each phase is
+ * measured, except for STREAMING_BLOCKED which measures every pause and the
+ * LAG phases which measure every result.
+ */
+typedef enum {
+	// TCP connected
+	MS_SPEECH_PHASE_TCP_CONNECTED,
+	// TLS handshake done
+	MS_SPEECH_PHASE_TLS_DONE,
+	// websocket upgrade done
+	MS_SPEECH_PHASE_UPGRADE_DONE,
+	// speech.config sent
+	MS_SPEECH_PHASE_SPEECH_CONFIG_SENT,
+	// first audio chunk sent
+	MS_SPEECH_PHASE_FIRST_AUDIO_SENT,
+	// speech.startDetected received
+	MS_SPEECH_PHASE_START_DETECTED,
+	// first speech.hypothesis received
+	MS_SPEECH_PHASE_FIRST_HYPOTHESIS,
+	// speech.endDetected received
+	MS_SPEECH_PHASE_END_DETECTED,
+	// first speech.phrase received
+	MS_SPEECH_PHASE_FINAL_PHRASE,
+	// turn.end received
+	MS_SPEECH_PHASE_TURN_END,
+	// time spent waiting for audio after the stream callback returned -EAGAIN
+	MS_SPEECH_PHASE_STREAMING_BLOCKED,
+	// time from sending audio to receiving a hypothesis or fragment ending in it
+	MS_SPEECH_PHASE_HYPOTHESIS_LAG,
+	// time from sending audio to receiving a phrase ending in it
+	MS_SPEECH_PHASE_PHRASE_LAG,
+	MS_SPEECH_PHASE_COUNT
+} ms_speech_phase_t;
+
+/**
+ * \typedef ms_speech_latency_stats_t
+ * \brief Summary of a latency histogram.
+ */
+typedef struct {
+	// Number of samples.
+	unsigned long count;
+	double min_ms;
+	double mean_ms;
+	double p50_ms;
+	double p90_ms;
+	double p99_ms;
+	double max_ms;
+} ms_speech_latency_stats_t;
+
+/**
+ * \typedef ms_speech_capture_flags_t
+ * \brief Session capture options, bitwise ORed.
+ */
+typedef enum {
+	// Store audio frames without the audio, keeping their headers.
+	MS_SPEECH_CAPTURE_ELIDE_AUDIO = 0x1,
+	// Store a 64 bit hash of the audio instead of the audio.
+	MS_SPEECH_CAPTURE_HASH_AUDIO = 0x2
+} ms_speech_capture_flags_t;
+
+/**
+ * \typedef ms_speech_timeouts_t
+ * \brief Structure to define connection timeouts in milliseconds, 0 disables a timeout.
+ */
+typedef struct {
+	// From connection start, including name resolution, until established.
+	int connect_ms;
+	// From request start until the service acknowledges it with turn.start.
+	int speech_config_ms;
+	// From request start until the first hypothesis, fragment or phrase.
+	int first_result_ms;
+	// Between consecutive results of a request.
+	int result_gap_ms;
+	// From request start until turn.end.
+	int total_ms;
+} ms_speech_timeouts_t;
+
 /**
  * \typedef ms_speech_client_callbacks_t
  * \brief Structure to define user callbacks and their data.
@@ -108,6 +227,8 @@ typedef struct {
 	/**
 	 * \brief Called to provide authentication header.
 	 *
+	 * \remark Takes precedence over the context token provider.
+	 *
 	 * \param connection connection reference for this callback.
 	 * \param user_data user data.
 	 * \return a pointer to <header>: <value> authentication header. Value is copied.
@@ -190,8 +311,167 @@ typedef struct {
 	 * \param message log message.
 	 */
 	void (*log)(ms_speech_connection_t connection, void *user_data, ms_speech_log_level_t level, const char *message);
+	/**
+	 * \brief Called when a dropped connection is about to be reestablished.
+	 *
+	 * \remark Only called when a reconnect policy is set.
+	 *
+	 * \param connection connection reference for this callback.
+	 * \param attempt reconnect attempt number, starting at 1.
+	 * \param delay_ms delay before the attempt is made.
+	 * \param user_data user data.
+	 */
+	void (*connection_reconnecting)(ms_speech_connection_t connection, int attempt, int delay_ms, void *user_data);
+	/**
+	 * \brief Called when a connection timeout expires.
+	 *
+	 * The connection has been closed by the time this is called and no other
+	 * callback is called for it. It must still be cleaned up using
+	 * ms_speech_disconnect(). When NULL, connection_error is called instead.
+	 *
+	 * \param connection connection reference for this callback.
+	 * \param timeout timeout that expired.
+	 * \param user_data user data.
+	 */
+	void (*connection_timeout)(ms_speech_connection_t connection, ms_speech_timeout_t timeout, void *user_data);
+	/**
+	 * \brief Called to append content to outgoing messages.
+	 *
+	 * Same as message_overlay but members are written directly into the
+	 * outgoing frame with the ms_speech_json_* functions. The top level
+	 * object of the message is open and already holds the library members.
+	 * Cheaper than message_overlay, which builds a json_object tree. If
+	 * both are set, message_overlay is called first.
+	 *
+	 * \param connection connection reference for this callback.
+	 * \param type outgoing message type.
+	 * \param writer writer of the message body.
+	 * \param user_data user data.
+	 */
+	void (*message_overlay_writer)(ms_speech_connection_t connection, ms_speech_user_message_type type, ms_speech_json_writer_t writer, void *user_data);
+
+	// Key under which the speech.config built by the overlays above is
+	// cached in the context. Connections with the same key reuse it and the
+	// overlays are only called for the first of them. NULL builds it per
+	// connection when an overlay is set. Must outlive the connection.
+	const char *speech_config_key;
 } ms_speech_client_callbacks_t;
 
+/**
+ * \typedef ms_speech_reconnect_policy_t
+ * \brief Structure to define automatic reconnect behavior.
+ */
+typedef struct {
+	// Maximum number of consecutive reconnect attempts, 0 disables reconnects.
+	int max_attempts;
+	// Backoff before the first attempt in milliseconds, doubled on every attempt.
+	int initial_backoff_ms;
+	// Upper bound of the backoff in milliseconds.
+	int max_backoff_ms;
+	// Maximum number of audio bytes kept for replay, 0 for default.
+	size_t replay_buffer_size;
+	// Audio byte rate used if the stream has no RIFF header, 0 for 16kHz 16bit mono.
+	int audio_bytes_per_second;
+} ms_speech_reconnect_policy_t;
+
+/**
+ * \typedef ms_speech_tls_stats_t
+ * \brief TLS handshake counters of a context.
+ */
+typedef struct {
+	// Number of handshakes that negotiated a new session.
+	unsigned long full_handshakes;
+	// Number of handshakes that resumed a cached session.
+	unsigned long resumed_handshakes;
+	// Number of sessions currently cached.
+	unsigned long cached_sessions;
+} ms_speech_tls_stats_t;
+
+/**
+ * \typedef ms_speech_endpoint_stats_t
+ * \brief Health of an endpoint in an endpoint set.
+ */
+typedef struct {
+	// Endpoint URI.
+	const char *uri;
+	// Moving average of connect time in milliseconds.
+	double connect_time_ms;
+	// Moving average of time from request start to first result in milliseconds.
+	double first_result_ms;
+	// Moving average of connection failures, between 0 and 1.
+	double error_rate;
+	// Routing score, lower is preferred.
+	double score;
+	// Nonzero while the endpoint is ejected from routing.
+	int ejected;
+	// Number of connections routed to the endpoint.
+	unsigned long connections;
+	// Number of failed connects and dropped requests.
+	unsigned long failures;
+} ms_speech_endpoint_stats_t;
+
+/**
+ * \typedef ms_speech_memory_profile_t
+ * \brief Structure to define per connection memory use, zero initialize for defaults.
+ */
+typedef struct {
+	// Receive buffer of each connection in bytes, 0 for the default of 65536.
+	// Larger service messages are received in several fragments.
+	int rx_buffer_size;
+	// Size of the buffer handed to the audio stream callback in bytes, 0 for
+	// the default of 4096.
+	int stream_buffer_size;
+	// Maximum nesting depth of JSON service messages, 0 for the default of 32.
+	int json_max_depth;
+	// Bytes a connection may hold, 0 for no limit. Connections that do not fit
+	// are refused, telemetry stops recording and service messages fail the
+	// connection once they would exceed it.
+	size_t connection_budget;
+	// Send times of audio chunks kept to measure result lag, 0 for the default
+	// of 512, negative to not measure it. Kept only while a request streams.
+	int latency_audio_chunks;
+} ms_speech_memory_profile_t;
+
+/**
+ * \def MS_SPEECH_MEMORY_PROFILE_LOW
+ * \brief Memory profile for many mostly idle connections.
+ *
+ * 100ms of 16kHz 16 bit audio per stream callback, result lag measured over
+ * the last 6.4s of audio and a 32KB budget.
+ */
+#define MS_SPEECH_MEMORY_PROFILE_LOW { 4096, 3200, 16, 32768, 64 }
+
+/**
+ * \typedef ms_speech_context_options_t
+ * \brief Structure to define context options, zero initialize for defaults.
+ */
+typedef struct {
+	// NULL terminated list of service URIs whose hosts are resolved when the
+	// context is created, NULL for none.
+	const char * const *preresolve_uris;
+	// Time in milliseconds resolved addresses are cached, 0 for the default of 60s.
+	int dns_cache_ttl_ms;
+	// Delay in milliseconds before racing the next address or endpoint while
+	// a connect attempt is pending, 0 for the default of 250ms, negative to
+	// connect to one address at a time.
+	int connect_attempt_delay_ms;
+	// Maximum number of connect attempts in flight per connection, 0 for
+	// the default of 4.
+	int max_parallel_connects;
+	// Default timeouts of new connections.
+	ms_speech_timeouts_t timeouts;
+	// Maximum number of receive times kept per message path and turn for
+	// telemetry, 0 for the default of 256. Later messages are counted as
+	// dropped.
+	int telemetry_max_entries;
+	// Per connection buffer sizes and memory budget.
+	ms_speech_memory_profile_t memory;
+	// Nonzero to keep latency histograms per connection as well, for
+	// ms_speech_connection_get_latency(). Connections otherwise only record
+	// into the context histograms.
+	int connection_latency;
+} ms_speech_context_options_t;
+
 /**
  * \brief Create a new client context.
  *
@@ -205,6 +485,17 @@ typedef struct {
  * \return New client context.
  */
 ms_speech_context_t ms_speech_create_context();
+/**
+ * \brief Create a new client context with options.
+ *
+ * Same as ms_speech_create_context() but allows tuning of the context.
+ * Host names are resolved off the service thread and cached per context, so
+ * that new connections do not block streaming of existing ones.
+ *
+ * \param options context options, NULL for defaults.
+ * \return New client context.
+ */
+ms_speech_context_t ms_speech_create_context_ex(const ms_speech_context_options_t *options);
 /**
  * \brief Destroy client context.
  *
@@ -214,6 +505,104 @@ ms_speech_context_t ms_speech_create_context();
  * \param context client context.
  */
 void ms_speech_destroy_context(ms_speech_context_t context);
+/**
+ * \brief Get TLS handshake counters.
+ *
+ * Contexts cache TLS sessions per host and port, and offer them on new
+ * connections to the same endpoint to avoid full handshakes. Each cached
+ * session is offered to one connection only. Sessions are not offered while
+ * connections to different endpoints of the context are being set up.
+ *
+ * \param context client context.
+ * \param stats structure to be filled out with the counters.
+ */
+void ms_speech_context_get_tls_stats(ms_speech_context_t context, ms_speech_tls_stats_t *stats);
+/**
+ * \brief Capture websocket frames of all connections of a context to a file.
+ *
+ * Every frame sent or received is appended to path in a compact binary
+ * format starting with the magic "MSSPCAP1", documented in
+ * libmsspeech/ms_speech_capture.h. Records are buffered and written from a
+ * background thread. Connections capturing to their own file are not
+ * included.
+ *
+ * \param context client context.
+ * \param path capture file, appended to if it exists.
+ * \param flags bitwise ORed ms_speech_capture_flags_t.
+ * \return nonzero on failure.
+ */
+int ms_speech_context_start_capture(ms_speech_context_t context, const char *path, int flags);
+/**
+ * \brief Stop context capture and flush the capture file.
+ *
+ * \param context client context.
+ */
+void ms_speech_context_stop_capture(ms_speech_context_t context);
+/**
+ * \brief Render context metrics in Prometheus text exposition format.
+ *
+ * Counters are kept in per-thread shards and summed on read. The output is
+ * truncated to size like snprintf(), this method may be called from any
+ * thread.
+ *
+ * \param context client context.
+ * \param buffer buffer to receive the NUL terminated text, may be NULL if size is 0.
+ * \param size size of buffer.
+ * \return length of the full text, or negative errno on failure.
+ */
+int ms_speech_context_metrics_dump(ms_speech_context_t context, char *buffer, size_t size);
+/**
+ * \brief Get latency of a phase aggregated over all connections of the context.
+ *
+ * Latencies are kept in log-linear histograms with a relative error of at
+ * most 12.5%. This method may be called from any thread.
+ *
+ * \param context client context.
+ * \param phase latency phase.
+ * \param stats structure to be filled out with the latency summary.
+ * \return nonzero on failure.
+ */
+int ms_speech_context_get_latency(ms_speech_context_t context, ms_speech_phase_t phase, ms_speech_latency_stats_t *stats);
+/**
+ * \brief Resolve the host of a service URI ahead of time.
+ *
+ * Resolution happens in the background and the result is cached in the
+ * context to be used by subsequent connections.
+ *
+ * \param context client context.
+ * \param uri service URI.
+ * \return nonzero on failure.
+ */
+int ms_speech_context_preresolve(ms_speech_context_t context, const char *uri);
+/**
+ * \brief Share one authentication token between the connections of a context.
+ *
+ * The token is fetched on a background thread right away and again ahead
+ * of its expiry. Connections without a provide_authentication_header
+ * callback send the current token. They wait before connecting while there
+ * is no token yet or it has expired, and fail with connection_error when the
+ * next fetch fails. A failed fetch keeps an unexpired token in use.
+ *
+ * \param context client context.
+ * \param fetch token fetch callback.
+ * \param refresh_ahead_ms how long before expiry to refresh, 0 for the default of 60s.
+ * \param user_data user data passed to fetch.
+ * \return nonzero on failure.
+ */
+int ms_speech_context_set_token_provider(ms_speech_context_t context, ms_speech_token_fetch_callback fetch, int refresh_ahead_ms, void *user_data);
+/**
+ * \brief Register a precomputed speech.config payload.
+ *
+ * Connections whose speech_config_key matches send the payload as is and
+ * their overlays are not called for speech.config. Without an overlay, the
+ * default payload is built once per context and cached under the NULL key.
+ *
+ * \param context client context.
+ * \param key speech_config_key of the connections using the payload, or NULL.
+ * \param json serialized JSON object, or NULL to drop the cached payload.
+ * \return nonzero on failure.
+ */
+int ms_speech_context_set_speech_config(ms_speech_context_t context, const char *key, const char *json);
 
 /**
  * \brief Initiate a new connection to the service.
@@ -231,6 +620,22 @@ void ms_speech_destroy_context(ms_speech_context_t context);
  * \return nonzero on failure.
  */
 int ms_speech_connect(ms_speech_context_t context, const char *uri, ms_speech_client_callbacks_t *callbacks, ms_speech_connection_t *conn);
+/**
+ * \brief Initiate a new connection to any of several service endpoints.
+ *
+ * Same as ms_speech_connect() but connect attempts are raced across the
+ * resolved addresses of all the given URIs. Attempts are started staggered
+ * and the first to complete the websocket upgrade is kept, the others are
+ * dropped without calling any callbacks.
+ *
+ * \param context client context.
+ * \param uris service URIs, in order of preference.
+ * \param num_uris number of URIs.
+ * \param callbacks callbacks structure pointing to user callbacks.
+ * \param conn connection object to be filled out by method return.
+ * \return nonzero on failure.
+ */
+int ms_speech_connect_endpoints(ms_speech_context_t context, const char * const *uris, int num_uris, ms_speech_client_callbacks_t *callbacks, ms_speech_connection_t *conn);
 /**
  * \brief Disconnects and destroys the connection object.
  *
@@ -263,6 +668,10 @@ void ms_speech_service_cancel_step(ms_speech_context_t context);
  * Use this method to initiate audio streaming. The method will return immediately
  * and the provided callback method will be called whenever the client is ready to 
  * send more audio.
+ * A connection can serve multiple requests, one at a time. If called after all
+ * audio of the previous request has been sent, for example from the turn_end
+ * callback, the new request is queued and starts as soon as the previous turn
+ * has completed.
  * This method will fail if the client is not in the proper state.
  * 
  * \param connection connection object.
@@ -284,6 +693,263 @@ int ms_speech_start_stream(ms_speech_connection_t connection, ms_speech_audio_st
  * \return nonzero on failure.
  */
 int ms_speech_resume_stream(ms_speech_connection_t connection);
+/**
+ * \brief Enable automatic reconnect of dropped connections.
+ *
+ * When a connection drops while a request is in progress, it is reconnected
+ * with jittered exponential backoff. Audio sent since the last final result
+ * is kept in a bounded buffer and replayed under a new request ID once
+ * speech.config has been resent. Offsets of subsequent results are mapped back
+ * onto the timeline of the original request.
+ * connection_closed and connection_error are only called once all attempts
+ * have failed.
+ *
+ * \param connection connection object.
+ * \param policy reconnect policy, NULL to disable.
+ * \return nonzero on failure.
+ */
+int ms_speech_set_reconnect_policy(ms_speech_connection_t connection, const ms_speech_reconnect_policy_t *policy);
+/**
+ * \brief Get latency of a phase for a connection.
+ *
+ * Same as ms_speech_context_get_latency() for a single connection. Only
+ * available when the context was created with connection_latency set.
+ *
+ * \param connection connection object.
+ * \param phase latency phase.
+ * \param stats structure to be filled out with the latency summary.
+ * \return nonzero on failure.
+ */
+int ms_speech_connection_get_latency(ms_speech_connection_t connection, ms_speech_phase_t phase, ms_speech_latency_stats_t *stats);
+/**
+ * \brief Get the memory currently held by a connection.
+ *
+ * Sums the connection objects, receive and stream buffers, JSON tokenizer,
+ * partially received service message, telemetry and reconnect replay buffer.
+ * This is the figure the context's connection_budget is enforced against.
+ * Memory libwebsockets and TLS hold outside of the receive buffer is not
+ * included.
+ *
+ * \param connection connection object.
+ * \return bytes held by the connection.
+ */
+size_t ms_speech_connection_get_memory(ms_speech_connection_t connection);
+/**
+ * \brief Capture websocket frames of a connection to a file.
+ *
+ * Same as ms_speech_context_start_capture() for a single connection. The
+ * capture is stopped when the connection is cleaned up.
+ *
+ * \param connection connection object.
+ * \param path capture file, appended to if it exists.
+ * \param flags bitwise ORed ms_speech_capture_flags_t.
+ * \return nonzero on failure.
+ */
+int ms_speech_connection_start_capture(ms_speech_connection_t connection, const char *path, int flags);
+/**
+ * \brief Stop connection capture and flush the capture file.
+ *
+ * \param connection connection object.
+ */
+void ms_speech_connection_stop_capture(ms_speech_connection_t connection);
+/**
+ * \brief Set connection timeouts.
+ *
+ * Overrides the context default timeouts of the connection. When a timeout
+ * expires the connection is closed, connection_timeout, or connection_error
+ * when it is not set, is called and the connection must be cleaned up using
+ * ms_speech_disconnect().
+ * Timeouts are checked as part of ms_speech_service_step(), so their
+ * precision is bounded by the step timeout.
+ *
+ * \param connection connection object.
+ * \param timeouts timeouts, NULL to disable all.
+ * \return nonzero on failure.
+ */
+int ms_speech_set_timeouts(ms_speech_connection_t connection, const ms_speech_timeouts_t *timeouts);
+
+/**
+ * \brief Create a pool of pre-warmed connections.
+ *
+ * Use this method to keep a number of connections to the given URI established
+ * with speech.config already sent, so that they can be handed out ready to
+ * stream. The pool refills itself and sends keepalive pings on idle connections
+ * as part of ms_speech_service_step().
+ * Only the authentication, message overlay and log callbacks are used while
+ * connections are pooled.
+ * Pools must be destroyed by calling ms_speech_destroy_pool().
+ *
+ * \param context client context.
+ * \param uri service URI.
+ * \param callbacks callbacks used by pooled connections.
+ * \param size number of connections to keep warm.
+ * \return New pool, NULL on failure.
+ */
+ms_speech_pool_t ms_speech_create_pool(ms_speech_context_t context, const char *uri, ms_speech_client_callbacks_t *callbacks, int size);
+/**
+ * \brief Destroy a connection pool.
+ *
+ * Pooled connections that have not been acquired are disconnected.
+ * Acquired connections are not affected.
+ *
+ * \param pool connection pool.
+ */
+void ms_speech_destroy_pool(ms_speech_pool_t pool);
+/**
+ * \brief Acquire a connection from the pool.
+ *
+ * If a warm connection is available, it is handed out with the provided
+ * callbacks and client_ready is called before this method returns. Otherwise
+ * a new connection is initiated as in ms_speech_connect() and client_ready is
+ * called once it is ready.
+ * Acquired connections are owned by the caller and must be cleaned up using
+ * ms_speech_disconnect().
+ *
+ * \param pool connection pool.
+ * \param callbacks callbacks structure pointing to user callbacks.
+ * \param conn connection object to be filled out by method return.
+ * \return nonzero on failure.
+ */
+int ms_speech_pool_acquire(ms_speech_pool_t pool, ms_speech_client_callbacks_t *callbacks, ms_speech_connection_t *conn);
+/**
+ * \brief Get number of warm connections ready to be acquired.
+ *
+ * \param pool connection pool.
+ * \return number of ready connections.
+ */
+int ms_speech_pool_available(ms_speech_pool_t pool);
+/**
+ * \brief Set keepalive ping interval of idle pooled connections.
+ *
+ * \param pool connection pool.
+ * \param interval_ms ping interval in milliseconds, 0 to disable.
+ */
+void ms_speech_pool_set_keepalive(ms_speech_pool_t pool, int interval_ms);
+
+/**
+ * \brief Create a set of interchangeable service endpoints.
+ *
+ * Endpoint sets track the health of each endpoint as moving averages of
+ * connect time, time to first result and error rate. New connections are
+ * routed by picking two endpoints at random and using the one with the better
+ * score. Endpoints that fail repeatedly are ejected for an increasing amount
+ * of time.
+ * Endpoint sets must be destroyed by calling ms_speech_destroy_endpoint_set().
+ *
+ * \param context client context.
+ * \param uris service URIs.
+ * \param num_uris number of URIs.
+ * \return New endpoint set, NULL on failure.
+ */
+ms_speech_endpoint_set_t ms_speech_create_endpoint_set(ms_speech_context_t context, const char * const *uris, int num_uris);
+/**
+ * \brief Destroy an endpoint set.
+ *
+ * Connections made through the set are not affected.
+ *
+ * \param set endpoint set.
+ */
+void ms_speech_destroy_endpoint_set(ms_speech_endpoint_set_t set);
+/**
+ * \brief Initiate a new connection to the best endpoint of the set.
+ *
+ * Same as ms_speech_connect() with the URI picked by the set.
+ *
+ * \param set endpoint set.
+ * \param callbacks callbacks structure pointing to user callbacks.
+ * \param conn connection object to be filled out by method return.
+ * \return nonzero on failure.
+ */
+int ms_speech_endpoint_set_connect(ms_speech_endpoint_set_t set, ms_speech_client_callbacks_t *callbacks, ms_speech_connection_t *conn);
+/**
+ * \brief Get health of an endpoint in the set.
+ *
+ * \param set endpoint set.
+ * \param index endpoint index, in the order given at creation.
+ * \param stats structure to be filled out with the endpoint health.
+ * \return nonzero on failure.
+ */
+int ms_speech_endpoint_set_get_stats(ms_speech_endpoint_set_t set, int index, ms_speech_endpoint_stats_t *stats);
+/**
+ * \brief Open a JSON object in a message writer.
+ *
+ * Writers are handed out by message_overlay_writer and only valid during
+ * that call. All ms_speech_json_* functions append to the message body,
+ * escape strings, and insert separators. Once a call fails, the writer
+ * stays failed and the message is not sent.
+ *
+ * \param writer message writer.
+ * \return nonzero on failure.
+ */
+int ms_speech_json_begin_object(ms_speech_json_writer_t writer);
+/**
+ * \brief Close the innermost JSON object of a message writer.
+ *
+ * \param writer message writer.
+ * \return nonzero on failure.
+ */
+int ms_speech_json_end_object(ms_speech_json_writer_t writer);
+/**
+ * \brief Open a JSON array in a message writer.
+ *
+ * \param writer message writer.
+ * \return nonzero on failure.
+ */
+int ms_speech_json_begin_array(ms_speech_json_writer_t writer);
+/**
+ * \brief Close the innermost JSON array of a message writer.
+ *
+ * \param writer message writer.
+ * \return nonzero on failure.
+ */
+int ms_speech_json_end_array(ms_speech_json_writer_t writer);
+/**
+ * \brief Write the key of the next object member.
+ *
+ * \param writer message writer.
+ * \param key member name.
+ * \return nonzero on failure.
+ */
+int ms_speech_json_key(ms_speech_json_writer_t writer, const char *key);
+/**
+ * \brief Write a string value.
+ *
+ * \param writer message writer.
+ * \param value UTF-8 string, NULL writes null.
+ * \return nonzero on failure.
+ */
+int ms_speech_json_string(ms_speech_json_writer_t writer, const char *value);
+/**
+ * \brief Write an integer value.
+ *
+ * \param writer message writer.
+ * \param value value.
+ * \return nonzero on failure.
+ */
+int ms_speech_json_int(ms_speech_json_writer_t writer, int64_t value);
+/**
+ * \brief Write a floating point value.
+ *
+ * \param writer message writer.
+ * \param value value, written as null when not finite.
+ * \return nonzero on failure.
+ */
+int ms_speech_json_double(ms_speech_json_writer_t writer, double value);
+/**
+ * \brief Write a boolean value.
+ *
+ * \param writer message writer.
+ * \param value value.
+ * \return nonzero on failure.
+ */
+int ms_speech_json_bool(ms_speech_json_writer_t writer, int value);
+/**
+ * \brief Write a null value.
+ *
+ * \param writer message writer.
+ * \return nonzero on failure.
+ */
+int ms_speech_json_null(ms_speech_json_writer_t writer);
 
 #ifdef __cplusplus
 }
@@ -21,6 +21,7 @@ all copies or substantial portions of the Software.
 extern "C" {
 #endif
 
+#include <stdint.h>
 #include <libwebsockets.h>
 
 /**
@@ -50,6 +51,30 @@ typedef enum {
  */
 typedef void (*ms_speech_global_log_t)(ms_speech_log_level_t level, const char *message);
 
+/**
+ * \typedef ms_speech_log_record_t
+ * \brief A log message queued for asynchronous delivery.
+ */
+typedef struct {
+	// Wall clock time the message was logged, in microseconds since the epoch.
+	uint64_t timestamp_us;
+	// Message log level.
+	ms_speech_log_level_t level;
+	// Connection ID, empty if the message is not about a connection.
+	const char *connection_id;
+	// Log message.
+	const char *message;
+} ms_speech_log_record_t;
+
+/**
+ * \typedef ms_speech_batch_log_t
+ * \brief Callback definition for asynchronous logging.
+ *
+ * \param records log records, only valid for the duration of the call.
+ * \param num_records number of records.
+ */
+typedef void (*ms_speech_batch_log_t)(const ms_speech_log_record_t *records, int num_records);
+
 /**
  * \brief Set logging callback.
  *
@@ -57,6 +82,27 @@ typedef void (*ms_speech_global_log_t)(ms_speech_log_level_t level, const char *
  * \param callback loging callback.
  */
 void ms_speech_set_logging(int levels, ms_speech_global_log_t callback);
+/**
+ * \brief Deliver log messages from a background thread.
+ *
+ * Messages are formatted into a lock-free ring owned by the logging thread
+ * and handed to callback in batches by a flusher thread, so logging never
+ * blocks the caller. When a ring is full its oldest messages are dropped.
+ * Messages of connections with their own log callback are still delivered
+ * synchronously.
+ *
+ * \param levels requested log levels, bitwise ORed.
+ * \param callback batch logging callback, NULL to stop asynchronous logging.
+ * \param ring_size number of messages buffered per thread, 0 for default.
+ * \return nonzero on failure.
+ */
+int ms_speech_set_async_logging(int levels, ms_speech_batch_log_t callback, int ring_size);
+/**
+ * \brief Get number of asynchronous log messages dropped on full rings.
+ *
+ * \return dropped message count.
+ */
+unsigned long ms_speech_get_dropped_log_count(void);
 
 #ifdef __cplusplus
 }
@@ -147,6 +147,8 @@ typedef struct
 	const char *text;
 	// Text timing information.
 	ms_speech_phrase_timing_t time;
+	// Milliseconds since the audio at the end of the text was sent, NAN if unknown.
+	double result_latency_ms;
 } ms_speech_hypothesis_message_t;
 
 /**
@@ -161,6 +163,8 @@ typedef struct
 	const char *text;
 	// Text timing information.
 	ms_speech_phrase_timing_t time;
+	// Milliseconds since the audio at the end of the text was sent, NAN if unknown.
+	double result_latency_ms;
 } ms_speech_fragment_message_t;
 
 /**
@@ -201,6 +205,8 @@ typedef struct
 	// Number of nbest results.
 	int num_phrase_results;
 	ms_speech_phrase_result_t *phrase_results;
+	// Milliseconds since the audio at the end of the phrase was sent, NAN if unknown.
+	double result_latency_ms;
 } ms_speech_result_message_t;
 
 #ifdef __cplusplus
@@ -21,13 +21,13 @@ all copies or substantial portions of the Software.
 #include <errno.h>
 
 #include "ms_speech_priv.h"
+#include "client_messages.h"
 #include "ms_speech/ms_speech_logging.h"
 #include "response_messages_priv.h"
 #include "message_constants.h"
 #include "ms_speech_timestamp.h"
 #include "ms_speech_guid.h"
-
-static const int ms_speech_maximum_header_size = 512;
+#include "ms_speech_config_cache.h"
 
 ms_speech_message *ms_speech_create_new_message()
 {
@@ -41,80 +41,158 @@ void ms_speech_destroy_message(ms_speech_message *message)
 {
 	if (message->body)
 		free(message->body);
+	if (message->frame)
+		free(message->frame);
 
 	free(message);
 }
 
-void ms_speech_set_message_time(ms_speech_message *message)
+void ms_speech_set_message_time(ms_speech_message *message, uint64_t epoch_us)
 {
-	ms_speech_get_timestamp(message->request_time, sizeof(message->request_time));
+	ms_speech_format_timestamp(epoch_us, message->request_time, sizeof(message->request_time));
 }
 
 void ms_speech_set_message_body(ms_speech_message *message, const unsigned char *body, size_t body_length)
 {
+	free(message->body);
 	message->body = (char *)malloc(body_length);
 	memcpy(message->body, body, body_length);
 	message->body_length = body_length;
 }
 
+void ms_speech_begin_message_json(ms_speech_message *message, ms_speech_json_writer_t writer, size_t size_hint)
+{
+	ms_speech_json_writer_initialize(writer, MS_SPEECH_MESSAGE_HEADROOM, size_hint);
+}
+
+void ms_speech_set_message_frame_body(ms_speech_message *message, const char *body, size_t body_length)
+{
+	free(message->frame);
+	message->frame = (char *)malloc(MS_SPEECH_MESSAGE_HEADROOM + body_length);
+	memcpy(message->frame + MS_SPEECH_MESSAGE_HEADROOM, body, body_length);
+	message->body_in_frame = 1;
+	message->body_length = body_length;
+}
+
+int ms_speech_end_message_json(ms_speech_message *message, ms_speech_json_writer_t writer)
+{
+	if (writer->failed || writer->depth) {
+		ms_speech_json_writer_destroy(writer);
+		return -EINVAL;
+	}
+
+	// the message takes over the writer buffer
+	free(message->frame);
+	message->frame = writer->buffer;
+	message->body_in_frame = 1;
+	message->body_length = writer->length - writer->headroom;
+	writer->buffer = NULL;
+
+	return 0;
+}
+
 int ms_speech_serialize_message(ms_speech_message *message, char **buffer)
 {
 	*buffer = NULL;
-	char *b = (char *)malloc(sizeof(unsigned short) +
-							 message->body_length +
-							 ms_speech_maximum_header_size +
-							 LWS_PRE);
-	char *buffer_start = b + LWS_PRE;
-	char *p = buffer_start;
-	if (message->binary)
-		p += sizeof(unsigned short);
+	char headers[MS_SPEECH_MESSAGE_MAX_HEADER_SIZE];
+	int headers_length;
 	
 	// required headers
 	if (strlen(message->request_id)) {
-		sprintf(p,
-				"%s: %s\r\n"
-				"%s: %s\r\n"
-				"%s: %s\r\n"
-				"%s: %s\r\n",
-				MS_SPEECH_PATH_HEADER, message->path,
-				MS_SPEECH_TIMESTAMP_HEADER, message->request_time,
-				MS_SPEECH_REQUEST_ID_HEADER, message->request_id,
-				MS_SPEECH_CONTENT_TYPE_HEADER, message->content_type);
+		headers_length = snprintf(headers,
+								  sizeof(headers),
+								  "%s: %s\r\n"
+								  "%s: %s\r\n"
+								  "%s: %s\r\n"
+								  "%s: %s\r\n"
+								  "\r\n",
+								  MS_SPEECH_PATH_HEADER, message->path,
+								  MS_SPEECH_TIMESTAMP_HEADER, message->request_time,
+								  MS_SPEECH_REQUEST_ID_HEADER, message->request_id,
+								  MS_SPEECH_CONTENT_TYPE_HEADER, message->content_type);
 	}
 	else {
-		sprintf(p,
-				"%s: %s\r\n"
-				"%s: %s\r\n"
-				"%s: %s\r\n",
-				MS_SPEECH_PATH_HEADER, message->path,
-				MS_SPEECH_TIMESTAMP_HEADER, message->request_time,
-				MS_SPEECH_CONTENT_TYPE_HEADER, message->content_type);
+		headers_length = snprintf(headers,
+								  sizeof(headers),
+								  "%s: %s\r\n"
+								  "%s: %s\r\n"
+								  "%s: %s\r\n"
+								  "\r\n",
+								  MS_SPEECH_PATH_HEADER, message->path,
+								  MS_SPEECH_TIMESTAMP_HEADER, message->request_time,
+								  MS_SPEECH_CONTENT_TYPE_HEADER, message->content_type);
 	}
-	// finalize
-	strcat(p, "\r\n");
-	
-	unsigned short headers_length = strlen(p);
-	p += headers_length;
-	memcpy(p, message->body, message->body_length);
+	if (headers_length < 0 || headers_length >= (int)sizeof(headers))
+		return -EMSGSIZE;
 
-	size_t total_length =
-	headers_length +
-	message->body_length;
-	
+	size_t prefix_length = headers_length;
+	if (message->binary)
+		prefix_length += sizeof(unsigned short);
+
+	char *body;
+	if (message->body_in_frame) {
+		// headers go right in front of the body in the headroom
+		body = message->frame + MS_SPEECH_MESSAGE_HEADROOM;
+	} else {
+		free(message->frame);
+		message->frame = (char *)malloc(LWS_PRE + prefix_length + message->body_length);
+		body = message->frame + LWS_PRE + prefix_length;
+		memcpy(body, message->body, message->body_length);
+	}
+
+	char *start = body - prefix_length;
+	char *p = start;
 	if (message->binary) {
 		// prepend header size
 		unsigned short bit_headers_length = htons(headers_length);
-		memcpy(buffer_start, &bit_headers_length, sizeof(unsigned short));
-		total_length += sizeof(unsigned short);
+		memcpy(p, &bit_headers_length, sizeof(unsigned short));
+		p += sizeof(unsigned short);
 	}
+	memcpy(p, headers, headers_length);
 	
-	*buffer = buffer_start;
+	*buffer = start;
 	
-	return (int)total_length;
+	return (int)(prefix_length + message->body_length);
 }
 
-int ms_speech_set_message_speech_config(ms_speech_connection_t connection, ms_speech_message *message)
+static int ms_speech_write_speech_config(ms_speech_connection_t connection, ms_speech_json_writer_t writer)
+{
+	struct utsname name;
+	if (uname(&name))
+		return errno;
+
+	ms_speech_json_key(writer, "system");
+	ms_speech_json_begin_object(writer);
+	ms_speech_json_key(writer, "version");
+	ms_speech_json_string(writer, ms_speech_version);
+	ms_speech_json_end_object(writer);
+
+	ms_speech_json_key(writer, "os");
+	ms_speech_json_begin_object(writer);
+	ms_speech_json_key(writer, "platform");
+	ms_speech_json_string(writer, name.sysname);
+	ms_speech_json_key(writer, "name");
+	ms_speech_json_string(writer, name.version);
+	ms_speech_json_key(writer, "version");
+	ms_speech_json_string(writer, name.release);
+	ms_speech_json_end_object(writer);
+
+	ms_speech_json_key(writer, "device");
+	ms_speech_json_begin_object(writer);
+	ms_speech_json_key(writer, "manufacturer");
+	ms_speech_json_string(writer, "");
+	ms_speech_json_key(writer, "model");
+	ms_speech_json_string(writer, "");
+	ms_speech_json_key(writer, "version");
+	ms_speech_json_string(writer, "");
+	ms_speech_json_end_object(writer);
+
+	return 0;
+}
+
+static int ms_speech_write_speech_config_overlay(ms_speech_connection_t connection, ms_speech_json_writer_t writer)
 {
+	// the overlay edits a json_object tree, which is then reopened
 	json_object *context = json_object_new_object();
 
 	{
@@ -126,8 +204,10 @@ int ms_speech_set_message_speech_config(ms_speech_connection_t connection, ms_sp
 	
 	{
 		struct utsname name;
-		if (uname(&name))
+		if (uname(&name)) {
+			json_object_put(context);
 			return errno;
+		}
 		
 		json_object *os = json_object_new_object();
 		json_object_object_add(os, "platform", json_object_new_string(name.sysname));
@@ -146,17 +226,60 @@ int ms_speech_set_message_speech_config(ms_speech_connection_t connection, ms_sp
 		json_object_object_add(context, "device", device);
 	}
 	
-	if (connection->callbacks->message_overlay)
-		connection->callbacks->message_overlay(connection, MS_SPEECH_MESSAGE_SPEECH_CONFIG, context, connection->callbacks->user_data);
+	connection->callbacks->message_overlay(connection, MS_SPEECH_MESSAGE_SPEECH_CONFIG, context, connection->callbacks->user_data);
 	
+	const char * json_string = json_object_to_json_string_ext(context, JSON_C_TO_STRING_PLAIN);
+	int r = ms_speech_json_resume_object(writer, json_string, strlen(json_string));
+	json_object_put(context);
+	
+	return r;
+}
+
+int ms_speech_set_message_speech_config(ms_speech_connection_t connection, ms_speech_message *message)
+{
+	ms_speech_client_callbacks_t *callbacks = connection->callbacks;
+	const char *key = callbacks->speech_config_key;
+
 	message->path = MS_SPEECH_MESSAGE_PATH_SPEECH_CONFIG;
 	message->binary = 0;
 	message->content_type = MS_SPEECH_MESSAGE_CONTENT_TYPE_JSON;
-	const char * json_string = json_object_to_json_string_ext(context, JSON_C_TO_STRING_PLAIN);
-	ms_speech_set_message_body(message,
-							   (const unsigned char *)json_string,
-							   strlen(json_string));
+
+	// overlays may depend on the connection unless the caller keyed them
+	int cacheable = key || (!callbacks->message_overlay && !callbacks->message_overlay_writer);
+
+	// frames are masked in place when sent so the cached body is copied
+	const struct ms_speech_config_cache_st *cached = ms_speech_config_cache_find(connection->context, key);
+	if (cached && (cacheable || cached->registered)) {
+		ms_speech_set_message_frame_body(message, cached->body, cached->body_length);
+		return 0;
+	}
+
+	struct ms_speech_json_writer_st writer;
+	int r;
+
+	ms_speech_begin_message_json(message, &writer, 0);
+	if (callbacks->message_overlay) {
+		r = ms_speech_write_speech_config_overlay(connection, &writer);
+	} else {
+		ms_speech_json_begin_object(&writer);
+		r = ms_speech_write_speech_config(connection, &writer);
+	}
+	if (r) {
+		ms_speech_json_writer_destroy(&writer);
+		return r;
+	}
 	
+	if (callbacks->message_overlay_writer)
+		callbacks->message_overlay_writer(connection, MS_SPEECH_MESSAGE_SPEECH_CONFIG, &writer, callbacks->user_data);
+	ms_speech_json_end_object(&writer);
+	
+	r = ms_speech_end_message_json(message, &writer);
+	if (r)
+		return r;
+
+	if (cacheable)
+		ms_speech_config_cache_store(connection->context, key, message->frame + MS_SPEECH_MESSAGE_HEADROOM, message->body_length, 0);
+
 	return 0;
 }
 
@@ -17,11 +17,21 @@ all copies or substantial portions of the Software.
 #ifndef client_messages_h
 #define client_messages_h
 
+#include "ms_speech_priv.h"
+#include "ms_speech_json_writer.h"
+
+#define MS_SPEECH_MESSAGE_MAX_HEADER_SIZE 512
+// room for the frame prefix and headers in front of bodies written in place
+#define MS_SPEECH_MESSAGE_HEADROOM (LWS_PRE + sizeof(unsigned short) + MS_SPEECH_MESSAGE_MAX_HEADER_SIZE)
+
 ms_speech_message *ms_speech_create_new_message();
 
 void ms_speech_destroy_message(ms_speech_message *message);
-void ms_speech_set_message_time(ms_speech_message *message);
+void ms_speech_set_message_time(ms_speech_message *message, uint64_t epoch_us);
 void ms_speech_set_message_body(ms_speech_message *message, const unsigned char *body, size_t body_length);
+void ms_speech_set_message_frame_body(ms_speech_message *message, const char *body, size_t body_length);
+void ms_speech_begin_message_json(ms_speech_message *message, ms_speech_json_writer_t writer, size_t size_hint);
+int ms_speech_end_message_json(ms_speech_message *message, ms_speech_json_writer_t writer);
 
 int ms_speech_set_message_speech_config(ms_speech_connection_t connection, ms_speech_message *message);
 int ms_speech_set_message_audio(ms_speech_connection_t connection, ms_speech_message *message, const unsigned char *audio_buffer, int len);
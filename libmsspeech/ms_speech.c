@@ -24,6 +24,20 @@ all copies or substantial portions of the Software.
 #include "ms_speech_logging_priv.h"
 #include "ms_speech_status_control.h"
 #include "ms_speech_telemetry.h"
+#include "ms_speech_pool.h"
+#include "ms_speech_reconnect.h"
+#include "ms_speech_tls.h"
+#include "ms_speech_resolver.h"
+#include "ms_speech_token.h"
+#include "ms_speech_race.h"
+#include "ms_speech_endpoint_set.h"
+#include "ms_speech_timeouts.h"
+#include "ms_speech_latency.h"
+#include "ms_speech_metrics.h"
+#include "ms_speech_capture.h"
+#include "ms_speech_config_cache.h"
+#include "ms_speech_timestamp.h"
+#include "ms_speech_memory.h"
 
 const char * ms_speech_version = "0.0.3";
 
@@ -36,6 +50,9 @@ static int write_message(ms_speech_connection_t connection, ms_speech_message *
 static int ms_speech_handle_speech_config(ms_speech_connection_t connection, ms_speech_message *message);
 static int ms_speech_handle_streaming(ms_speech_connection_t connection, ms_speech_message *message);
 static int ms_speech_handle_telemetry(ms_speech_connection_t connection, ms_speech_message *message);
+static void ms_speech_begin_request(ms_speech_connection_t connection);
+static void ms_speech_release_connection(ms_speech_connection_t connection);
+static void ms_speech_discard_connection(ms_speech_connection_t connection);
 
 static const struct lws_protocols protocols[] = {
 	{
@@ -62,13 +79,21 @@ static const struct lws_extension exts[] = {
 };
 
 ms_speech_context_t ms_speech_create_context()
+{
+	return ms_speech_create_context_ex(NULL);
+}
+
+ms_speech_context_t ms_speech_create_context_ex(const ms_speech_context_options_t *options)
 {
 	ms_speech_context_t context = (ms_speech_context_t)malloc(sizeof(struct ms_speech_context_st));
 
 	memset(context, 0, sizeof(struct ms_speech_context_st));
+	ms_speech_memory_initialize(context, options ? &options->memory : NULL);
+	memcpy(context->protocols, protocols, sizeof(protocols));
+	context->protocols[0].rx_buffer_size = context->memory.rx_buffer_size;
 	context->info.port = CONTEXT_PORT_NO_LISTEN;
 	context->info.iface = NULL;
-	context->info.protocols = protocols;
+	context->info.protocols = context->protocols;
 	context->info.ssl_cert_filepath = NULL;
 	context->info.ssl_private_key_filepath = NULL;
 	context->info.extensions = exts;
@@ -76,40 +101,73 @@ ms_speech_context_t ms_speech_create_context()
 	context->info.uid = -1;
 	context->info.count_threads = 1;
 	context->info.options = LWS_SERVER_OPTION_DO_SSL_GLOBAL_INIT;
+	context->info.user = context;
 	context->context = lws_create_context(&context->info);
 
+	ms_speech_slab_initialize(&context->connection_slab, "connection", sizeof(struct ms_speech_connection_st), MS_SPEECH_CONNECTION_SLAB_CHUNK);
+	ms_speech_slab_initialize(&context->callbacks_slab, "callbacks", sizeof(ms_speech_client_callbacks_t), MS_SPEECH_CALLBACKS_SLAB_CHUNK);
+	ms_speech_slab_initialize(&context->streaming_slab, "streaming", sizeof(ms_speech_streaming_info_t) + context->memory.stream_buffer_size, MS_SPEECH_STREAMING_SLAB_CHUNK);
+	ms_speech_slab_initialize(&context->telemetry_slab, "telemetry", sizeof(ms_speech_telemetry_t), MS_SPEECH_TELEMETRY_SLAB_CHUNK);
+	ms_speech_resolver_initialize(context, options ? options->dns_cache_ttl_ms : 0);
+	ms_speech_timer_wheel_initialize(&context->timers);
+	ms_speech_latency_initialize_context(context);
+	ms_speech_metrics_initialize(context);
+	if (options)
+		context->timeouts = options->timeouts;
+	context->connect_attempt_delay_ms = MS_SPEECH_RACE_DEFAULT_DELAY_MS;
+	context->connect_max_parallel = MS_SPEECH_RACE_DEFAULT_PARALLEL;
+	if (options && options->connect_attempt_delay_ms)
+		context->connect_attempt_delay_ms = options->connect_attempt_delay_ms;
+	if (options && options->max_parallel_connects > 0)
+		context->connect_max_parallel = options->max_parallel_connects;
+	context->telemetry_max_entries = MS_SPEECH_TELEMETRY_DEFAULT_MAX_ENTRIES;
+	if (options && options->telemetry_max_entries > 0)
+		context->telemetry_max_entries = options->telemetry_max_entries;
+	if (options)
+		context->connection_latency = options->connection_latency;
+	if (options && options->preresolve_uris) {
+		for (const char * const *uri = options->preresolve_uris; *uri; uri++) {
+			if (ms_speech_context_preresolve(context, *uri))
+				ms_speech_log(MS_SPEECH_LOG_WARN,
+							  "Unable to pre-resolve %s",
+							  *uri);
+		}
+	}
+
 	return context;
 }
 
 void ms_speech_destroy_context(ms_speech_context_t context)
 {
+	while (context->pools)
+		ms_speech_destroy_pool(context->pools);
+
+	ms_speech_resolver_destroy(context);
+	ms_speech_token_destroy(context);
 	lws_context_destroy(context->context);
+	ms_speech_context_stop_capture(context);
+	ms_speech_tls_destroy(context);
+	ms_speech_latency_destroy_context(context);
+	ms_speech_metrics_destroy(context);
+	ms_speech_config_cache_destroy(context);
+	ms_speech_release_retired(context);
+	ms_speech_slab_destroy(&context->connection_slab);
+	ms_speech_slab_destroy(&context->callbacks_slab);
+	ms_speech_slab_destroy(&context->streaming_slab);
+	ms_speech_slab_destroy(&context->telemetry_slab);
 	free(context);
 }
 
-int ms_speech_connect(ms_speech_context_t context, const char *uri, ms_speech_client_callbacks_t *callbacks, ms_speech_connection_t *conn)
+static int ms_speech_parse_endpoint(ms_speech_connection_t connection, const char *uri, ms_speech_endpoint_t *endpoint)
 {
-	*conn = NULL;
-
-	ms_speech_connection_t connection = (ms_speech_connection_t)malloc(sizeof(struct ms_speech_connection_st));
-	memset(connection, 0, sizeof(struct ms_speech_connection_st));
-	connection->callbacks = (ms_speech_client_callbacks_t *)malloc(sizeof(ms_speech_client_callbacks_t));
-	memcpy(connection->callbacks, callbacks, sizeof(ms_speech_client_callbacks_t));
-	connection->context = context;
-	
-	connection->uri = strdup(uri);
-	
-	struct lws_client_connect_info i;
-	memset(&i, 0, sizeof(i));
-
-	ms_speech_telemetry_initialize(connection);
+	endpoint->uri = strdup(uri);
 	
 	const char *prot;
 	const char *path;
-	if (lws_parse_uri(connection->uri,
+	if (lws_parse_uri(endpoint->uri,
 					  &prot,
-					  &i.address,
-					  &i.port,
+					  &endpoint->address,
+					  &endpoint->port,
 					  &path))
 		return -EINVAL;
 	
@@ -117,54 +175,293 @@ int ms_speech_connect(ms_speech_context_t context, const char *uri, ms_speech_cl
 		return -EINVAL;
 	
 	size_t uri_length = strlen(uri);
-	connection->path = (char *)malloc(uri_length);
-	strcpy(connection->path, path);
+	endpoint->path = (char *)malloc(uri_length);
+	strcpy(endpoint->path, path);
 	
 	/* add back the leading / on path */
-	connection->path[0] = '/';
-	strncpy(connection->path + 1, path, uri_length - 1);
-	i.path = connection->path;
+	endpoint->path[0] = '/';
+	strncpy(endpoint->path + 1, path, uri_length - 1);
 	
 	if (!strcasecmp(prot, "wss"))
-		i.ssl_connection = LCCSCF_USE_SSL;
+		endpoint->ssl_connection = LCCSCF_USE_SSL;
 	ms_speech_connection_log(connection,
 							 MS_SPEECH_LOG_DEBUG,
 							 "URI parsed: proto: %s, address: %s, port: %d, path: %s, ssl: %d",
 							 prot,
-							 i.address,
-							 i.port,
-							 i.path,
-							 i.ssl_connection);
-	
-	i.context = context->context;
-	i.host = i.address;
-	i.origin = i.address;
-	i.ietf_version_or_minus_one = -1;
-	i.userdata = connection;
-	connection->wsi = lws_client_connect_via_info(&i);
+							 endpoint->address,
+							 endpoint->port,
+							 endpoint->path,
+							 endpoint->ssl_connection);
+	
+	return 0;
+}
 
-	ms_speech_set_connection_status(connection, MS_SPEECH_CLIENT_CONNECTING);
+int ms_speech_connect(ms_speech_context_t context, const char *uri, ms_speech_client_callbacks_t *callbacks, ms_speech_connection_t *conn)
+{
+	return ms_speech_connect_endpoints(context, &uri, 1, callbacks, conn);
+}
+
+int ms_speech_connect_endpoints(ms_speech_context_t context, const char * const *uris, int num_uris, ms_speech_client_callbacks_t *callbacks, ms_speech_connection_t *conn)
+{
+	*conn = NULL;
+
+	if (num_uris < 1)
+		return -EINVAL;
+
+	ms_speech_connection_t connection = (ms_speech_connection_t)ms_speech_slab_alloc(&context->connection_slab);
+	if (!connection)
+		return -ENOMEM;
+	connection->context = context;
+	connection->callbacks = (ms_speech_client_callbacks_t *)ms_speech_slab_alloc(&context->callbacks_slab);
+	connection->endpoints = (ms_speech_endpoint_t *)calloc(num_uris, sizeof(ms_speech_endpoint_t));
+	if (!connection->callbacks || !connection->endpoints) {
+		ms_speech_discard_connection(connection);
+		return -ENOMEM;
+	}
+	memcpy(connection->callbacks, callbacks, sizeof(ms_speech_client_callbacks_t));
+	
+	connection->num_endpoints = num_uris;
+	for (int i=0; i<num_uris; i++) {
+		if (ms_speech_parse_endpoint(connection, uris[i], &connection->endpoints[i])) {
+			ms_speech_discard_connection(connection);
+			return -EINVAL;
+		}
+	}
+	ms_speech_select_endpoint(connection, 0);
+	
+	if (ms_speech_telemetry_initialize(connection) || ms_speech_latency_initialize(connection)) {
+		ms_speech_discard_connection(connection);
+		return -ENOMEM;
+	}
+	ms_speech_timeouts_initialize(connection);
+	
 	connection->status = MS_SPEECH_CLIENT_NONE;
+	ms_speech_metrics_handle_connection_created(connection);
+	if (ms_speech_memory_reserve(connection, LWS_PRE + context->memory.rx_buffer_size)) {
+		ms_speech_connection_log(connection,
+								 MS_SPEECH_LOG_ERR,
+								 "Connection needs %zu bytes, more than its budget of %zu",
+								 ms_speech_connection_get_memory(connection) + LWS_PRE + context->memory.rx_buffer_size,
+								 context->memory.connection_budget);
+		ms_speech_handle_connection_cleanup(connection);
+		return -ENOBUFS;
+	}
+	int r = ms_speech_connection_open(connection);
+	if (r < 0) {
+		ms_speech_handle_connection_cleanup(connection);
+		return r;
+	}
 
 	*conn = connection;
 	
 	return 0;
 }
 
+static void ms_speech_release_connection(ms_speech_connection_t connection)
+{
+	for (int i=0; i<connection->num_endpoints; i++) {
+		free(connection->endpoints[i].uri);
+		free(connection->endpoints[i].path);
+	}
+	free(connection->endpoints);
+	ms_speech_slab_free(&connection->context->connection_slab, connection);
+}
+
+// undoes a connect that failed before anything else referred to the connection
+static void ms_speech_discard_connection(ms_speech_connection_t connection)
+{
+	ms_speech_latency_destroy(connection);
+	ms_speech_telemetry_destroy(connection);
+	ms_speech_slab_free(&connection->context->callbacks_slab, connection->callbacks);
+	connection->callbacks = NULL;
+	ms_speech_release_connection(connection);
+}
+
+void ms_speech_release_retired(ms_speech_context_t context)
+{
+	while (context->retired) {
+		ms_speech_connection_t connection = context->retired;
+		context->retired = connection->retired_next;
+		ms_speech_release_connection(connection);
+	}
+}
+
+void ms_speech_select_endpoint(ms_speech_connection_t connection, int index)
+{
+	ms_speech_endpoint_t *endpoint = &connection->endpoints[index];
+
+	connection->endpoint = index;
+	connection->uri = endpoint->uri;
+	connection->path = endpoint->path;
+	connection->address = endpoint->address;
+	connection->port = endpoint->port;
+	connection->ssl_connection = endpoint->ssl_connection;
+}
+
+int ms_speech_connection_open(ms_speech_connection_t connection)
+{
+	char address[MS_SPEECH_RESOLVER_ADDRESS_SIZE];
+
+	ms_speech_set_connection_status(connection, MS_SPEECH_CLIENT_CONNECTING);
+	ms_speech_endpoint_set_handle_connecting(connection);
+	ms_speech_timeouts_handle_connecting(connection);
+	ms_speech_latency_handle_connecting(connection);
+	for (int i=0; i<connection->num_endpoints; i++) {
+		if (i != connection->endpoint)
+			ms_speech_resolver_prefetch(connection->context, connection->endpoints[i].address);
+	}
+
+	// resolve meanwhile, the connection is opened again once a token is there
+	if (ms_speech_token_wait(connection)) {
+		ms_speech_resolver_prefetch(connection->context, connection->address);
+		return 0;
+	}
+
+	int r = ms_speech_resolver_lookup(connection, address, sizeof(address));
+	if (r == -EINPROGRESS)
+		return 0;
+
+	// race the resolved addresses and endpoints when there are several
+	int race = ms_speech_race_start(connection, r ? NULL : address);
+	if (race <= 0)
+		return race;
+
+	if (r) {
+		ms_speech_set_connection_status(connection, MS_SPEECH_CLIENT_DISCONNECTED);
+		ms_speech_connection_log(connection,
+								 MS_SPEECH_LOG_ERR,
+								 "Unable to resolve %s",
+								 connection->address);
+		return r;
+	}
+
+	return ms_speech_connection_connect(connection, address);
+}
+
+struct lws *ms_speech_connection_connect_to(ms_speech_connection_t connection, const ms_speech_endpoint_t *endpoint, const char *address)
+{
+	struct lws_client_connect_info i;
+	memset(&i, 0, sizeof(i));
+
+	// connect to the resolved address, host header and SNI keep the name
+	i.context = connection->context->context;
+	i.address = address;
+	i.port = endpoint->port;
+	i.path = endpoint->path;
+	i.ssl_connection = endpoint->ssl_connection;
+	i.host = endpoint->address;
+	i.origin = endpoint->address;
+	i.ietf_version_or_minus_one = -1;
+	i.userdata = connection;
+
+	// lws may set up TLS before returning
+	ms_speech_tls_begin_attempt(connection->context, endpoint);
+	struct lws *wsi = lws_client_connect_via_info(&i);
+	ms_speech_tls_bind_attempt(connection->context, wsi);
+
+	return wsi;
+}
+
+int ms_speech_connection_connect(ms_speech_connection_t connection, const char *address)
+{
+	ms_speech_connection_log(connection,
+							 MS_SPEECH_LOG_DEBUG,
+							 "Connecting to %s (%s)",
+							 connection->address,
+							 address);
+	connection->opening = 1;
+	connection->open_failed = 0;
+	struct lws *wsi = ms_speech_connection_connect_to(connection, &connection->endpoints[connection->endpoint], address);
+	connection->opening = 0;
+	connection->wsi = connection->open_failed ? NULL : wsi;
+	
+	return connection->wsi ? 0 : -ECONNREFUSED;
+}
+
+void ms_speech_connection_abort(ms_speech_connection_t connection)
+{
+	ms_speech_resolver_cancel(connection);
+	ms_speech_token_cancel(connection);
+	ms_speech_race_cancel(connection);
+	ms_speech_reconnect_cancel(connection);
+
+	if (connection->wsi) {
+		// lws closes the socket on its own, detached from the connection
+		lws_set_wsi_user(connection->wsi, NULL);
+		lws_set_timeout(connection->wsi, PENDING_TIMEOUT_AWAITING_SERVER_RESPONSE, LWS_TO_KILL_ASYNC);
+		connection->wsi = NULL;
+	}
+
+	connection->request_pending = 0;
+	ms_speech_set_connection_status(connection, MS_SPEECH_CLIENT_DISCONNECTED);
+	ms_speech_set_status(connection, MS_SPEECH_CLIENT_IDLE);
+}
+
+void ms_speech_handle_connection_error(ms_speech_connection_t connection, unsigned int http_status, const char *message)
+{
+	ms_speech_set_connection_status(connection, MS_SPEECH_CLIENT_DISCONNECTED);
+
+	ms_speech_connection_log(connection,
+							 MS_SPEECH_LOG_INFO,
+							 "Failed to connect to service: %s. HTTP status: %d",
+							 message ? message : "(null)",
+							 http_status);
+	ms_speech_endpoint_set_handle_error(connection);
+
+	if (ms_speech_reconnect_schedule(connection))
+		return;
+	ms_speech_set_status(connection, MS_SPEECH_CLIENT_IDLE);
+
+	if (connection->callbacks->connection_error)
+		connection->callbacks->connection_error(connection, http_status, message, connection->callbacks->user_data);
+}
+
 int ms_speech_disconnect(ms_speech_connection_t connection)
 {
 	ms_speech_connection_log(connection,
 							 MS_SPEECH_LOG_DEBUG,
 							 "Disconnecting");
 	
-	ms_speech_handle_connection_cleanup(connection);
+	if (connection->wsi) {
+		// let the service loop close the socket, cleanup happens once
+		// lws is done with it
+		connection->disconnecting = 1;
+		lws_callback_on_writable(connection->wsi);
+	} else {
+		ms_speech_handle_connection_cleanup(connection);
+	}
 	
 	return 0;
 }
 
+uint64_t ms_speech_context_get_epoch_us(ms_speech_context_t context)
+{
+	// outside of the loop there is no iteration to share the reading with
+	if (!context->in_service)
+		return ms_speech_get_epoch_us();
+
+	// read lazily so that time spent polling is not included
+	if (!context->clock_us)
+		context->clock_us = ms_speech_get_epoch_us();
+	return context->clock_us;
+}
+
 void ms_speech_service_step(ms_speech_context_t context, int timeout_ms)
 {
+	context->clock_us = 0;
+	context->in_service = 1;
+
 	lws_service(context->context, timeout_ms);
+	ms_speech_resolver_service(context);
+	ms_speech_token_service(context);
+	ms_speech_race_service(context);
+	ms_speech_timer_wheel_service(&context->timers);
+	ms_speech_pool_service(context);
+	ms_speech_reconnect_service(context);
+	// nothing up the stack refers to connections cleaned up by now
+	ms_speech_release_retired(context);
+
+	context->in_service = 0;
 }
 
 void ms_speech_service_cancel_step(ms_speech_context_t context)
@@ -175,15 +472,20 @@ void ms_speech_service_cancel_step(ms_speech_context_t context)
 int ms_speech_start_stream(ms_speech_connection_t connection, ms_speech_audio_stream_callback stream_callback, const char *request_id, void *stream_user_data)
 {
 	if (connection->connection_status != MS_SPEECH_CLIENT_CONNECTED ||
-		connection->connection_status != MS_SPEECH_CLIENT_IDLE) {
+		connection->request_pending ||
+		(connection->status != MS_SPEECH_CLIENT_IDLE &&
+		 connection->status != MS_SPEECH_CLIENT_TURN_PENDING &&
+		 connection->status != MS_SPEECH_CLIENT_TELEMETRY_PENDING)) {
 		ms_speech_connection_log(connection,
 								 MS_SPEECH_LOG_WARN,
-								 "Cannot start streaming since connection is in an invalid state %d", connection->connection_status);
+								 "Cannot start streaming since we are in invalid state: connection %d, status: %d",
+								 connection->connection_status,
+								 connection->status);
 		return EPERM;
 	}
 	
 	if (request_id) {
-		int r = ms_speech_sanitize_guid(request_id, connection->current_request_id, sizeof(connection->current_request_id), 0);
+		int r = ms_speech_sanitize_guid(request_id, connection->pending_request_id, sizeof(connection->pending_request_id), 0);
 		if (r == -1) {
 			ms_speech_connection_log(connection,
 									MS_SPEECH_LOG_ERR,
@@ -191,28 +493,70 @@ int ms_speech_start_stream(ms_speech_connection_t connection, ms_speech_audio_st
 			return -1;
 		}
 	} else {
-		ms_speech_generate_guid(connection->current_request_id, sizeof(connection->current_request_id), 0);
+		ms_speech_generate_guid(connection->pending_request_id, sizeof(connection->pending_request_id), 0);
 	}
 
-	ms_speech_connection_log(connection,
-							 MS_SPEECH_LOG_DEBUG,
-							 "Starting streaming");
-	
-	connection->streaming_info = (ms_speech_streaming_info_t *)malloc(sizeof(ms_speech_streaming_info_t));
-	memset(connection->streaming_info, 0, sizeof(ms_speech_streaming_info_t));
+	// streaming state is reused by requests queued behind the current turn
+	if (connection->streaming_info == NULL) {
+		if (ms_speech_memory_reserve(connection, connection->context->streaming_slab.object_size)) {
+			ms_speech_connection_log(connection,
+									 MS_SPEECH_LOG_ERR,
+									 "Cannot start streaming: stream buffer exceeds connection memory budget");
+			return -ENOBUFS;
+		}
+		connection->streaming_info = (ms_speech_streaming_info_t *)ms_speech_slab_alloc(&connection->context->streaming_slab);
+		if (connection->streaming_info == NULL)
+			return -ENOMEM;
+	} else {
+		memset(connection->streaming_info, 0, sizeof(ms_speech_streaming_info_t));
+	}
+	connection->streaming_info->buffer_size = connection->context->memory.stream_buffer_size;
 	connection->streaming_info->stream_callback = stream_callback;
 	connection->streaming_info->stream_user_data = stream_user_data;
+	connection->request_pending = 1;
+	
+	if (connection->status == MS_SPEECH_CLIENT_IDLE) {
+		ms_speech_begin_request(connection);
+	} else {
+		// previous turn is still finishing, start once its telemetry is out
+		ms_speech_connection_log(connection,
+								 MS_SPEECH_LOG_DEBUG,
+								 "Queued request %s until current turn ends",
+								 connection->pending_request_id);
+	}
+	
+	return 0;
+}
+
+static void ms_speech_begin_request(ms_speech_connection_t connection)
+{
+	strcpy(connection->current_request_id, connection->pending_request_id);
+	connection->pending_request_id[0] = '\0';
+	connection->request_pending = 0;
+
+	ms_speech_connection_log(connection,
+							 MS_SPEECH_LOG_DEBUG,
+							 "Starting streaming for request %s",
+							 connection->current_request_id);
+
+	ms_speech_telemetry_reset(connection);
+	ms_speech_reconnect_reset(connection);
+	ms_speech_endpoint_set_handle_request(connection);
+	ms_speech_timeouts_handle_request(connection);
+	ms_speech_latency_handle_request(connection);
 	ms_speech_set_status(connection, MS_SPEECH_CLIENT_STREAMING);
 	
 	lws_callback_on_writable(connection->wsi);
 	
 	ms_speech_telemetry_handle_stream_start_request(connection);
-	
-	return 0;
 }
 
 int ms_speech_resume_stream(ms_speech_connection_t connection)
 {
+	// resumed once reconnected
+	if (ms_speech_reconnect_resume(connection))
+		return 0;
+	
 	if (connection->connection_status != MS_SPEECH_CLIENT_CONNECTED ||
 		connection->status != MS_SPEECH_CLIENT_STREAMING_BLOCKED) {
 		ms_speech_connection_log(connection,
@@ -236,14 +580,53 @@ int ms_speech_resume_stream(ms_speech_connection_t connection)
 
 static int ws_service_callback(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len)
 {
+	// context wide reasons, user is not a connection for these
+	switch (reason) {
+		case LWS_CALLBACK_OPENSSL_LOAD_EXTRA_CLIENT_VERIFY_CERTS:
+			// user is the client SSL_CTX here
+			ms_speech_tls_attach((ms_speech_context_t)lws_context_user(lws_get_context(wsi)), user);
+			return 0;
+
+		case LWS_CALLBACK_GET_THREAD_ID:
+			return pthread_self();
+
+		case LWS_CALLBACK_WSI_DESTROY:
+			ms_speech_tls_end_attempt((ms_speech_context_t)lws_context_user(lws_get_context(wsi)), wsi);
+			return 0;
+
+		case LWS_CALLBACK_CLIENT_ESTABLISHED:
+		case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
+			// the handshake is over, also for attempts that lost a race
+			ms_speech_tls_end_attempt((ms_speech_context_t)lws_context_user(lws_get_context(wsi)), wsi);
+			break;
+
+		default:
+			break;
+	}
+
 	ms_speech_connection_t conn = (ms_speech_connection_t)user;
 
+	// connect attempts that lost a race are detached from their connection
+	if (!conn)
+		return reason == LWS_CALLBACK_CLIENT_ESTABLISHED ? -1 : 0;
+
+	if (ms_speech_race_handle_callback(conn, wsi, reason))
+		return 0;
+
 	int r = 0;
 	switch (reason) {
 			
 		case LWS_CALLBACK_CLIENT_ESTABLISHED:
 		{
+			if (conn->disconnecting) {
+				r = -1;
+				break;
+			}
+
 			ms_speech_set_connection_status(conn, conn->connection_status = MS_SPEECH_CLIENT_CONNECTED);
+			ms_speech_endpoint_set_handle_connected(conn);
+			ms_speech_timeouts_handle_connected(conn);
+			ms_speech_latency_handle_established(conn, wsi);
 			
 			ms_speech_connection_log(conn,
 									 MS_SPEECH_LOG_INFO,
@@ -260,29 +643,40 @@ static int ws_service_callback(struct lws *wsi, enum lws_callback_reasons reason
 			
 		case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
 		{
-			unsigned int http_status = lws_http_client_http_response(conn->wsi);
-			ms_speech_set_connection_status(conn, MS_SPEECH_CLIENT_DISCONNECTED);
-			ms_speech_set_status(conn, MS_SPEECH_CLIENT_IDLE);
-
-			ms_speech_connection_log(conn,
-									 MS_SPEECH_LOG_INFO,
-									 "Failed to connect to service: %s. HTTP status: %d",
-									 in ? (char *)in : "(null)",
-									 http_status);
+			unsigned int http_status = lws_http_client_http_response(wsi);
+			conn->wsi = NULL;
+			// the connection may be released before lws is done with the wsi
+			lws_set_wsi_user(wsi, NULL);
+			if (conn->opening) {
+				conn->open_failed = 1;
+				break;
+			}
+			if (conn->disconnecting) {
+				ms_speech_handle_connection_cleanup(conn);
+				break;
+			}
 
-			if (conn->callbacks->connection_error)
-				conn->callbacks->connection_error(conn, http_status, (char *)in, conn->callbacks->user_data);
+			ms_speech_handle_connection_error(conn, http_status, (const char *)in);
 			break;
 		}
 			
 		case LWS_CALLBACK_CLOSED:
+			conn->wsi = NULL;
+			lws_set_wsi_user(wsi, NULL);
+			if (conn->disconnecting) {
+				ms_speech_handle_connection_cleanup(conn);
+				break;
+			}
+
 			ms_speech_set_connection_status(conn, MS_SPEECH_CLIENT_DISCONNECTED);
 			
 			ms_speech_connection_log(conn,
 									 MS_SPEECH_LOG_INFO,
 									 "Connection closed");
+			ms_speech_endpoint_set_handle_closed(conn);
 
-			ms_speech_set_connection_status(conn, MS_SPEECH_CLIENT_DISCONNECTED);
+			if (ms_speech_reconnect_schedule(conn))
+				break;
 			ms_speech_set_status(conn, MS_SPEECH_CLIENT_IDLE);
 
 			if (conn->callbacks->connection_closed)
@@ -290,10 +684,15 @@ static int ws_service_callback(struct lws *wsi, enum lws_callback_reasons reason
 			break;
 
 		case LWS_CALLBACK_CLIENT_APPEND_HANDSHAKE_HEADER:
+			ms_speech_latency_handle_handshake(conn, wsi);
 			r = handle_handshake_headers(conn, in, len);
 			break;
 			
 		case LWS_CALLBACK_CLIENT_WRITEABLE:
+			if (conn->disconnecting) {
+				r = -1;
+				break;
+			}
 			r = handle_writable(conn);
 			break;
 
@@ -310,18 +709,29 @@ static int ws_service_callback(struct lws *wsi, enum lws_callback_reasons reason
 									 MS_SPEECH_LOG_ERR,
 									 "Service closed connection: %d: %.*s",
 									 server_code,
-									 len,
+									 (int)len,
 									 in ? (char *)in : "");
 			break;
 		}
 			
 		case LWS_CALLBACK_CLIENT_RECEIVE:
 		{
+			if (conn->disconnecting)
+				break;
+
 			ms_speech_connection_log(conn,
 									 MS_SPEECH_LOG_DEBUG,
 									 "Received data: %.*s",
-									 len,
+									 (int)len,
 									 in ? (char *)in : "");
+			ms_speech_metrics_add(conn->context, MS_SPEECH_METRIC_BYTES_RECEIVED, len);
+			ms_speech_metrics_add(conn->context, MS_SPEECH_METRIC_FRAMES_RECEIVED, 1);
+			ms_speech_capture_frame(conn,
+									MS_SPEECH_CAPTURE_INCOMING,
+									lws_frame_is_binary(wsi) ? MS_SPEECH_CAPTURE_OPCODE_BINARY : MS_SPEECH_CAPTURE_OPCODE_TEXT,
+									lws_is_final_fragment(wsi),
+									(const unsigned char *)in,
+									len);
 			r = ms_speech_handle_resonse_message(conn, in, len);
 			if (r == -EAGAIN) {
 				lws_callback_on_writable(conn->wsi);
@@ -330,12 +740,6 @@ static int ws_service_callback(struct lws *wsi, enum lws_callback_reasons reason
 			break;
 		}
 
-		case LWS_CALLBACK_GET_THREAD_ID:
-		{
-			r = pthread_self();
-			break;
-		}
-			
 		default:
 			break;
 	}
@@ -354,7 +758,7 @@ static int handle_handshake_headers(ms_speech_connection_t connection, void *in,
 	if (len < header_len) {
 		ms_speech_connection_log(connection,
 								 MS_SPEECH_LOG_ERR | MS_SPEECH_LOG_HEADER,
-								 "Not enough buffer for connection ID header: %d/%d",
+								 "Not enough buffer for connection ID header: %zu/%zu",
 								 header_len,
 								 len);
 		r = -EINVAL;
@@ -363,22 +767,38 @@ static int handle_handshake_headers(ms_speech_connection_t connection, void *in,
 	int written_len = sprintf(*p, "%s: ", MS_SPEECH_CONNECTION_ID_HEADER);
 	*p += written_len;
 	len -= written_len;
-	written_len = ms_speech_generate_guid(*p, len, 0);
-	strncpy(connection->connection_id, *p, sizeof(connection->connection_id));
+	if (connection->race || connection->connection_id_reserved) {
+		// reuse the ID shared by all racing attempts or generated ahead
+		written_len = snprintf(*p, len, "%s", connection->connection_id);
+		connection->connection_id_reserved = 0;
+	} else {
+		written_len = ms_speech_generate_guid(*p, len, 0);
+		strncpy(connection->connection_id, *p, sizeof(connection->connection_id));
+	}
 	*p += written_len;
 	len -= written_len;
 	strncat(*p, "\r\n", len);
 	*p += 2;
 	len -= 2;
 	
-	if (connection->callbacks->provide_authentication_header)
+	const char *header = NULL;
+	if (connection->callbacks->provide_authentication_header) {
+		header = connection->callbacks->provide_authentication_header(connection, connection->callbacks->user_data, len);
+	} else {
+		int expired = 0;
+		header = ms_speech_token_get_header(connection->context, &expired);
+		if (header && expired)
+			ms_speech_connection_log(connection,
+									 MS_SPEECH_LOG_WARN | MS_SPEECH_LOG_HEADER,
+									 "Authentication token has expired");
+	}
+	if (header)
 	{
-		const char *header = connection->callbacks->provide_authentication_header(connection, connection->callbacks->user_data, len);
 		size_t header_length = strlen(header);
 		if (header_length > len) {
 			ms_speech_connection_log(connection,
 									 MS_SPEECH_LOG_ERR | MS_SPEECH_LOG_HEADER,
-									 "Requested authorization is too long: %d/%d",
+									 "Requested authorization is too long: %zu/%zu",
 									 header_length,
 									 len);
 			r = -EINVAL;
@@ -395,6 +815,29 @@ static int handle_writable(ms_speech_connection_t connection)
 	ms_speech_message *message = NULL;
 	int r = 0;
 	
+	if (connection->ping_pending) {
+		unsigned char buffer[LWS_PRE];
+		connection->ping_pending = 0;
+		ms_speech_connection_log(connection,
+								 MS_SPEECH_LOG_DEBUG,
+								 "Sending keepalive ping");
+		lws_write(connection->wsi, buffer + LWS_PRE, 0, LWS_WRITE_PING);
+		ms_speech_metrics_add(connection->context, MS_SPEECH_METRIC_FRAMES_SENT, 1);
+		ms_speech_capture_frame(connection, MS_SPEECH_CAPTURE_OUTGOING, MS_SPEECH_CAPTURE_OPCODE_PING, 1, NULL, 0);
+		if (connection->status == MS_SPEECH_CLIENT_SPEECH_CONFIG_PENDING ||
+			connection->status == MS_SPEECH_CLIENT_STREAMING ||
+			connection->status == MS_SPEECH_CLIENT_TELEMETRY_PENDING)
+			lws_callback_on_writable(connection->wsi);
+		return 0;
+	}
+
+	if (lws_send_pipe_choked(connection->wsi)) {
+		// come back once the socket drained instead of buffering in lws
+		ms_speech_metrics_add(connection->context, MS_SPEECH_METRIC_SEND_CHOKED, 1);
+		lws_callback_on_writable(connection->wsi);
+		return 0;
+	}
+	
 	switch(connection->status)
 	{
 		case MS_SPEECH_CLIENT_SPEECH_CONFIG_PENDING:
@@ -422,27 +865,56 @@ static int handle_writable(ms_speech_connection_t connection)
 		r = 0;
 	}
 	
-	if (message != NULL)
+	if (message != NULL) {
+		ms_speech_metrics_add(connection->context, MS_SPEECH_METRIC_MESSAGE_ALLOCATIONS, 1);
 		ms_speech_destroy_message(message);
+	}
 	
 	return r;
 }
 
 static int write_message(ms_speech_connection_t connection, ms_speech_message * message)
 {
-	ms_speech_set_message_time(message);
+	ms_speech_set_message_time(message, ms_speech_context_get_epoch_us(connection->context));
 
 	char *buffer = NULL;
 	int len = ms_speech_serialize_message(message, &buffer);
-	ms_speech_connection_log(connection,
-							 MS_SPEECH_LOG_DEBUG,
-							 "Sending: %.*s",
-							 len,
-							 buffer);
+	if (len < 0) {
+		ms_speech_connection_log(connection,
+								 MS_SPEECH_LOG_ERR,
+								 "Unable to serialize %s: %d",
+								 message->path,
+								 len);
+		return len;
+	}
+	if (message->binary) {
+		// binary frames do not print, only their size is useful
+		ms_speech_connection_log(connection,
+								 MS_SPEECH_LOG_DEBUG,
+								 "Sending: %s, %d bytes",
+								 message->path,
+								 len);
+	} else {
+		ms_speech_connection_log(connection,
+								 MS_SPEECH_LOG_DEBUG,
+								 "Sending: %.*s",
+								 len,
+								 buffer);
+	}
+	// lws masks the frame in place, capture it while it is still readable
+	ms_speech_capture_frame(connection,
+							MS_SPEECH_CAPTURE_OUTGOING,
+							message->binary ? MS_SPEECH_CAPTURE_OPCODE_BINARY : MS_SPEECH_CAPTURE_OPCODE_TEXT,
+							1,
+							(const unsigned char *)buffer,
+							len);
 	lws_write(connection->wsi,
 			  (unsigned char *)buffer,
 			  len,
 			  message->binary ? LWS_WRITE_BINARY : LWS_WRITE_TEXT);
+	ms_speech_metrics_add(connection->context, MS_SPEECH_METRIC_BYTES_SENT, len);
+	ms_speech_metrics_add(connection->context, MS_SPEECH_METRIC_FRAMES_SENT, 1);
+	ms_speech_metrics_count_message(connection->context, MS_SPEECH_METRIC_MESSAGES_SENT, message->path);
 	
 	return 0;
 }
@@ -453,7 +925,15 @@ static int ms_speech_handle_telemetry(ms_speech_connection_t connection, ms_spee
 	strcpy(message->request_id, connection->current_request_id);
 	int r = write_message(connection, message);
 	if (!r) {
-		ms_speech_set_status(connection, MS_SPEECH_CLIENT_IDLE);
+		ms_speech_telemetry_reset(connection);
+		if (connection->request_pending) {
+			ms_speech_begin_request(connection);
+		} else {
+			// idle connections do not hold on to a stream buffer
+			ms_speech_slab_free(&connection->context->streaming_slab, connection->streaming_info);
+			connection->streaming_info = NULL;
+			ms_speech_set_status(connection, MS_SPEECH_CLIENT_IDLE);
+		}
 	}
 	return r;
 }
@@ -462,23 +942,78 @@ static int ms_speech_handle_speech_config(ms_speech_connection_t connection, ms_
 {
 	ms_speech_set_message_speech_config(connection, message);
 	int r = write_message(connection, message);
-	if (!r) {
+	if (!r)
+		ms_speech_latency_mark(connection, MS_SPEECH_PHASE_SPEECH_CONFIG_SENT);
+	if (!r && connection->reconnect && connection->reconnect->reconnecting) {
+		// pick up the interrupted request under a new request ID
+		ms_speech_generate_guid(connection->current_request_id, sizeof(connection->current_request_id), 0);
+		ms_speech_telemetry_reset(connection);
+		ms_speech_reconnect_start_replay(connection);
+		connection->streaming_info->packet_num = 0;
+		ms_speech_set_status(connection, MS_SPEECH_CLIENT_STREAMING);
+		ms_speech_telemetry_handle_stream_start_request(connection);
+		r = -EAGAIN;
+	} else if (!r) {
 		ms_speech_set_status(connection, MS_SPEECH_CLIENT_IDLE);
 		connection->callbacks->client_ready(connection, connection->callbacks->user_data);
 	}
 	return r;
 }
 
+static int ms_speech_handle_replay(ms_speech_connection_t connection, ms_speech_message *message)
+{
+	strcpy(message->request_id, connection->current_request_id);
+	
+	int r = ms_speech_reconnect_replay(connection,
+									   connection->streaming_info->buffer,
+									   connection->streaming_info->buffer_size);
+	if (r > 0) {
+		ms_speech_set_message_audio(connection,
+									message,
+									connection->streaming_info->buffer,
+									r);
+		r = write_message(connection, message);
+		connection->streaming_info->packet_num++;
+		return r ? r : -EAGAIN;
+	}
+	
+	switch (ms_speech_reconnect_finish_replay(connection)) {
+		case MS_SPEECH_CLIENT_STREAMING_BLOCKED:
+			ms_speech_set_status(connection, MS_SPEECH_CLIENT_STREAMING_BLOCKED);
+			return 0;
+			
+		case MS_SPEECH_CLIENT_TURN_PENDING:
+			// audio had already ended before the connection dropped
+			ms_speech_set_message_audio(connection,
+										message,
+										connection->streaming_info->buffer,
+										0);
+			r = write_message(connection, message);
+			if (!r)
+				ms_speech_set_status(connection, MS_SPEECH_CLIENT_TURN_PENDING);
+			ms_speech_telemetry_handle_stream_stop_request(connection, 0);
+			return r;
+			
+		default:
+			return -EAGAIN;
+	}
+}
+
 static int ms_speech_handle_streaming(ms_speech_connection_t connection, ms_speech_message *message)
 {
+	if (connection->reconnect && connection->reconnect->replaying)
+		return ms_speech_handle_replay(connection, message);
+	
 	ms_speech_connection_log(connection,
 							 MS_SPEECH_LOG_DEBUG,
 							 "Invoking streaming callback");
 	
+	uint64_t callback_started = ms_speech_get_monotonic_us();
 	int r = connection->streaming_info->stream_callback(connection,
 														connection->streaming_info->buffer,
-														sizeof(connection->streaming_info->buffer),
+														connection->streaming_info->buffer_size,
 														connection->streaming_info->stream_user_data);
+	ms_speech_metrics_add(connection->context, MS_SPEECH_METRIC_CALLBACK_TIME_US, ms_speech_get_monotonic_us() - callback_started);
 	
 	ms_speech_connection_log(connection,
 							 MS_SPEECH_LOG_DEBUG,
@@ -492,12 +1027,19 @@ static int ms_speech_handle_streaming(ms_speech_connection_t connection, ms_spee
 		ms_speech_set_status(connection, MS_SPEECH_CLIENT_STREAMING_BLOCKED);
 		r = 0;
 	} else if (r > 0) {
+		ms_speech_reconnect_record_audio(connection,
+										 connection->streaming_info->buffer,
+										 r);
+		ms_speech_latency_handle_audio(connection,
+									   connection->streaming_info->buffer,
+									   r);
 		ms_speech_set_message_audio(connection,
 									message,
 									connection->streaming_info->buffer,
 									r);
 		r = write_message(connection, message);
 		if (!r) {
+			ms_speech_latency_mark(connection, MS_SPEECH_PHASE_FIRST_AUDIO_SENT);
 			// need more writes
 			r = -EAGAIN;
 		}
@@ -513,7 +1055,7 @@ static int ms_speech_handle_streaming(ms_speech_connection_t connection, ms_spee
 									r);
 		r = write_message(connection, message);
 		if (!r) {
-			ms_speech_set_status(connection, MS_SPEECH_CLIENT_IDLE);
+			ms_speech_set_status(connection, MS_SPEECH_CLIENT_TURN_PENDING);
 		}
 		
 		ms_speech_telemetry_handle_stream_stop_request(connection, user_error);
@@ -0,0 +1,284 @@
+/*
+
+Copyright 2017 technicianted
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+*/
+#include <ctype.h>
+#include <errno.h>
+
+#include "compat.h"
+#include "ms_speech_capture.h"
+#include "ms_speech_logging_priv.h"
+#include "ms_speech_timestamp.h"
+
+#define MS_SPEECH_CAPTURE_HASH_SIZE 8
+
+static ms_speech_capture_buffer_t *ms_speech_capture_new_buffer(size_t capacity)
+{
+	ms_speech_capture_buffer_t *buffer = (ms_speech_capture_buffer_t *)malloc(sizeof(ms_speech_capture_buffer_t));
+	buffer->data = (unsigned char *)malloc(capacity);
+	buffer->length = 0;
+	buffer->capacity = capacity;
+	buffer->num_records = 0;
+	buffer->next = NULL;
+
+	return buffer;
+}
+
+static void ms_speech_capture_free_buffer(ms_speech_capture_buffer_t *buffer)
+{
+	free(buffer->data);
+	free(buffer);
+}
+
+static void *ms_speech_capture_thread(void *arg)
+{
+	struct ms_speech_capture_st *capture = (struct ms_speech_capture_st *)arg;
+
+	pthread_mutex_lock(&capture->lock);
+	for (;;) {
+		while (!capture->pending && !capture->stopping)
+			pthread_cond_wait(&capture->cond, &capture->lock);
+		if (!capture->pending)
+			break;
+
+		ms_speech_capture_buffer_t *buffers = capture->pending;
+		capture->pending = NULL;
+		capture->pending_tail = &capture->pending;
+		capture->num_pending = 0;
+		pthread_mutex_unlock(&capture->lock);
+
+		while (buffers) {
+			ms_speech_capture_buffer_t *next = buffers->next;
+			fwrite(buffers->data, 1, buffers->length, capture->file);
+			ms_speech_capture_free_buffer(buffers);
+			buffers = next;
+		}
+		fflush(capture->file);
+
+		pthread_mutex_lock(&capture->lock);
+	}
+	pthread_mutex_unlock(&capture->lock);
+
+	return NULL;
+}
+
+static struct ms_speech_capture_st *ms_speech_capture_open(const char *path, int flags)
+{
+	FILE *file = fopen(path, "ab");
+	if (!file)
+		return NULL;
+
+	// a new file starts with the magic, appends continue the record stream
+	if (ftell(file) == 0)
+		fwrite(MS_SPEECH_CAPTURE_MAGIC, 1, strlen(MS_SPEECH_CAPTURE_MAGIC), file);
+
+	struct ms_speech_capture_st *capture = (struct ms_speech_capture_st *)malloc(sizeof(struct ms_speech_capture_st));
+	memset(capture, 0, sizeof(struct ms_speech_capture_st));
+	capture->file = file;
+	capture->flags = flags;
+	capture->current = ms_speech_capture_new_buffer(MS_SPEECH_CAPTURE_BUFFER_SIZE);
+	capture->pending_tail = &capture->pending;
+	pthread_mutex_init(&capture->lock, NULL);
+	pthread_cond_init(&capture->cond, NULL);
+	if (pthread_create(&capture->thread, NULL, &ms_speech_capture_thread, capture)) {
+		pthread_cond_destroy(&capture->cond);
+		pthread_mutex_destroy(&capture->lock);
+		ms_speech_capture_free_buffer(capture->current);
+		fclose(file);
+		free(capture);
+		return NULL;
+	}
+
+	return capture;
+}
+
+static void ms_speech_capture_submit(struct ms_speech_capture_st *capture)
+{
+	ms_speech_capture_buffer_t *buffer = capture->current;
+	if (!buffer->length)
+		return;
+
+	pthread_mutex_lock(&capture->lock);
+	if (capture->num_pending < MS_SPEECH_CAPTURE_MAX_PENDING) {
+		*capture->pending_tail = buffer;
+		capture->pending_tail = &buffer->next;
+		capture->num_pending++;
+		capture->current = NULL;
+		pthread_cond_signal(&capture->cond);
+	} else {
+		// the disk is not keeping up, never block the service thread
+		capture->dropped += buffer->num_records;
+		buffer->length = 0;
+		buffer->num_records = 0;
+	}
+	pthread_mutex_unlock(&capture->lock);
+
+	if (!capture->current)
+		capture->current = ms_speech_capture_new_buffer(MS_SPEECH_CAPTURE_BUFFER_SIZE);
+}
+
+void ms_speech_capture_close(struct ms_speech_capture_st *capture)
+{
+	if (!capture)
+		return;
+
+	ms_speech_capture_submit(capture);
+
+	pthread_mutex_lock(&capture->lock);
+	capture->stopping = 1;
+	pthread_cond_signal(&capture->cond);
+	pthread_mutex_unlock(&capture->lock);
+	pthread_join(capture->thread, NULL);
+
+	if (capture->dropped)
+		ms_speech_log(MS_SPEECH_LOG_WARN,
+					  "Capture dropped %lu records",
+					  capture->dropped);
+
+	ms_speech_capture_free_buffer(capture->current);
+	pthread_cond_destroy(&capture->cond);
+	pthread_mutex_destroy(&capture->lock);
+	fclose(capture->file);
+	free(capture);
+}
+
+static void ms_speech_capture_put(unsigned char *p, uint64_t value, int size)
+{
+	for (int i=0; i<size; i++)
+		p[i] = (unsigned char)(value >> (8 * i));
+}
+
+static uint64_t ms_speech_capture_hash(const unsigned char *data, size_t length)
+{
+	// FNV-1a
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (size_t i=0; i<length; i++) {
+		hash ^= data[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+static void ms_speech_capture_parse_id(const char *connection_id, unsigned char *id)
+{
+	memset(id, 0, 16);
+	for (int i=0; i<32 && isxdigit((unsigned char)connection_id[i]); i++) {
+		int c = tolower((unsigned char)connection_id[i]);
+		int nibble = c <= '9' ? c - '0' : c - 'a' + 10;
+		id[i / 2] |= nibble << ((i % 2) ? 0 : 4);
+	}
+}
+
+// makes room for a whole record in the current buffer
+static void ms_speech_capture_reserve(struct ms_speech_capture_st *capture, size_t size)
+{
+	if (capture->current->capacity - capture->current->length >= size)
+		return;
+
+	ms_speech_capture_submit(capture);
+	if (capture->current->capacity < size) {
+		ms_speech_capture_free_buffer(capture->current);
+		capture->current = ms_speech_capture_new_buffer(size);
+	}
+}
+
+static void ms_speech_capture_append(struct ms_speech_capture_st *capture, const void *data, size_t length)
+{
+	memcpy(capture->current->data + capture->current->length, data, length);
+	capture->current->length += length;
+}
+
+void ms_speech_capture_frame(ms_speech_connection_t connection,
+							 ms_speech_capture_direction_t direction,
+							 int opcode,
+							 int final,
+							 const unsigned char *payload,
+							 size_t length)
+{
+	struct ms_speech_capture_st *capture = connection->capture ? connection->capture : connection->context->capture;
+	if (!capture)
+		return;
+
+	int flags = final ? MS_SPEECH_CAPTURE_RECORD_FINAL : 0;
+	size_t stored_length = length;
+	unsigned char hash[MS_SPEECH_CAPTURE_HASH_SIZE];
+
+	// audio frames keep their headers, the audio itself is optional
+	if (opcode == MS_SPEECH_CAPTURE_OPCODE_BINARY && length >= 2 &&
+		(capture->flags & (MS_SPEECH_CAPTURE_ELIDE_AUDIO | MS_SPEECH_CAPTURE_HASH_AUDIO))) {
+		size_t headers_length = 2 + ((payload[0] << 8) | payload[1]);
+		if (headers_length < length) {
+			stored_length = headers_length;
+			flags |= MS_SPEECH_CAPTURE_RECORD_ELIDED;
+			if (capture->flags & MS_SPEECH_CAPTURE_HASH_AUDIO) {
+				ms_speech_capture_put(hash, ms_speech_capture_hash(payload + headers_length, length - headers_length), MS_SPEECH_CAPTURE_HASH_SIZE);
+				flags |= MS_SPEECH_CAPTURE_RECORD_HASHED;
+			}
+		}
+	}
+
+	unsigned char header[MS_SPEECH_CAPTURE_RECORD_HEADER_SIZE];
+	ms_speech_capture_put(header, ms_speech_get_monotonic_us(), 8);
+	header[8] = (unsigned char)direction;
+	header[9] = (unsigned char)opcode;
+	header[10] = (unsigned char)flags;
+	header[11] = 0;
+	ms_speech_capture_parse_id(connection->connection_id, header + 12);
+	ms_speech_capture_put(header + 28, length, 4);
+	ms_speech_capture_put(header + 32, stored_length + ((flags & MS_SPEECH_CAPTURE_RECORD_HASHED) ? MS_SPEECH_CAPTURE_HASH_SIZE : 0), 4);
+
+	size_t hash_length = (flags & MS_SPEECH_CAPTURE_RECORD_HASHED) ? sizeof(hash) : 0;
+	ms_speech_capture_reserve(capture, sizeof(header) + stored_length + hash_length);
+	ms_speech_capture_append(capture, header, sizeof(header));
+	ms_speech_capture_append(capture, payload, stored_length);
+	ms_speech_capture_append(capture, hash, hash_length);
+	capture->current->num_records++;
+}
+
+int ms_speech_context_start_capture(ms_speech_context_t context, const char *path, int flags)
+{
+	struct ms_speech_capture_st *capture = ms_speech_capture_open(path, flags);
+	if (!capture)
+		return errno ? -errno : -ENOMEM;
+
+	ms_speech_capture_close(context->capture);
+	context->capture = capture;
+
+	return 0;
+}
+
+void ms_speech_context_stop_capture(ms_speech_context_t context)
+{
+	ms_speech_capture_close(context->capture);
+	context->capture = NULL;
+}
+
+int ms_speech_connection_start_capture(ms_speech_connection_t connection, const char *path, int flags)
+{
+	struct ms_speech_capture_st *capture = ms_speech_capture_open(path, flags);
+	if (!capture)
+		return errno ? -errno : -ENOMEM;
+
+	ms_speech_capture_close(connection->capture);
+	connection->capture = capture;
+
+	return 0;
+}
+
+void ms_speech_connection_stop_capture(ms_speech_connection_t connection)
+{
+	ms_speech_capture_close(connection->capture);
+	connection->capture = NULL;
+}
@@ -0,0 +1,93 @@
+/*
+
+Copyright 2017 technicianted
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+*/
+#ifndef ms_speech_capture_h
+#define ms_speech_capture_h
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "ms_speech_priv.h"
+
+#define MS_SPEECH_CAPTURE_MAGIC "MSSPCAP1"
+// records larger than this get a buffer of their own
+#define MS_SPEECH_CAPTURE_BUFFER_SIZE (256 * 1024)
+// buffers queued for the writer before records are dropped
+#define MS_SPEECH_CAPTURE_MAX_PENDING 16
+
+/*
+ * File layout: the 8 byte magic followed by records, little endian.
+ *
+ *   uint64_t timestamp_us    monotonic
+ *   uint8_t  direction       ms_speech_capture_direction_t
+ *   uint8_t  opcode          websocket opcode
+ *   uint8_t  flags           MS_SPEECH_CAPTURE_RECORD_*
+ *   uint8_t  reserved
+ *   uint8_t  connection_id[16]
+ *   uint32_t length          original payload length
+ *   uint32_t stored_length   payload bytes that follow
+ */
+#define MS_SPEECH_CAPTURE_RECORD_HEADER_SIZE 36
+#define MS_SPEECH_CAPTURE_RECORD_FINAL 0x01
+#define MS_SPEECH_CAPTURE_RECORD_ELIDED 0x02
+#define MS_SPEECH_CAPTURE_RECORD_HASHED 0x04
+
+#define MS_SPEECH_CAPTURE_OPCODE_TEXT 0x1
+#define MS_SPEECH_CAPTURE_OPCODE_BINARY 0x2
+#define MS_SPEECH_CAPTURE_OPCODE_PING 0x9
+
+typedef enum {
+	MS_SPEECH_CAPTURE_OUTGOING,
+	MS_SPEECH_CAPTURE_INCOMING
+} ms_speech_capture_direction_t;
+
+// holds whole records only, so that dropping a buffer keeps the file parseable
+typedef struct ms_speech_capture_buffer_st {
+	unsigned char *data;
+	size_t length;
+	size_t capacity;
+	unsigned long num_records;
+	struct ms_speech_capture_buffer_st *next;
+} ms_speech_capture_buffer_t;
+
+struct ms_speech_capture_st {
+	FILE *file;
+	int flags;
+
+	// filled by the service thread
+	ms_speech_capture_buffer_t *current;
+	// full buffers waiting for the writer, oldest first
+	ms_speech_capture_buffer_t *pending;
+	ms_speech_capture_buffer_t **pending_tail;
+	int num_pending;
+	// records lost while the writer was behind
+	unsigned long dropped;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int stopping;
+};
+
+void ms_speech_capture_frame(ms_speech_connection_t connection,
+							 ms_speech_capture_direction_t direction,
+							 int opcode,
+							 int final,
+							 const unsigned char *payload,
+							 size_t length);
+void ms_speech_capture_close(struct ms_speech_capture_st *capture);
+
+#endif /* ms_speech_capture_h */
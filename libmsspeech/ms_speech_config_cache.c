@@ -0,0 +1,104 @@
+/*
+
+Copyright 2017 technicianted
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+*/
+#include <errno.h>
+
+#include "compat.h"
+#include "ms_speech_config_cache.h"
+
+static int ms_speech_config_cache_key_equal(const char *a, const char *b)
+{
+	if (!a || !b)
+		return a == b;
+
+	return !strcmp(a, b);
+}
+
+const struct ms_speech_config_cache_st *ms_speech_config_cache_find(ms_speech_context_t context, const char *key)
+{
+	for (struct ms_speech_config_cache_st *entry = context->speech_configs; entry; entry = entry->next) {
+		if (ms_speech_config_cache_key_equal(entry->key, key))
+			return entry;
+	}
+
+	return NULL;
+}
+
+static void ms_speech_config_cache_free(struct ms_speech_config_cache_st *entry)
+{
+	free(entry->key);
+	free(entry->body);
+	free(entry);
+}
+
+static void ms_speech_config_cache_remove(ms_speech_context_t context, const char *key)
+{
+	struct ms_speech_config_cache_st **p = &context->speech_configs;
+	while (*p && !ms_speech_config_cache_key_equal((*p)->key, key))
+		p = &(*p)->next;
+	if (!*p)
+		return;
+
+	struct ms_speech_config_cache_st *entry = *p;
+	*p = entry->next;
+	ms_speech_config_cache_free(entry);
+}
+
+void ms_speech_config_cache_store(ms_speech_context_t context, const char *key, const char *body, size_t body_length, int registered)
+{
+	ms_speech_config_cache_remove(context, key);
+
+	struct ms_speech_config_cache_st *entry = (struct ms_speech_config_cache_st *)malloc(sizeof(struct ms_speech_config_cache_st));
+	memset(entry, 0, sizeof(struct ms_speech_config_cache_st));
+	if (key)
+		entry->key = strdup(key);
+	entry->body = (char *)malloc(body_length);
+	memcpy(entry->body, body, body_length);
+	entry->body_length = body_length;
+	entry->registered = registered;
+
+	entry->next = context->speech_configs;
+	context->speech_configs = entry;
+}
+
+void ms_speech_config_cache_destroy(ms_speech_context_t context)
+{
+	while (context->speech_configs) {
+		struct ms_speech_config_cache_st *entry = context->speech_configs;
+		context->speech_configs = entry->next;
+		ms_speech_config_cache_free(entry);
+	}
+}
+
+int ms_speech_context_set_speech_config(ms_speech_context_t context, const char *key, const char *json)
+{
+	if (!json) {
+		ms_speech_config_cache_remove(context, key);
+		return 0;
+	}
+
+	// cheap sanity check, the payload is sent as is
+	while (*json == ' ' || *json == '\t' || *json == '\r' || *json == '\n')
+		json++;
+	size_t length = strlen(json);
+	while (length && (json[length - 1] == ' ' || json[length - 1] == '\t' || json[length - 1] == '\r' || json[length - 1] == '\n'))
+		length--;
+	if (length < 2 || json[0] != '{' || json[length - 1] != '}')
+		return -EINVAL;
+
+	ms_speech_config_cache_store(context, key, json, length, 1);
+
+	return 0;
+}
@@ -0,0 +1,39 @@
+/*
+
+Copyright 2017 technicianted
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+*/
+#ifndef ms_speech_config_cache_h
+#define ms_speech_config_cache_h
+
+#include <stddef.h>
+
+#include "ms_speech_priv.h"
+
+// serialized speech.config bodies shared by the connections of a context
+struct ms_speech_config_cache_st {
+	// NULL for connections without a speech_config_key
+	char *key;
+	char *body;
+	size_t body_length;
+	// set by ms_speech_context_set_speech_config(), overlays are skipped
+	int registered;
+
+	struct ms_speech_config_cache_st *next;
+};
+
+const struct ms_speech_config_cache_st *ms_speech_config_cache_find(ms_speech_context_t context, const char *key);
+void ms_speech_config_cache_store(ms_speech_context_t context, const char *key, const char *body, size_t body_length, int registered);
+void ms_speech_config_cache_destroy(ms_speech_context_t context);
+
+#endif /* ms_speech_config_cache_h */
@@ -0,0 +1,249 @@
+/*
+
+Copyright 2017 technicianted
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+*/
+
+#include <errno.h>
+#include <time.h>
+
+#include "compat.h"
+#include "ms_speech_endpoint_set.h"
+#include "ms_speech_logging_priv.h"
+#include "ms_speech_timestamp.h"
+
+static void ms_speech_endpoint_set_free(ms_speech_endpoint_set_t set)
+{
+	for (int i=0; i<set->num_endpoints; i++)
+		free(set->endpoints[i].uri);
+	free(set->endpoints);
+	free(set);
+}
+
+static void ms_speech_endpoint_set_sample(double *ewma, double value)
+{
+	*ewma += MS_SPEECH_ENDPOINT_SET_EWMA_ALPHA * (value - *ewma);
+}
+
+static void ms_speech_endpoint_set_sample_latency(double *ewma, double value)
+{
+	// seed with the first measurement rather than decaying up from zero
+	if (*ewma == 0.0)
+		*ewma = value;
+	else
+		ms_speech_endpoint_set_sample(ewma, value);
+}
+
+static double ms_speech_endpoint_set_score(const ms_speech_endpoint_health_t *endpoint)
+{
+	// lower is better, the constant keeps errors counting before any latency is known
+	return (1.0 + endpoint->connect_time_ms + endpoint->first_result_ms) *
+		(1.0 + MS_SPEECH_ENDPOINT_SET_ERROR_WEIGHT * endpoint->error_rate);
+}
+
+ms_speech_endpoint_set_t ms_speech_create_endpoint_set(ms_speech_context_t context, const char * const *uris, int num_uris)
+{
+	if (num_uris < 1)
+		return NULL;
+
+	ms_speech_endpoint_set_t set = (ms_speech_endpoint_set_t)malloc(sizeof(struct ms_speech_endpoint_set_st));
+	memset(set, 0, sizeof(struct ms_speech_endpoint_set_st));
+	set->context = context;
+	set->num_endpoints = num_uris;
+	set->endpoints = (ms_speech_endpoint_health_t *)calloc(num_uris, sizeof(ms_speech_endpoint_health_t));
+	for (int i=0; i<num_uris; i++)
+		set->endpoints[i].uri = strdup(uris[i]);
+	set->seed = (unsigned int)time(NULL) ^ (unsigned int)(uintptr_t)set;
+
+	return set;
+}
+
+void ms_speech_destroy_endpoint_set(ms_speech_endpoint_set_t set)
+{
+	set->destroyed = 1;
+	if (!set->refs)
+		ms_speech_endpoint_set_free(set);
+}
+
+static int ms_speech_endpoint_set_pick(ms_speech_endpoint_set_t set)
+{
+	uint64_t now = ms_speech_get_monotonic_ms();
+
+	int num_eligible = 0;
+	int soonest = 0;
+	for (int i=0; i<set->num_endpoints; i++) {
+		if (set->endpoints[i].ejected_until <= now)
+			num_eligible++;
+		if (set->endpoints[i].ejected_until < set->endpoints[soonest].ejected_until)
+			soonest = i;
+	}
+
+	// everything is ejected, fail open on the one coming back first
+	if (!num_eligible)
+		return soonest;
+
+	// power of two choices among the eligible endpoints
+	int choices[2] = { rand_r(&set->seed) % num_eligible, 0 };
+	int num_choices = 1;
+	if (num_eligible > 1) {
+		choices[1] = rand_r(&set->seed) % (num_eligible - 1);
+		if (choices[1] >= choices[0])
+			choices[1]++;
+		num_choices = 2;
+	}
+
+	int best = -1;
+	for (int c=0; c<num_choices; c++) {
+		int rank = choices[c];
+		for (int i=0; i<set->num_endpoints; i++) {
+			if (set->endpoints[i].ejected_until > now)
+				continue;
+			if (rank--)
+				continue;
+
+			if (best < 0 || ms_speech_endpoint_set_score(&set->endpoints[i]) < ms_speech_endpoint_set_score(&set->endpoints[best]))
+				best = i;
+			break;
+		}
+	}
+
+	return best;
+}
+
+int ms_speech_endpoint_set_connect(ms_speech_endpoint_set_t set, ms_speech_client_callbacks_t *callbacks, ms_speech_connection_t *conn)
+{
+	int index = ms_speech_endpoint_set_pick(set);
+	ms_speech_endpoint_health_t *endpoint = &set->endpoints[index];
+
+	ms_speech_log(MS_SPEECH_LOG_DEBUG,
+				  "Routing connection to %s, score: %.1f",
+				  endpoint->uri,
+				  ms_speech_endpoint_set_score(endpoint));
+
+	int r = ms_speech_connect(set->context, endpoint->uri, callbacks, conn);
+	if (r) {
+		endpoint->failures++;
+		ms_speech_endpoint_set_sample(&endpoint->error_rate, 1.0);
+		return r;
+	}
+
+	(*conn)->endpoint_set = set;
+	(*conn)->endpoint_set_index = index;
+	set->refs++;
+	endpoint->connections++;
+
+	return 0;
+}
+
+int ms_speech_endpoint_set_get_stats(ms_speech_endpoint_set_t set, int index, ms_speech_endpoint_stats_t *stats)
+{
+	if (index < 0 || index >= set->num_endpoints)
+		return -EINVAL;
+
+	ms_speech_endpoint_health_t *endpoint = &set->endpoints[index];
+	memset(stats, 0, sizeof(ms_speech_endpoint_stats_t));
+	stats->uri = endpoint->uri;
+	stats->connect_time_ms = endpoint->connect_time_ms;
+	stats->first_result_ms = endpoint->first_result_ms;
+	stats->error_rate = endpoint->error_rate;
+	stats->score = ms_speech_endpoint_set_score(endpoint);
+	stats->ejected = endpoint->ejected_until > ms_speech_get_monotonic_ms();
+	stats->connections = endpoint->connections;
+	stats->failures = endpoint->failures;
+
+	return 0;
+}
+
+void ms_speech_endpoint_set_handle_connecting(ms_speech_connection_t connection)
+{
+	connection->connect_started_at = ms_speech_get_monotonic_ms();
+}
+
+void ms_speech_endpoint_set_handle_connected(ms_speech_connection_t connection)
+{
+	ms_speech_endpoint_set_t set = connection->endpoint_set;
+	if (!set)
+		return;
+
+	ms_speech_endpoint_health_t *endpoint = &set->endpoints[connection->endpoint_set_index];
+	ms_speech_endpoint_set_sample_latency(&endpoint->connect_time_ms, (double)(ms_speech_get_monotonic_ms() - connection->connect_started_at));
+	ms_speech_endpoint_set_sample(&endpoint->error_rate, 0.0);
+	endpoint->consecutive_failures = 0;
+	endpoint->ejections = 0;
+}
+
+void ms_speech_endpoint_set_handle_error(ms_speech_connection_t connection)
+{
+	ms_speech_endpoint_set_t set = connection->endpoint_set;
+	if (!set)
+		return;
+
+	ms_speech_endpoint_health_t *endpoint = &set->endpoints[connection->endpoint_set_index];
+	ms_speech_endpoint_set_sample(&endpoint->error_rate, 1.0);
+	endpoint->failures++;
+	if (++endpoint->consecutive_failures < MS_SPEECH_ENDPOINT_SET_EJECT_FAILURES)
+		return;
+
+	int eject_ms = MS_SPEECH_ENDPOINT_SET_MIN_EJECT_MS;
+	for (int i=0; i<endpoint->ejections && eject_ms < MS_SPEECH_ENDPOINT_SET_MAX_EJECT_MS; i++)
+		eject_ms *= 2;
+	if (eject_ms > MS_SPEECH_ENDPOINT_SET_MAX_EJECT_MS)
+		eject_ms = MS_SPEECH_ENDPOINT_SET_MAX_EJECT_MS;
+
+	endpoint->ejections++;
+	endpoint->consecutive_failures = 0;
+	endpoint->ejected_until = ms_speech_get_monotonic_ms() + eject_ms;
+
+	ms_speech_log(MS_SPEECH_LOG_WARN,
+				  "Ejecting %s for %dms after %d failures",
+				  endpoint->uri,
+				  eject_ms,
+				  MS_SPEECH_ENDPOINT_SET_EJECT_FAILURES);
+}
+
+void ms_speech_endpoint_set_handle_closed(ms_speech_connection_t connection)
+{
+	// dropping a request midway counts against the endpoint
+	if (connection->status == MS_SPEECH_CLIENT_STREAMING ||
+		connection->status == MS_SPEECH_CLIENT_STREAMING_BLOCKED ||
+		connection->status == MS_SPEECH_CLIENT_TURN_PENDING)
+		ms_speech_endpoint_set_handle_error(connection);
+}
+
+void ms_speech_endpoint_set_handle_request(ms_speech_connection_t connection)
+{
+	connection->request_started_at = ms_speech_get_monotonic_ms();
+	connection->result_seen = 0;
+}
+
+void ms_speech_endpoint_set_handle_result(ms_speech_connection_t connection)
+{
+	ms_speech_endpoint_set_t set = connection->endpoint_set;
+	if (!set || connection->result_seen)
+		return;
+
+	connection->result_seen = 1;
+	ms_speech_endpoint_health_t *endpoint = &set->endpoints[connection->endpoint_set_index];
+	ms_speech_endpoint_set_sample_latency(&endpoint->first_result_ms, (double)(ms_speech_get_monotonic_ms() - connection->request_started_at));
+}
+
+void ms_speech_endpoint_set_release(ms_speech_connection_t connection)
+{
+	ms_speech_endpoint_set_t set = connection->endpoint_set;
+	if (!set)
+		return;
+
+	connection->endpoint_set = NULL;
+	if (!--set->refs && set->destroyed)
+		ms_speech_endpoint_set_free(set);
+}
@@ -0,0 +1,67 @@
+/*
+
+Copyright 2017 technicianted
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+*/
+
+#ifndef ms_speech_endpoint_set_h
+#define ms_speech_endpoint_set_h
+
+#include <stdint.h>
+
+#include "ms_speech_priv.h"
+
+#define MS_SPEECH_ENDPOINT_SET_EWMA_ALPHA 0.2
+// error rate weight in the score, an endpoint failing half of the time
+// scores as if it were six times slower
+#define MS_SPEECH_ENDPOINT_SET_ERROR_WEIGHT 10.0
+#define MS_SPEECH_ENDPOINT_SET_EJECT_FAILURES 3
+#define MS_SPEECH_ENDPOINT_SET_MIN_EJECT_MS 10000
+#define MS_SPEECH_ENDPOINT_SET_MAX_EJECT_MS 300000
+
+typedef struct {
+	char *uri;
+
+	double connect_time_ms;
+	double first_result_ms;
+	double error_rate;
+
+	int consecutive_failures;
+	int ejections;
+	uint64_t ejected_until;
+
+	unsigned long connections;
+	unsigned long failures;
+} ms_speech_endpoint_health_t;
+
+struct ms_speech_endpoint_set_st {
+	ms_speech_context_t context;
+
+	ms_speech_endpoint_health_t *endpoints;
+	int num_endpoints;
+	unsigned int seed;
+
+	// connections still reporting into the set
+	int refs;
+	int destroyed;
+};
+
+void ms_speech_endpoint_set_handle_connecting(ms_speech_connection_t connection);
+void ms_speech_endpoint_set_handle_connected(ms_speech_connection_t connection);
+void ms_speech_endpoint_set_handle_error(ms_speech_connection_t connection);
+void ms_speech_endpoint_set_handle_closed(ms_speech_connection_t connection);
+void ms_speech_endpoint_set_handle_request(ms_speech_connection_t connection);
+void ms_speech_endpoint_set_handle_result(ms_speech_connection_t connection);
+void ms_speech_endpoint_set_release(ms_speech_connection_t connection);
+
+#endif /* ms_speech_endpoint_set_h */
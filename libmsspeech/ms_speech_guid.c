@@ -13,18 +13,186 @@ The above copyright notice and this permission notice shall be included in
 all copies or substantial portions of the Software.
 
 */
-
 #include "ms_speech_guid.h"
 
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef HAVE_GETRANDOM
+#include <sys/random.h>
+#endif
+
+// IDs only need to be unique, a per-thread xoshiro256** seeded from the
+// kernel avoids libuuid locking and reading /dev/urandom every time
+typedef struct {
+	uint64_t s[4];
+	unsigned int generation;
+	int seeded;
+} ms_speech_guid_state_t;
+
+static __thread ms_speech_guid_state_t guid_state;
+// bumped in forked children so that they do not repeat their parent
+static unsigned int guid_generation;
+static pthread_once_t guid_once = PTHREAD_ONCE_INIT;
+
+static const char ms_speech_guid_hex_pairs[] =
+	"000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"
+	"202122232425262728292a2b2c2d2e2f303132333435363738393a3b3c3d3e3f"
+	"404142434445464748494a4b4c4d4e4f505152535455565758595a5b5c5d5e5f"
+	"606162636465666768696a6b6c6d6e6f707172737475767778797a7b7c7d7e7f"
+	"808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f"
+	"a0a1a2a3a4a5a6a7a8a9aaabacadaeafb0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+	"c0c1c2c3c4c5c6c7c8c9cacbcccdcecfd0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+	"e0e1e2e3e4e5e6e7e8e9eaebecedeeeff0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+
+static void ms_speech_guid_handle_fork()
+{
+	__atomic_add_fetch(&guid_generation, 1, __ATOMIC_RELAXED);
+}
+
+static void ms_speech_guid_register_fork()
+{
+	pthread_atfork(NULL, NULL, &ms_speech_guid_handle_fork);
+}
+
+static uint64_t ms_speech_guid_splitmix(uint64_t *x)
+{
+	uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static size_t ms_speech_guid_read_entropy(unsigned char *buffer, size_t len)
+{
+	size_t got = 0;
+#ifdef HAVE_GETRANDOM
+	while (got < len) {
+		ssize_t r = getrandom(buffer + got, len - got, 0);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			break;
+		got += r;
+	}
+#endif
+	if (got < len) {
+		int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+		if (fd >= 0) {
+			ssize_t r;
+			while (got < len && ((r = read(fd, buffer + got, len - got)) > 0 || (r < 0 && errno == EINTR)))
+				got += r > 0 ? r : 0;
+			close(fd);
+		}
+	}
+
+	return got;
+}
+
+static void ms_speech_guid_seed(ms_speech_guid_state_t *state)
+{
+	uint64_t seed[4] = { 0 };
+	if (ms_speech_guid_read_entropy((unsigned char *)seed, sizeof(seed)) < sizeof(seed)) {
+		// last resort, still distinct per thread and process
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		seed[0] ^= (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+		seed[1] ^= (uint64_t)(uintptr_t)state;
+		seed[2] ^= (uint64_t)getpid();
+	}
+
+	// spread the seed so that the state can not be all zeros in practice
+	uint64_t x = 0;
+	for (int i=0; i<4; i++) {
+		x ^= seed[i];
+		state->s[i] = ms_speech_guid_splitmix(&x);
+	}
+	state->generation = __atomic_load_n(&guid_generation, __ATOMIC_RELAXED);
+	state->seeded = 1;
+}
+
+static inline uint64_t ms_speech_guid_rotl(uint64_t x, int k)
+{
+	return (x << k) | (x >> (64 - k));
+}
+
+static inline uint64_t ms_speech_guid_next(ms_speech_guid_state_t *state)
+{
+	uint64_t *s = state->s;
+	uint64_t result = ms_speech_guid_rotl(s[1] * 5, 7) * 9;
+	uint64_t t = s[1] << 17;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = ms_speech_guid_rotl(s[3], 45);
+
+	return result;
+}
+
+static ms_speech_guid_state_t *ms_speech_guid_get_state()
+{
+	ms_speech_guid_state_t *state = &guid_state;
+	if (!state->seeded) {
+		pthread_once(&guid_once, &ms_speech_guid_register_fork);
+		ms_speech_guid_seed(state);
+	} else if (state->generation != __atomic_load_n(&guid_generation, __ATOMIC_RELAXED)) {
+		ms_speech_guid_seed(state);
+	}
+
+	return state;
+}
+
+static void ms_speech_guid_random_uuid(ms_speech_guid_state_t *state, uuid_t uuid)
+{
+	uint64_t high = ms_speech_guid_next(state);
+	uint64_t low = ms_speech_guid_next(state);
+	memcpy(uuid, &high, sizeof(high));
+	memcpy(uuid + sizeof(high), &low, sizeof(low));
+
+	// version 4, RFC 4122 variant
+	uuid[6] = (uuid[6] & 0x0f) | 0x40;
+	uuid[8] = (uuid[8] & 0x3f) | 0x80;
+}
+
+static char *ms_speech_guid_hex(char *p, const unsigned char *bytes, int count)
+{
+	for (int i=0; i<count; i++) {
+		memcpy(p, &ms_speech_guid_hex_pairs[bytes[i] * 2], 2);
+		p += 2;
+	}
+
+	return p;
+}
 
 int ms_speech_generate_guid(char *buffer, size_t len, int canonical_form)
 {
 	uuid_t uuid;
-	uuid_generate(uuid);
+	ms_speech_guid_random_uuid(ms_speech_guid_get_state(), uuid);
 	return ms_speech_uuid_to_char(uuid, buffer, len, canonical_form);
 }
 
+int ms_speech_generate_guids(char *buffers, size_t stride, int count, int canonical_form)
+{
+	if (stride < (canonical_form ? MS_SPEECH_CANONICAL_GUID_SIZE : MS_SPEECH_GUID_SIZE))
+		return -EINVAL;
+
+	ms_speech_guid_state_t *state = ms_speech_guid_get_state();
+	for (int i=0; i<count; i++) {
+		uuid_t uuid;
+		ms_speech_guid_random_uuid(state, uuid);
+		ms_speech_uuid_to_char(uuid, buffers + i * stride, stride, canonical_form);
+	}
+
+	return count;
+}
+
 int ms_speech_sanitize_guid(const char *input, char *buffer, size_t len, int canonical_form)
 {
 	uuid_t uuid;
@@ -36,23 +204,27 @@ int ms_speech_sanitize_guid(const char *input, char *buffer, size_t len, int can
 
 int ms_speech_uuid_to_char(uuid_t uuid, char *buffer, size_t len, int canonical_form)
 {
-	int r = 0;
+	char *p = buffer;
 	if (canonical_form) {
-		if (len < 37)
-			r = -EINVAL;
-		else {
-			uuid_unparse(uuid, buffer);
-			r = 36;
-		}
+		if (len < MS_SPEECH_CANONICAL_GUID_SIZE)
+			return -EINVAL;
+
+		p = ms_speech_guid_hex(p, uuid, 4);
+		*p++ = '-';
+		p = ms_speech_guid_hex(p, uuid + 4, 2);
+		*p++ = '-';
+		p = ms_speech_guid_hex(p, uuid + 6, 2);
+		*p++ = '-';
+		p = ms_speech_guid_hex(p, uuid + 8, 2);
+		*p++ = '-';
+		p = ms_speech_guid_hex(p, uuid + 10, 6);
 	} else {
-		if (len < 33)
-			r = -EINVAL;
-		else {
-			for(int i=0; i<sizeof(uuid_t); i++)
-				sprintf(buffer + i*2, "%02x", uuid[i]);
-			r = 32;
-		}
+		if (len < MS_SPEECH_GUID_SIZE)
+			return -EINVAL;
+
+		p = ms_speech_guid_hex(p, uuid, sizeof(uuid_t));
 	}
+	*p = '\0';
 	
-	return r;
+	return (int)(p - buffer);
 }
@@ -13,14 +13,18 @@ The above copyright notice and this permission notice shall be included in
 all copies or substantial portions of the Software.
 
 */
-
 #ifndef ms_speech_guid_h
 #define ms_speech_guid_h
 
 #include <stdio.h>
 #include <uuid/uuid.h>
 
+// sizes including the terminating NUL
+#define MS_SPEECH_GUID_SIZE 33
+#define MS_SPEECH_CANONICAL_GUID_SIZE 37
+
 int ms_speech_generate_guid(char *buffer, size_t len, int canonical_form);
+int ms_speech_generate_guids(char *buffers, size_t stride, int count, int canonical_form);
 int ms_speech_sanitize_guid(const char *input, char *buffer, size_t len, int canonical_form);
 int ms_speech_uuid_to_char(uuid_t uuid, char *buffer, size_t len, int canonical_form);
 
@@ -0,0 +1,113 @@
+/*
+
+Copyright 2017 technicianted
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+*/
+
+#include <string.h>
+
+#include "ms_speech_histogram.h"
+
+static int ms_speech_histogram_index(uint64_t value)
+{
+	if (value < MS_SPEECH_HISTOGRAM_SUB_BUCKETS)
+		return (int)value;
+
+	if (value >> (MS_SPEECH_HISTOGRAM_MAX_EXPONENT + 1))
+		return MS_SPEECH_HISTOGRAM_BUCKETS - 1;
+
+	int exponent = 63 - __builtin_clzll(value);
+	int sub = (int)(value >> (exponent - MS_SPEECH_HISTOGRAM_SUB_BITS)) & (MS_SPEECH_HISTOGRAM_SUB_BUCKETS - 1);
+	return (exponent - MS_SPEECH_HISTOGRAM_SUB_BITS + 1) * MS_SPEECH_HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+static uint64_t ms_speech_histogram_midpoint(int index)
+{
+	if (index < MS_SPEECH_HISTOGRAM_SUB_BUCKETS)
+		return index;
+
+	int exponent = index / MS_SPEECH_HISTOGRAM_SUB_BUCKETS + MS_SPEECH_HISTOGRAM_SUB_BITS - 1;
+	int sub = index % MS_SPEECH_HISTOGRAM_SUB_BUCKETS;
+	uint64_t width = (uint64_t)1 << (exponent - MS_SPEECH_HISTOGRAM_SUB_BITS);
+	return (uint64_t)(MS_SPEECH_HISTOGRAM_SUB_BUCKETS + sub) * width + width / 2;
+}
+
+void ms_speech_histogram_initialize(ms_speech_histogram_t *histogram)
+{
+	memset(histogram, 0, sizeof(ms_speech_histogram_t));
+	histogram->min = UINT64_MAX;
+}
+
+void ms_speech_histogram_record(ms_speech_histogram_t *histogram, uint64_t value)
+{
+	__atomic_fetch_add(&histogram->counts[ms_speech_histogram_index(value)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&histogram->sum, value, __ATOMIC_RELAXED);
+
+	uint64_t current = __atomic_load_n(&histogram->min, __ATOMIC_RELAXED);
+	while (value < current &&
+		   !__atomic_compare_exchange_n(&histogram->min, &current, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	current = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+	while (value > current &&
+		   !__atomic_compare_exchange_n(&histogram->max, &current, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	// count last so that readers never see more samples than buckets hold
+	__atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELEASE);
+}
+
+uint64_t ms_speech_histogram_percentile(const ms_speech_histogram_t *histogram, double percentile)
+{
+	uint64_t count = __atomic_load_n(&histogram->count, __ATOMIC_ACQUIRE);
+	if (!count)
+		return 0;
+
+	uint64_t rank = (uint64_t)(percentile / 100.0 * count + 0.5);
+	if (rank < 1)
+		rank = 1;
+	if (rank > count)
+		rank = count;
+
+	uint64_t seen = 0;
+	for (int i=0; i<MS_SPEECH_HISTOGRAM_BUCKETS; i++) {
+		seen += __atomic_load_n(&histogram->counts[i], __ATOMIC_RELAXED);
+		if (seen < rank)
+			continue;
+
+		// keep estimates within the observed range
+		uint64_t value = ms_speech_histogram_midpoint(i);
+		uint64_t min = __atomic_load_n(&histogram->min, __ATOMIC_RELAXED);
+		uint64_t max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+		if (value < min)
+			value = min;
+		if (value > max)
+			value = max;
+		return value;
+	}
+
+	return __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+}
+
+void ms_speech_histogram_get_stats(const ms_speech_histogram_t *histogram, ms_speech_latency_stats_t *stats)
+{
+	memset(stats, 0, sizeof(ms_speech_latency_stats_t));
+	stats->count = __atomic_load_n(&histogram->count, __ATOMIC_ACQUIRE);
+	if (!stats->count)
+		return;
+
+	// recorded in microseconds, reported in milliseconds
+	stats->min_ms = __atomic_load_n(&histogram->min, __ATOMIC_RELAXED) / 1000.0;
+	stats->max_ms = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED) / 1000.0;
+	stats->mean_ms = __atomic_load_n(&histogram->sum, __ATOMIC_RELAXED) / 1000.0 / stats->count;
+	stats->p50_ms = ms_speech_histogram_percentile(histogram, 50) / 1000.0;
+	stats->p90_ms = ms_speech_histogram_percentile(histogram, 90) / 1000.0;
+	stats->p99_ms = ms_speech_histogram_percentile(histogram, 99) / 1000.0;
+}
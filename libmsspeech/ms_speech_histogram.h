@@ -0,0 +1,45 @@
+/*
+
+Copyright 2017 technicianted
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+*/
+
+#ifndef ms_speech_histogram_h
+#define ms_speech_histogram_h
+
+#include <stdint.h>
+
+#include "ms_speech/ms_speech.h"
+
+// values below 2^SUB_BITS are exact, above that every power of two is split
+// into 2^SUB_BITS linear buckets, bounding the relative error to 12.5%
+#define MS_SPEECH_HISTOGRAM_SUB_BITS 3
+#define MS_SPEECH_HISTOGRAM_SUB_BUCKETS (1 << MS_SPEECH_HISTOGRAM_SUB_BITS)
+#define MS_SPEECH_HISTOGRAM_MAX_EXPONENT 35
+#define MS_SPEECH_HISTOGRAM_BUCKETS ((MS_SPEECH_HISTOGRAM_MAX_EXPONENT - MS_SPEECH_HISTOGRAM_SUB_BITS + 2) * MS_SPEECH_HISTOGRAM_SUB_BUCKETS)
+
+// updated with relaxed atomics, may be recorded and read from any thread
+typedef struct ms_speech_histogram_st {
+	uint64_t counts[MS_SPEECH_HISTOGRAM_BUCKETS];
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+} ms_speech_histogram_t;
+
+void ms_speech_histogram_initialize(ms_speech_histogram_t *histogram);
+void ms_speech_histogram_record(ms_speech_histogram_t *histogram, uint64_t value);
+uint64_t ms_speech_histogram_percentile(const ms_speech_histogram_t *histogram, double percentile);
+void ms_speech_histogram_get_stats(const ms_speech_histogram_t *histogram, ms_speech_latency_stats_t *stats);
+
+#endif /* ms_speech_histogram_h */
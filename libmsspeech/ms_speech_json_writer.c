@@ -0,0 +1,285 @@
+/*
+
+Copyright 2017 technicianted
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+*/
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+
+#include "ms_speech_json_writer.h"
+
+static const char ms_speech_json_hex[] = "0123456789abcdef";
+
+void ms_speech_json_writer_initialize(ms_speech_json_writer_t writer, size_t headroom, size_t size_hint)
+{
+	memset(writer, 0, sizeof(struct ms_speech_json_writer_st));
+	writer->headroom = headroom;
+	writer->length = headroom;
+	writer->capacity = headroom + (size_hint > MS_SPEECH_JSON_WRITER_MIN_CAPACITY ? size_hint : MS_SPEECH_JSON_WRITER_MIN_CAPACITY);
+	writer->buffer = (char *)malloc(writer->capacity);
+	if (!writer->buffer)
+		writer->failed = 1;
+}
+
+void ms_speech_json_writer_destroy(ms_speech_json_writer_t writer)
+{
+	free(writer->buffer);
+	writer->buffer = NULL;
+}
+
+static char *ms_speech_json_reserve(ms_speech_json_writer_t writer, size_t len)
+{
+	if (writer->failed)
+		return NULL;
+
+	if (writer->length + len > writer->capacity) {
+		size_t capacity = writer->capacity * 2;
+		while (capacity < writer->length + len)
+			capacity *= 2;
+		char *buffer = (char *)realloc(writer->buffer, capacity);
+		if (!buffer) {
+			writer->failed = 1;
+			return NULL;
+		}
+		writer->buffer = buffer;
+		writer->capacity = capacity;
+	}
+
+	return writer->buffer + writer->length;
+}
+
+static void ms_speech_json_append(ms_speech_json_writer_t writer, const char *text, size_t len)
+{
+	char *p = ms_speech_json_reserve(writer, len);
+	if (!p)
+		return;
+
+	memcpy(p, text, len);
+	writer->length += len;
+}
+
+static void ms_speech_json_append_char(ms_speech_json_writer_t writer, char c)
+{
+	char *p = ms_speech_json_reserve(writer, 1);
+	if (!p)
+		return;
+
+	*p = c;
+	writer->length++;
+}
+
+// separates a member or element from the one before it
+static int ms_speech_json_begin_value(ms_speech_json_writer_t writer)
+{
+	if (writer->failed)
+		return -1;
+
+	if (writer->after_key) {
+		writer->after_key = 0;
+		return 0;
+	}
+	if (writer->depth > 0) {
+		uint64_t bit = 1ULL << (writer->depth - 1);
+		if (writer->has_members & bit)
+			ms_speech_json_append_char(writer, ',');
+		writer->has_members |= bit;
+	}
+
+	return 0;
+}
+
+static void ms_speech_json_append_string(ms_speech_json_writer_t writer, const char *value)
+{
+	ms_speech_json_append_char(writer, '"');
+
+	const char *run = value;
+	const char *p;
+	for (p = value; *p; p++) {
+		unsigned char c = (unsigned char)*p;
+		if (c >= 0x20 && c != '"' && c != '\\')
+			continue;
+
+		// copy the plain run in one go
+		ms_speech_json_append(writer, run, p - run);
+		run = p + 1;
+
+		char escape[6] = { '\\', 0, 0, 0, 0, 0 };
+		switch (c) {
+			case '"': escape[1] = '"'; break;
+			case '\\': escape[1] = '\\'; break;
+			case '\b': escape[1] = 'b'; break;
+			case '\f': escape[1] = 'f'; break;
+			case '\n': escape[1] = 'n'; break;
+			case '\r': escape[1] = 'r'; break;
+			case '\t': escape[1] = 't'; break;
+			default:
+				escape[1] = 'u';
+				escape[2] = '0';
+				escape[3] = '0';
+				escape[4] = ms_speech_json_hex[c >> 4];
+				escape[5] = ms_speech_json_hex[c & 0xf];
+				ms_speech_json_append(writer, escape, 6);
+				continue;
+		}
+		ms_speech_json_append(writer, escape, 2);
+	}
+	ms_speech_json_append(writer, run, p - run);
+
+	ms_speech_json_append_char(writer, '"');
+}
+
+static int ms_speech_json_open(ms_speech_json_writer_t writer, char c)
+{
+	if (ms_speech_json_begin_value(writer))
+		return -1;
+	if (writer->depth == MS_SPEECH_JSON_WRITER_MAX_DEPTH) {
+		writer->failed = 1;
+		return -1;
+	}
+
+	ms_speech_json_append_char(writer, c);
+	writer->depth++;
+	writer->has_members &= ~(1ULL << (writer->depth - 1));
+
+	return writer->failed ? -1 : 0;
+}
+
+static int ms_speech_json_close(ms_speech_json_writer_t writer, char c)
+{
+	if (writer->failed || writer->depth == 0 || writer->after_key) {
+		writer->failed = 1;
+		return -1;
+	}
+
+	writer->depth--;
+	ms_speech_json_append_char(writer, c);
+
+	return writer->failed ? -1 : 0;
+}
+
+int ms_speech_json_begin_object(ms_speech_json_writer_t writer)
+{
+	return ms_speech_json_open(writer, '{');
+}
+
+int ms_speech_json_end_object(ms_speech_json_writer_t writer)
+{
+	return ms_speech_json_close(writer, '}');
+}
+
+int ms_speech_json_begin_array(ms_speech_json_writer_t writer)
+{
+	return ms_speech_json_open(writer, '[');
+}
+
+int ms_speech_json_end_array(ms_speech_json_writer_t writer)
+{
+	return ms_speech_json_close(writer, ']');
+}
+
+int ms_speech_json_key(ms_speech_json_writer_t writer, const char *key)
+{
+	if (writer->after_key || ms_speech_json_begin_value(writer)) {
+		writer->failed = 1;
+		return -1;
+	}
+
+	ms_speech_json_append_string(writer, key);
+	ms_speech_json_append_char(writer, ':');
+	writer->after_key = 1;
+
+	return writer->failed ? -1 : 0;
+}
+
+int ms_speech_json_string(ms_speech_json_writer_t writer, const char *value)
+{
+	if (!value)
+		return ms_speech_json_null(writer);
+	if (ms_speech_json_begin_value(writer))
+		return -1;
+
+	ms_speech_json_append_string(writer, value);
+
+	return writer->failed ? -1 : 0;
+}
+
+int ms_speech_json_int(ms_speech_json_writer_t writer, int64_t value)
+{
+	if (ms_speech_json_begin_value(writer))
+		return -1;
+
+	char number[24];
+	int len = snprintf(number, sizeof(number), "%lld", (long long)value);
+	ms_speech_json_append(writer, number, len);
+
+	return writer->failed ? -1 : 0;
+}
+
+int ms_speech_json_double(ms_speech_json_writer_t writer, double value)
+{
+	// JSON has no representation for these
+	if (!isfinite(value))
+		return ms_speech_json_null(writer);
+	if (ms_speech_json_begin_value(writer))
+		return -1;
+
+	char number[32];
+	int len = snprintf(number, sizeof(number), "%.17g", value);
+	ms_speech_json_append(writer, number, len);
+	if (!strpbrk(number, ".eE"))
+		ms_speech_json_append(writer, ".0", 2);
+
+	return writer->failed ? -1 : 0;
+}
+
+int ms_speech_json_bool(ms_speech_json_writer_t writer, int value)
+{
+	if (ms_speech_json_begin_value(writer))
+		return -1;
+
+	if (value)
+		ms_speech_json_append(writer, "true", 4);
+	else
+		ms_speech_json_append(writer, "false", 5);
+
+	return writer->failed ? -1 : 0;
+}
+
+int ms_speech_json_null(ms_speech_json_writer_t writer)
+{
+	if (ms_speech_json_begin_value(writer))
+		return -1;
+
+	ms_speech_json_append(writer, "null", 4);
+
+	return writer->failed ? -1 : 0;
+}
+
+int ms_speech_json_resume_object(ms_speech_json_writer_t writer, const char *json, size_t len)
+{
+	// reopen a serialized object so that more members can follow
+	if (len < 2 || json[0] != '{' || json[len - 1] != '}' || ms_speech_json_open(writer, '{'))
+		return -EINVAL;
+
+	ms_speech_json_append(writer, json + 1, len - 2);
+	for (size_t i=1; i<len - 1; i++) {
+		if (!isspace((unsigned char)json[i])) {
+			writer->has_members |= 1ULL << (writer->depth - 1);
+			break;
+		}
+	}
+
+	return writer->failed ? -ENOMEM : 0;
+}
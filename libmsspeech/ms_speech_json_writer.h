@@ -0,0 +1,45 @@
+/*
+
+Copyright 2017 technicianted
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+*/
+#ifndef ms_speech_json_writer_h
+#define ms_speech_json_writer_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "ms_speech_priv.h"
+
+#define MS_SPEECH_JSON_WRITER_MAX_DEPTH 64
+#define MS_SPEECH_JSON_WRITER_MIN_CAPACITY 256
+
+// appends JSON text to a buffer that starts with reserved headroom
+struct ms_speech_json_writer_st {
+	char *buffer;
+	size_t headroom;
+	size_t length;
+	size_t capacity;
+
+	int depth;
+	// bit per nesting level, set once the level has a member
+	uint64_t has_members;
+	int after_key;
+	int failed;
+};
+
+void ms_speech_json_writer_initialize(ms_speech_json_writer_t writer, size_t headroom, size_t size_hint);
+void ms_speech_json_writer_destroy(ms_speech_json_writer_t writer);
+int ms_speech_json_resume_object(ms_speech_json_writer_t writer, const char *json, size_t len);
+
+#endif /* ms_speech_json_writer_h */
@@ -0,0 +1,270 @@
+/*
+
+Copyright 2017 technicianted
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+*/
+
+#include <errno.h>
+#include <math.h>
+
+#include "compat.h"
+#include "ms_speech_latency.h"
+#include "ms_speech_tls.h"
+#include "ms_speech_timestamp.h"
+#include "ms_speech_memory.h"
+
+#define MS_SPEECH_LATENCY_REQUEST_PHASES \
+	((1u << MS_SPEECH_PHASE_FIRST_AUDIO_SENT) | \
+	 (1u << MS_SPEECH_PHASE_START_DETECTED) | \
+	 (1u << MS_SPEECH_PHASE_FIRST_HYPOTHESIS) | \
+	 (1u << MS_SPEECH_PHASE_END_DETECTED) | \
+	 (1u << MS_SPEECH_PHASE_FINAL_PHRASE) | \
+	 (1u << MS_SPEECH_PHASE_TURN_END))
+
+static void ms_speech_latency_record(ms_speech_connection_t connection, ms_speech_phase_t phase, uint64_t value_us)
+{
+	connection->latency->recorded |= 1u << phase;
+	if (connection->latency->histograms)
+		ms_speech_histogram_record(&connection->latency->histograms[phase], value_us);
+	if (connection->context->latency)
+		ms_speech_histogram_record(&connection->context->latency[phase], value_us);
+}
+
+void ms_speech_latency_initialize_context(ms_speech_context_t context)
+{
+	context->latency = (ms_speech_histogram_t *)malloc(MS_SPEECH_PHASE_COUNT * sizeof(ms_speech_histogram_t));
+	if (!context->latency)
+		return;
+
+	for (int i=0; i<MS_SPEECH_PHASE_COUNT; i++)
+		ms_speech_histogram_initialize(&context->latency[i]);
+}
+
+void ms_speech_latency_destroy_context(ms_speech_context_t context)
+{
+	free(context->latency);
+	context->latency = NULL;
+}
+
+int ms_speech_latency_initialize(ms_speech_connection_t connection)
+{
+	connection->latency = (struct ms_speech_latency_st *)calloc(1, sizeof(struct ms_speech_latency_st));
+	if (!connection->latency)
+		return -ENOMEM;
+	if (!connection->context->connection_latency)
+		return 0;
+
+	connection->latency->histograms = (ms_speech_histogram_t *)malloc(MS_SPEECH_PHASE_COUNT * sizeof(ms_speech_histogram_t));
+	if (!connection->latency->histograms) {
+		ms_speech_latency_destroy(connection);
+		return -ENOMEM;
+	}
+	for (int i=0; i<MS_SPEECH_PHASE_COUNT; i++)
+		ms_speech_histogram_initialize(&connection->latency->histograms[i]);
+
+	return 0;
+}
+
+static void ms_speech_latency_release_chunks(struct ms_speech_latency_st *latency)
+{
+	free(latency->chunks);
+	latency->chunks = NULL;
+	latency->num_slots = 0;
+	latency->num_chunks = 0;
+}
+
+void ms_speech_latency_destroy(ms_speech_connection_t connection)
+{
+	if (connection->latency) {
+		free(connection->latency->histograms);
+		free(connection->latency->chunks);
+	}
+	free(connection->latency);
+	connection->latency = NULL;
+}
+
+void ms_speech_latency_handle_connecting(ms_speech_connection_t connection)
+{
+	if (!connection->latency)
+		return;
+
+	connection->latency->connect_started_us = ms_speech_get_monotonic_us();
+	connection->latency->tcp_connected_us = 0;
+	connection->latency->recorded &= MS_SPEECH_LATENCY_REQUEST_PHASES;
+}
+
+void ms_speech_latency_handle_handshake(ms_speech_connection_t connection, struct lws *wsi)
+{
+	uint64_t handshake_start;
+	uint64_t handshake_done;
+
+	// without TLS the upgrade request goes out as soon as TCP is connected
+	if (connection->latency && ms_speech_tls_get_handshake_times(wsi, &handshake_start, &handshake_done))
+		connection->latency->tcp_connected_us = ms_speech_get_monotonic_us();
+}
+
+void ms_speech_latency_handle_established(ms_speech_connection_t connection, struct lws *wsi)
+{
+	struct ms_speech_latency_st *latency = connection->latency;
+	if (!latency || !latency->connect_started_us)
+		return;
+
+	uint64_t now = ms_speech_get_monotonic_us();
+	uint64_t handshake_start = 0;
+	uint64_t handshake_done = 0;
+	if (!ms_speech_tls_get_handshake_times(wsi, &handshake_start, &handshake_done)) {
+		// the client hello is sent right after TCP connects
+		latency->tcp_connected_us = handshake_start;
+		if (handshake_done >= latency->connect_started_us)
+			ms_speech_latency_record(connection, MS_SPEECH_PHASE_TLS_DONE, handshake_done - latency->connect_started_us);
+	}
+	if (latency->tcp_connected_us >= latency->connect_started_us)
+		ms_speech_latency_record(connection, MS_SPEECH_PHASE_TCP_CONNECTED, latency->tcp_connected_us - latency->connect_started_us);
+	ms_speech_latency_record(connection, MS_SPEECH_PHASE_UPGRADE_DONE, now - latency->connect_started_us);
+}
+
+void ms_speech_latency_handle_request(ms_speech_connection_t connection)
+{
+	struct ms_speech_latency_st *latency = connection->latency;
+	if (!latency)
+		return;
+
+	latency->request_started_us = ms_speech_get_monotonic_us();
+	latency->recorded &= ~MS_SPEECH_LATENCY_REQUEST_PHASES;
+
+	// result offsets restart with every request
+	latency->num_chunks = 0;
+	if (!latency->chunks)
+		latency->num_slots = 0;
+	latency->audio_offset = 0;
+	latency->bytes_per_second = MS_SPEECH_LATENCY_DEFAULT_BYTES_PER_SECOND;
+	latency->audio_seen = 0;
+}
+
+void ms_speech_latency_handle_status(ms_speech_connection_t connection, client_status_t old_status, client_status_t status)
+{
+	struct ms_speech_latency_st *latency = connection->latency;
+	if (!latency || old_status == status)
+		return;
+
+	if (status == MS_SPEECH_CLIENT_IDLE)
+		ms_speech_latency_release_chunks(latency);
+
+	if (status == MS_SPEECH_CLIENT_STREAMING_BLOCKED) {
+		latency->blocked_since_us = ms_speech_get_monotonic_us();
+	} else if (old_status == MS_SPEECH_CLIENT_STREAMING_BLOCKED && latency->blocked_since_us) {
+		ms_speech_latency_record(connection, MS_SPEECH_PHASE_STREAMING_BLOCKED, ms_speech_get_monotonic_us() - latency->blocked_since_us);
+		latency->blocked_since_us = 0;
+	}
+}
+
+void ms_speech_latency_mark(ms_speech_connection_t connection, ms_speech_phase_t phase)
+{
+	struct ms_speech_latency_st *latency = connection->latency;
+	if (!latency || (latency->recorded & (1u << phase)))
+		return;
+
+	// only the first occurrence per connect or request is recorded
+	uint64_t base = (MS_SPEECH_LATENCY_REQUEST_PHASES & (1u << phase)) ? latency->request_started_us : latency->connect_started_us;
+	if (base)
+		ms_speech_latency_record(connection, phase, ms_speech_get_monotonic_us() - base);
+}
+
+void ms_speech_latency_handle_audio(ms_speech_connection_t connection, const unsigned char *buffer, int len)
+{
+	struct ms_speech_latency_st *latency = connection->latency;
+	if (!latency || len <= 0)
+		return;
+
+	if (!latency->audio_seen) {
+		latency->audio_seen = 1;
+		if (len >= MS_SPEECH_LATENCY_WAV_HEADER_SIZE && !memcmp(buffer, "RIFF", 4)) {
+			int byte_rate = buffer[28] | (buffer[29] << 8) | (buffer[30] << 16) | (buffer[31] << 24);
+			if (byte_rate > 0)
+				latency->bytes_per_second = byte_rate;
+			len -= MS_SPEECH_LATENCY_WAV_HEADER_SIZE;
+		}
+	}
+
+	latency->audio_offset += len;
+	if (!latency->chunks) {
+		// negative once refused, lag is not measured for the rest of the request
+		int num_slots = connection->context->memory.latency_audio_chunks;
+		if (num_slots <= 0 || latency->num_slots < 0)
+			return;
+		if (ms_speech_memory_reserve(connection, num_slots * sizeof(ms_speech_latency_chunk_t)) ||
+			!(latency->chunks = (ms_speech_latency_chunk_t *)malloc(num_slots * sizeof(ms_speech_latency_chunk_t)))) {
+			latency->num_slots = -1;
+			return;
+		}
+		latency->num_slots = num_slots;
+	}
+
+	ms_speech_latency_chunk_t *chunk = &latency->chunks[latency->num_chunks++ % latency->num_slots];
+	chunk->end_offset = latency->audio_offset;
+	chunk->sent_us = ms_speech_get_monotonic_us();
+}
+
+double ms_speech_latency_handle_result(ms_speech_connection_t connection, ms_speech_phase_t phase, const ms_speech_phrase_timing_t *timing)
+{
+	struct ms_speech_latency_st *latency = connection->latency;
+	if (!latency || !latency->chunks || !latency->num_chunks)
+		return NAN;
+
+	uint64_t num_slots = (uint64_t)latency->num_slots;
+	uint64_t oldest = latency->num_chunks > num_slots ? latency->num_chunks - num_slots : 0;
+	double end = (timing->offset + timing->duration) * latency->bytes_per_second;
+	if (end < 0)
+		return NAN;
+
+	// first chunk containing the end of the result, rounding errors are
+	// attributed to the last chunk sent
+	uint64_t target = (uint64_t)end;
+	uint64_t low = oldest;
+	uint64_t high = latency->num_chunks - 1;
+	while (low < high) {
+		uint64_t middle = low + (high - low) / 2;
+		if (latency->chunks[middle % num_slots].end_offset < target)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	// the start of the oldest chunk is no longer known
+	if (low == oldest && oldest > 0)
+		return NAN;
+
+	ms_speech_latency_chunk_t *chunk = &latency->chunks[low % num_slots];
+	uint64_t lag_us = ms_speech_get_monotonic_us() - chunk->sent_us;
+	ms_speech_latency_record(connection, phase, lag_us);
+
+	return lag_us / 1000.0;
+}
+
+int ms_speech_connection_get_latency(ms_speech_connection_t connection, ms_speech_phase_t phase, ms_speech_latency_stats_t *stats)
+{
+	if (phase < 0 || phase >= MS_SPEECH_PHASE_COUNT || !connection->latency || !connection->latency->histograms)
+		return -EINVAL;
+
+	ms_speech_histogram_get_stats(&connection->latency->histograms[phase], stats);
+	return 0;
+}
+
+int ms_speech_context_get_latency(ms_speech_context_t context, ms_speech_phase_t phase, ms_speech_latency_stats_t *stats)
+{
+	if (phase < 0 || phase >= MS_SPEECH_PHASE_COUNT || !context->latency)
+		return -EINVAL;
+
+	ms_speech_histogram_get_stats(&context->latency[phase], stats);
+	return 0;
+}
@@ -0,0 +1,68 @@
+/*
+
+Copyright 2017 technicianted
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+*/
+
+#ifndef ms_speech_latency_h
+#define ms_speech_latency_h
+
+#include <stdint.h>
+
+#include "ms_speech_priv.h"
+#include "ms_speech_histogram.h"
+
+#define MS_SPEECH_LATENCY_DEFAULT_BYTES_PER_SECOND 32000
+#define MS_SPEECH_LATENCY_WAV_HEADER_SIZE 44
+
+typedef struct {
+	// audio offset at the end of the chunk, in bytes
+	uint64_t end_offset;
+	uint64_t sent_us;
+} ms_speech_latency_chunk_t;
+
+struct ms_speech_latency_st {
+	// one per phase when the context keeps connection latency, NULL otherwise
+	ms_speech_histogram_t *histograms;
+
+	uint64_t connect_started_us;
+	uint64_t tcp_connected_us;
+	uint64_t request_started_us;
+	uint64_t blocked_since_us;
+	// phases already recorded for the current connect or request
+	unsigned int recorded;
+
+	// send times of the last audio chunks of the current request, allocated
+	// on the first chunk and released once the connection is idle
+	ms_speech_latency_chunk_t *chunks;
+	int num_slots;
+	uint64_t num_chunks;
+	uint64_t audio_offset;
+	int bytes_per_second;
+	int audio_seen;
+};
+
+void ms_speech_latency_initialize_context(ms_speech_context_t context);
+void ms_speech_latency_destroy_context(ms_speech_context_t context);
+int ms_speech_latency_initialize(ms_speech_connection_t connection);
+void ms_speech_latency_destroy(ms_speech_connection_t connection);
+void ms_speech_latency_handle_connecting(ms_speech_connection_t connection);
+void ms_speech_latency_handle_handshake(ms_speech_connection_t connection, struct lws *wsi);
+void ms_speech_latency_handle_established(ms_speech_connection_t connection, struct lws *wsi);
+void ms_speech_latency_handle_request(ms_speech_connection_t connection);
+void ms_speech_latency_handle_status(ms_speech_connection_t connection, client_status_t old_status, client_status_t status);
+void ms_speech_latency_mark(ms_speech_connection_t connection, ms_speech_phase_t phase);
+void ms_speech_latency_handle_audio(ms_speech_connection_t connection, const unsigned char *buffer, int len);
+double ms_speech_latency_handle_result(ms_speech_connection_t connection, ms_speech_phase_t phase, const ms_speech_phrase_timing_t *timing);
+
+#endif /* ms_speech_latency_h */
@@ -0,0 +1,223 @@
+/*
+
+Copyright 2017 technicianted
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+*/
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "compat.h"
+#include "ms_speech_log_async.h"
+
+static ms_speech_batch_log_t ms_speech_log_async_callback = NULL;
+static uint32_t ms_speech_log_async_ring_size = MS_SPEECH_LOG_ASYNC_DEFAULT_RING_SIZE;
+static unsigned long ms_speech_log_async_dropped = 0;
+
+static ms_speech_log_ring_t *ms_speech_log_async_rings = NULL;
+static __thread ms_speech_log_ring_t *ms_speech_log_async_thread_ring = NULL;
+static pthread_key_t ms_speech_log_async_key;
+static pthread_once_t ms_speech_log_async_once = PTHREAD_ONCE_INIT;
+
+// only taken to start and stop the flusher
+static pthread_mutex_t ms_speech_log_async_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t ms_speech_log_async_thread;
+static int ms_speech_log_async_running = 0;
+static int ms_speech_log_async_stopping = 0;
+
+static void ms_speech_log_async_thread_exit(void *data)
+{
+	// the flusher frees the ring once drained
+	ms_speech_log_ring_t *ring = (ms_speech_log_ring_t *)data;
+	__atomic_store_n(&ring->abandoned, 1, __ATOMIC_RELEASE);
+}
+
+static void ms_speech_log_async_create_key(void)
+{
+	pthread_key_create(&ms_speech_log_async_key, &ms_speech_log_async_thread_exit);
+}
+
+static ms_speech_log_ring_t *ms_speech_log_async_get_ring(void)
+{
+	ms_speech_log_ring_t *ring = ms_speech_log_async_thread_ring;
+	if (ring)
+		return ring;
+
+	ring = (ms_speech_log_ring_t *)malloc(sizeof(ms_speech_log_ring_t));
+	memset(ring, 0, sizeof(ms_speech_log_ring_t));
+	ring->size = __atomic_load_n(&ms_speech_log_async_ring_size, __ATOMIC_RELAXED);
+	ring->slots = (ms_speech_log_slot_t *)calloc(ring->size, sizeof(ms_speech_log_slot_t));
+
+	pthread_once(&ms_speech_log_async_once, &ms_speech_log_async_create_key);
+	pthread_setspecific(ms_speech_log_async_key, ring);
+
+	ring->next = __atomic_load_n(&ms_speech_log_async_rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&ms_speech_log_async_rings, &ring->next, ring, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+
+	ms_speech_log_async_thread_ring = ring;
+	return ring;
+}
+
+int ms_speech_log_async_enabled(void)
+{
+	return __atomic_load_n(&ms_speech_log_async_callback, __ATOMIC_ACQUIRE) != NULL;
+}
+
+void ms_speech_log_async_push(const char *connection_id, ms_speech_log_level_t level, const char *format, va_list args)
+{
+	ms_speech_log_ring_t *ring = ms_speech_log_async_get_ring();
+	uint64_t index = ring->head;
+	ms_speech_log_slot_t *slot = &ring->slots[index % ring->size];
+
+	// a full ring overwrites its oldest record, the flusher notices
+	__atomic_store_n(&slot->sequence, 2 * index + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	slot->timestamp_us = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+	slot->level = level;
+	snprintf(slot->connection_id, sizeof(slot->connection_id), "%s", connection_id ? connection_id : "");
+	vsnprintf(slot->message, sizeof(slot->message), format, args);
+
+	__atomic_store_n(&slot->sequence, 2 * index + 2, __ATOMIC_RELEASE);
+	__atomic_store_n(&ring->head, index + 1, __ATOMIC_RELEASE);
+}
+
+static void ms_speech_log_async_deliver(ms_speech_batch_log_t callback, ms_speech_log_record_t *batch, int *num)
+{
+	if (*num > 0)
+		callback(batch, *num);
+	*num = 0;
+}
+
+static void ms_speech_log_async_drain(ms_speech_batch_log_t callback)
+{
+	ms_speech_log_slot_t copies[MS_SPEECH_LOG_ASYNC_BATCH_SIZE];
+	ms_speech_log_record_t batch[MS_SPEECH_LOG_ASYNC_BATCH_SIZE];
+	int num = 0;
+	unsigned long dropped = 0;
+
+	ms_speech_log_ring_t **p = &ms_speech_log_async_rings;
+	ms_speech_log_ring_t *ring = __atomic_load_n(p, __ATOMIC_ACQUIRE);
+	while (ring) {
+		int abandoned = __atomic_load_n(&ring->abandoned, __ATOMIC_ACQUIRE);
+		uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if (head - ring->tail > ring->size) {
+			dropped += head - ring->tail - ring->size;
+			ring->tail = head - ring->size;
+		}
+
+		for (; ring->tail < head; ring->tail++) {
+			ms_speech_log_slot_t *slot = &ring->slots[ring->tail % ring->size];
+			uint64_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+			if (sequence != 2 * ring->tail + 2) {
+				dropped++;
+				continue;
+			}
+
+			ms_speech_log_slot_t *copy = &copies[num];
+			memcpy(copy, slot, sizeof(ms_speech_log_slot_t));
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) != sequence) {
+				// overwritten while copying
+				dropped++;
+				continue;
+			}
+
+			copy->message[sizeof(copy->message) - 1] = '\0';
+			copy->connection_id[sizeof(copy->connection_id) - 1] = '\0';
+			batch[num].timestamp_us = copy->timestamp_us;
+			batch[num].level = copy->level;
+			batch[num].connection_id = copy->connection_id;
+			batch[num].message = copy->message;
+			if (++num == MS_SPEECH_LOG_ASYNC_BATCH_SIZE)
+				ms_speech_log_async_deliver(callback, batch, &num);
+		}
+
+		ms_speech_log_ring_t *next = ring->next;
+		if (abandoned && ring->tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+			// rings are only pushed at the list head, anything else is ours to unlink
+			ms_speech_log_ring_t *expected = ring;
+			if (p != &ms_speech_log_async_rings ||
+				__atomic_compare_exchange_n(p, &expected, next, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+				if (p != &ms_speech_log_async_rings)
+					*p = next;
+				free(ring->slots);
+				free(ring);
+				ring = next;
+				continue;
+			}
+		}
+
+		p = &ring->next;
+		ring = next;
+	}
+
+	ms_speech_log_async_deliver(callback, batch, &num);
+	if (dropped)
+		__atomic_fetch_add(&ms_speech_log_async_dropped, dropped, __ATOMIC_RELAXED);
+}
+
+static void *ms_speech_log_async_flusher(void *data)
+{
+	ms_speech_batch_log_t callback = (ms_speech_batch_log_t)data;
+	struct timespec interval = { 0, MS_SPEECH_LOG_ASYNC_FLUSH_INTERVAL_MS * 1000000L };
+
+	while (!__atomic_load_n(&ms_speech_log_async_stopping, __ATOMIC_ACQUIRE)) {
+		ms_speech_log_async_drain(callback);
+		nanosleep(&interval, NULL);
+	}
+	ms_speech_log_async_drain(callback);
+
+	return NULL;
+}
+
+int ms_speech_set_async_logging(int levels, ms_speech_batch_log_t callback, int ring_size)
+{
+	int r = 0;
+
+	pthread_mutex_lock(&ms_speech_log_async_lock);
+
+	if (ms_speech_log_async_running) {
+		__atomic_store_n(&ms_speech_log_async_callback, NULL, __ATOMIC_RELEASE);
+		__atomic_store_n(&ms_speech_log_async_stopping, 1, __ATOMIC_RELEASE);
+		pthread_join(ms_speech_log_async_thread, NULL);
+		ms_speech_log_async_running = 0;
+		ms_speech_log_async_stopping = 0;
+	}
+
+	if (callback) {
+		__atomic_store_n(&ms_speech_log_async_ring_size,
+						 ring_size > 0 ? (uint32_t)ring_size : MS_SPEECH_LOG_ASYNC_DEFAULT_RING_SIZE,
+						 __ATOMIC_RELAXED);
+		r = -pthread_create(&ms_speech_log_async_thread, NULL, &ms_speech_log_async_flusher, (void *)callback);
+		if (!r) {
+			ms_speech_log_async_running = 1;
+			ms_speech_log_levels = levels;
+			lws_set_log_level(levels, &ms_speech_lws_log);
+			__atomic_store_n(&ms_speech_log_async_callback, callback, __ATOMIC_RELEASE);
+		}
+	}
+
+	pthread_mutex_unlock(&ms_speech_log_async_lock);
+
+	return r;
+}
+
+unsigned long ms_speech_get_dropped_log_count(void)
+{
+	return __atomic_load_n(&ms_speech_log_async_dropped, __ATOMIC_RELAXED);
+}
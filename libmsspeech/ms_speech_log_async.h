@@ -0,0 +1,52 @@
+/*
+
+Copyright 2017 technicianted
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+*/
+#ifndef ms_speech_log_async_h
+#define ms_speech_log_async_h
+
+#include <stdarg.h>
+#include <stdint.h>
+
+#include "ms_speech_priv.h"
+#include "ms_speech_logging_priv.h"
+
+#define MS_SPEECH_LOG_ASYNC_DEFAULT_RING_SIZE 256
+#define MS_SPEECH_LOG_ASYNC_FLUSH_INTERVAL_MS 10
+#define MS_SPEECH_LOG_ASYNC_BATCH_SIZE 64
+
+typedef struct {
+	// odd while the slot is written, 2 * (index + 1) once complete
+	uint64_t sequence;
+	uint64_t timestamp_us;
+	ms_speech_log_level_t level;
+	char connection_id[48];
+	char message[MS_SPEECH_LOG_BUFFER_SIZE];
+} ms_speech_log_slot_t;
+
+// single producer ring owned by one thread, drained by the flusher
+typedef struct ms_speech_log_ring_st {
+	ms_speech_log_slot_t *slots;
+	uint32_t size;
+	uint64_t head;
+	uint64_t tail;
+	int abandoned;
+
+	struct ms_speech_log_ring_st *next;
+} ms_speech_log_ring_t;
+
+int ms_speech_log_async_enabled(void);
+void ms_speech_log_async_push(const char *connection_id, ms_speech_log_level_t level, const char *format, va_list args);
+
+#endif /* ms_speech_log_async_h */
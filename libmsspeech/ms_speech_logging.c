@@ -19,57 +19,73 @@ all copies or substantial portions of the Software.
 #include "ms_speech/ms_speech_logging.h"
 #include "ms_speech_priv.h"
 #include "ms_speech_logging_priv.h"
+#include "ms_speech_log_async.h"
 
-static int ms_speech_log_levels = 0;
+int ms_speech_log_levels = 0;
 static ms_speech_global_log_t ms_speech_global_log_callback = NULL;
 
+static void ms_speech_lws_push(ms_speech_log_level_t level, const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	ms_speech_log_async_push(NULL, level, format, args);
+	va_end(args);
+}
+
+void ms_speech_lws_log(int level, const char *line)
+{
+	if (ms_speech_log_async_enabled())
+		ms_speech_lws_push((ms_speech_log_level_t)level, "%s", line);
+	else if (ms_speech_global_log_callback)
+		ms_speech_global_log_callback((ms_speech_log_level_t)level, line);
+}
+
 void ms_speech_set_logging(int levels, ms_speech_global_log_t callback)
 {
 	ms_speech_log_levels = levels;
 	ms_speech_global_log_callback = callback;
-	lws_set_log_level(levels, (void (*)(int, const char *))&ms_speech_log);
+	lws_set_log_level(levels, &ms_speech_lws_log);
 }
 
-void ms_speech_log(ms_speech_log_level_t level, const char *format, ...)
+void ms_speech_log_printf(ms_speech_log_level_t level, const char *format, ...)
 {
-	if (ms_speech_global_log_callback && (level & ms_speech_log_levels)) {
-		va_list args;
-		va_start(args, format);
-		
-		char *buffer = NULL;
-		int r = vasprintf(&buffer, format, args);
-		if (r != -1) {
-			ms_speech_global_log_callback(level, buffer);
-			free(buffer);
-		}
-		else {
-			ms_speech_global_log_callback(MS_SPEECH_LOG_WARN, "Unable to allocate memory for logging");
-		}
-		
+	va_list args;
+	va_start(args, format);
+	if (ms_speech_log_async_enabled()) {
+		ms_speech_log_async_push(NULL, level, format, args);
 		va_end(args);
+		return;
 	}
+
+	if (!ms_speech_global_log_callback) {
+		va_end(args);
+		return;
+	}
+
+	// formatted on the stack, long messages are truncated
+	char buffer[MS_SPEECH_LOG_BUFFER_SIZE];
+	vsnprintf(buffer, sizeof(buffer), format, args);
+	va_end(args);
+
+	ms_speech_global_log_callback(level, buffer);
 }
 
-void ms_speech_connection_log(ms_speech_connection_t connection, ms_speech_log_level_t level, const char *format, ...)
+void ms_speech_connection_log_printf(ms_speech_connection_t connection, ms_speech_log_level_t level, const char *format, ...)
 {
-	if (level & ms_speech_log_levels) {
-		va_list args;
-		va_start(args, format);
-	
-		char *buffer = NULL;
-		int r = vasprintf(&buffer, format, args);
-		if (r == -1) {
-			buffer = (char *)malloc(255);
-			sprintf(buffer, "Unable to allocate memory for logging");
-			level = MS_SPEECH_LOG_WARN;
-		}
-		if (connection->callbacks->log)
-			connection->callbacks->log(connection, connection->callbacks->user_data, level, buffer);
-		else if (ms_speech_global_log_callback)
-			ms_speech_global_log_callback(level, buffer);
-		
-		free(buffer);
-		
+	va_list args;
+	va_start(args, format);
+	if ((!connection->callbacks || !connection->callbacks->log) && ms_speech_log_async_enabled()) {
+		ms_speech_log_async_push(connection->connection_id, level, format, args);
 		va_end(args);
+		return;
 	}
+
+	char buffer[MS_SPEECH_LOG_BUFFER_SIZE];
+	vsnprintf(buffer, sizeof(buffer), format, args);
+	va_end(args);
+
+	if (connection->callbacks && connection->callbacks->log)
+		connection->callbacks->log(connection, connection->callbacks->user_data, level, buffer);
+	else if (ms_speech_global_log_callback)
+		ms_speech_global_log_callback(level, buffer);
 }
@@ -17,7 +17,36 @@ all copies or substantial portions of the Software.
 #ifndef ms_speech_logging_priv_h
 #define ms_speech_logging_priv_h
 
-void ms_speech_log(ms_speech_log_level_t level, const char *format, ...);
-void ms_speech_connection_log(ms_speech_connection_t connection, ms_speech_log_level_t level, const char *format, ...);
+// messages longer than this are truncated
+#define MS_SPEECH_LOG_BUFFER_SIZE 1024
+
+// levels compiled in, debug logs are dropped by the optimizer when disabled
+#ifdef MS_SPEECH_DISABLE_DEBUG_LOG
+#define MS_SPEECH_LOG_COMPILED_LEVELS (~(int)MS_SPEECH_LOG_DEBUG)
+#else
+#define MS_SPEECH_LOG_COMPILED_LEVELS (~0)
+#endif
+
+extern int ms_speech_log_levels;
+
+// gate before arguments are evaluated, callers may pass ORed levels
+#define ms_speech_log_enabled(level) \
+	(((level) & MS_SPEECH_LOG_COMPILED_LEVELS & ms_speech_log_levels) != 0)
+
+#define ms_speech_log(level, ...) \
+	do { \
+		if (ms_speech_log_enabled(level)) \
+			ms_speech_log_printf((level), __VA_ARGS__); \
+	} while (0)
+
+#define ms_speech_connection_log(connection, level, ...) \
+	do { \
+		if (ms_speech_log_enabled(level)) \
+			ms_speech_connection_log_printf((connection), (level), __VA_ARGS__); \
+	} while (0)
+
+void ms_speech_lws_log(int level, const char *line);
+void ms_speech_log_printf(ms_speech_log_level_t level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+void ms_speech_connection_log_printf(ms_speech_connection_t connection, ms_speech_log_level_t level, const char *format, ...) __attribute__((format(printf, 3, 4)));
 
 #endif /* ms_speech_logging_priv_h */
@@ -0,0 +1,90 @@
+/*
+
+Copyright 2017 technicianted
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+*/
+#include <errno.h>
+
+#include "compat.h"
+#include "ms_speech_memory.h"
+#include "ms_speech_telemetry.h"
+#include "ms_speech_reconnect.h"
+#include "ms_speech_latency.h"
+#include "ms_speech_metrics.h"
+#include "response_messages_priv.h"
+
+void ms_speech_memory_initialize(ms_speech_context_t context, const ms_speech_memory_profile_t *profile)
+{
+	ms_speech_memory_profile_t *memory = &context->memory;
+
+	if (profile)
+		*memory = *profile;
+	if (memory->rx_buffer_size <= 0)
+		memory->rx_buffer_size = MS_SPEECH_MEMORY_DEFAULT_RX_BUFFER_SIZE;
+	else if (memory->rx_buffer_size < MS_SPEECH_MEMORY_MIN_RX_BUFFER_SIZE)
+		memory->rx_buffer_size = MS_SPEECH_MEMORY_MIN_RX_BUFFER_SIZE;
+	if (memory->stream_buffer_size <= 0)
+		memory->stream_buffer_size = MS_SPEECH_MEMORY_DEFAULT_STREAM_BUFFER_SIZE;
+	else if (memory->stream_buffer_size < MS_SPEECH_MEMORY_MIN_STREAM_BUFFER_SIZE)
+		memory->stream_buffer_size = MS_SPEECH_MEMORY_MIN_STREAM_BUFFER_SIZE;
+	if (memory->json_max_depth <= 0)
+		memory->json_max_depth = JSON_TOKENER_DEFAULT_DEPTH;
+	if (memory->latency_audio_chunks == 0)
+		memory->latency_audio_chunks = MS_SPEECH_MEMORY_DEFAULT_LATENCY_AUDIO_CHUNKS;
+}
+
+size_t ms_speech_connection_get_memory(ms_speech_connection_t connection)
+{
+	ms_speech_context_t context = connection->context;
+	size_t size = context->connection_slab.object_size;
+
+	// uri and path are both sized after the uri
+	for (int i=0; i<connection->num_endpoints; i++)
+		size += sizeof(ms_speech_endpoint_t) + 2 * strlen(connection->endpoints[i].uri) + 1;
+	if (connection->callbacks)
+		size += context->callbacks_slab.object_size;
+	if (connection->streaming_info)
+		size += context->streaming_slab.object_size;
+	if (connection->wsi)
+		size += LWS_PRE + context->memory.rx_buffer_size;
+	if (connection->json_tokenizer)
+		size += MS_SPEECH_MEMORY_TOKENIZER_SIZE + context->memory.json_max_depth * MS_SPEECH_MEMORY_TOKENIZER_DEPTH_SIZE;
+	if (connection->current_parsed_message)
+		size += sizeof(ms_speech_parsed_message_t) + connection->current_message_size;
+	if (connection->telemetry) {
+		size += context->telemetry_slab.object_size;
+		for (int i=0; i<connection->telemetry->num_paths; i++)
+			size += connection->telemetry->paths[i].capacity * sizeof(uint64_t);
+	}
+	if (connection->reconnect)
+		size += sizeof(struct ms_speech_reconnect_st) + connection->reconnect->capacity;
+	if (connection->latency) {
+		size += sizeof(struct ms_speech_latency_st);
+		if (connection->latency->histograms)
+			size += MS_SPEECH_PHASE_COUNT * sizeof(ms_speech_histogram_t);
+		if (connection->latency->chunks)
+			size += connection->latency->num_slots * sizeof(ms_speech_latency_chunk_t);
+	}
+
+	return size;
+}
+
+int ms_speech_memory_reserve(ms_speech_connection_t connection, size_t size)
+{
+	size_t budget = connection->context->memory.connection_budget;
+	if (!budget || ms_speech_connection_get_memory(connection) + size <= budget)
+		return 0;
+
+	ms_speech_metrics_add(connection->context, MS_SPEECH_METRIC_MEMORY_BUDGET_EXCEEDED, 1);
+	return -ENOBUFS;
+}
@@ -0,0 +1,37 @@
+/*
+
+Copyright 2017 technicianted
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+*/
+#ifndef ms_speech_memory_h
+#define ms_speech_memory_h
+
+#include <stddef.h>
+
+#include "ms_speech_priv.h"
+
+#define MS_SPEECH_MEMORY_DEFAULT_RX_BUFFER_SIZE 65536
+#define MS_SPEECH_MEMORY_DEFAULT_STREAM_BUFFER_SIZE MS_SPEECH_STREAM_BUFFER_SIZE
+#define MS_SPEECH_MEMORY_DEFAULT_LATENCY_AUDIO_CHUNKS 512
+// service message headers have to arrive in the first fragment
+#define MS_SPEECH_MEMORY_MIN_RX_BUFFER_SIZE 1024
+// room for the RIFF header resent ahead of replayed audio
+#define MS_SPEECH_MEMORY_MIN_STREAM_BUFFER_SIZE 256
+// approximate json-c tokenizer footprint, its structures are opaque to us
+#define MS_SPEECH_MEMORY_TOKENIZER_SIZE 192
+#define MS_SPEECH_MEMORY_TOKENIZER_DEPTH_SIZE 32
+
+void ms_speech_memory_initialize(ms_speech_context_t context, const ms_speech_memory_profile_t *profile);
+int ms_speech_memory_reserve(ms_speech_connection_t connection, size_t size);
+
+#endif /* ms_speech_memory_h */
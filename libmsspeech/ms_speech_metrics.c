@@ -0,0 +1,217 @@
+/*
+
+Copyright 2017 technicianted
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+*/
+#include <errno.h>
+#include <stdarg.h>
+
+#include "compat.h"
+#include "ms_speech_metrics.h"
+#include "message_constants.h"
+
+static __thread int ms_speech_metrics_thread_shard = -1;
+static int ms_speech_metrics_next_shard;
+
+static const char *ms_speech_metrics_status_names[MS_SPEECH_METRICS_NUM_STATUSES] = {
+	"none",
+	"speech_config_pending",
+	"idle",
+	"streaming",
+	"streaming_blocked",
+	"telemetry_pending",
+	"turn_pending"
+};
+
+static const char **ms_speech_metrics_path(int index)
+{
+	static const char **paths[MS_SPEECH_METRICS_NUM_PATHS - 1] = {
+		&MS_SPEECH_MESSAGE_PATH_SPEECH_CONFIG,
+		&MS_SPEECH_MESSAGE_PATH_AUDIO,
+		&MS_SPEECH_MESSAGE_PATH_TELEMETRY,
+		&MS_SPEECH_MESSAGE_PATH_SPEECH_STARTDETECTED,
+		&MS_SPEECH_MESSAGE_PATH_SPEECH_ENDDETECTED,
+		&MS_SPEECH_MESSAGE_PATH_SPEECH_HYPOTHESIS,
+		&MS_SPEECH_MESSAGE_PATH_SPEECH_FRAGMENT,
+		&MS_SPEECH_MESSAGE_PATH_SPEECH_PHRASE,
+		&MS_SPEECH_MESSAGE_PATH_TURN_START,
+		&MS_SPEECH_MESSAGE_PATH_TURN_END
+	};
+
+	return index < MS_SPEECH_METRICS_NUM_PATHS - 1 ? paths[index] : NULL;
+}
+
+int ms_speech_metrics_shard_index(void)
+{
+	if (ms_speech_metrics_thread_shard < 0)
+		ms_speech_metrics_thread_shard = __atomic_fetch_add(&ms_speech_metrics_next_shard, 1, __ATOMIC_RELAXED) % MS_SPEECH_METRICS_SHARDS;
+
+	return ms_speech_metrics_thread_shard;
+}
+
+void ms_speech_metrics_initialize(ms_speech_context_t context)
+{
+	void *metrics = NULL;
+	if (posix_memalign(&metrics, 64, sizeof(struct ms_speech_metrics_st)))
+		return;
+
+	memset(metrics, 0, sizeof(struct ms_speech_metrics_st));
+	context->metrics = (struct ms_speech_metrics_st *)metrics;
+}
+
+void ms_speech_metrics_destroy(ms_speech_context_t context)
+{
+	free(context->metrics);
+	context->metrics = NULL;
+}
+
+void ms_speech_metrics_count_message(ms_speech_context_t context, ms_speech_metric_t metric, const char *path)
+{
+	int index = 0;
+	const char **known;
+
+	// outgoing paths are the constants themselves
+	for (index=0; (known = ms_speech_metrics_path(index)) != NULL; index++) {
+		if (path == *known)
+			break;
+	}
+	if (!known && path) {
+		for (index=0; (known = ms_speech_metrics_path(index)) != NULL; index++) {
+			if (!strcasecmp(path, *known))
+				break;
+		}
+	}
+
+	ms_speech_metrics_add(context, metric + index, 1);
+}
+
+void ms_speech_metrics_handle_status(ms_speech_connection_t connection, client_status_t old_status, client_status_t status)
+{
+	if (!connection->metrics_counted || old_status == status)
+		return;
+
+	ms_speech_metrics_add(connection->context, MS_SPEECH_METRIC_CONNECTIONS + old_status, -1);
+	ms_speech_metrics_add(connection->context, MS_SPEECH_METRIC_CONNECTIONS + status, 1);
+}
+
+void ms_speech_metrics_handle_connection_created(ms_speech_connection_t connection)
+{
+	connection->metrics_counted = 1;
+	ms_speech_metrics_add(connection->context, MS_SPEECH_METRIC_CONNECTION_ALLOCATIONS, 1);
+	ms_speech_metrics_add(connection->context, MS_SPEECH_METRIC_CONNECTIONS + connection->status, 1);
+}
+
+void ms_speech_metrics_handle_connection_destroyed(ms_speech_connection_t connection)
+{
+	if (!connection->metrics_counted)
+		return;
+
+	connection->metrics_counted = 0;
+	ms_speech_metrics_add(connection->context, MS_SPEECH_METRIC_CONNECTIONS + connection->status, -1);
+}
+
+static int64_t ms_speech_metrics_get(ms_speech_context_t context, int metric)
+{
+	int64_t value = 0;
+	for (int i=0; i<MS_SPEECH_METRICS_SHARDS; i++)
+		value += __atomic_load_n(&context->metrics->shards[i].values[metric], __ATOMIC_RELAXED);
+
+	return value;
+}
+
+typedef struct {
+	char *buffer;
+	size_t size;
+	size_t length;
+} ms_speech_metrics_writer_t;
+
+static void ms_speech_metrics_printf(ms_speech_metrics_writer_t *writer, const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	size_t available = writer->length < writer->size ? writer->size - writer->length : 0;
+	int r = vsnprintf(available ? writer->buffer + writer->length : NULL, available, format, args);
+	va_end(args);
+
+	if (r > 0)
+		writer->length += r;
+}
+
+static void ms_speech_metrics_header(ms_speech_metrics_writer_t *writer, const char *name, const char *type, const char *help)
+{
+	ms_speech_metrics_printf(writer, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void ms_speech_metrics_counter(ms_speech_metrics_writer_t *writer, ms_speech_context_t context, const char *name, const char *help, int metric)
+{
+	ms_speech_metrics_header(writer, name, "counter", help);
+	ms_speech_metrics_printf(writer, "%s %lld\n", name, (long long)ms_speech_metrics_get(context, metric));
+}
+
+int ms_speech_context_metrics_dump(ms_speech_context_t context, char *buffer, size_t size)
+{
+	if (!context->metrics)
+		return -ENOMEM;
+
+	ms_speech_metrics_writer_t writer = { buffer, size, 0 };
+
+	ms_speech_metrics_header(&writer, "ms_speech_connections", "gauge", "Connections by client status.");
+	for (int i=0; i<MS_SPEECH_METRICS_NUM_STATUSES; i++) {
+		ms_speech_metrics_printf(&writer,
+								 "ms_speech_connections{status=\"%s\"} %lld\n",
+								 ms_speech_metrics_status_names[i],
+								 (long long)ms_speech_metrics_get(context, MS_SPEECH_METRIC_CONNECTIONS + i));
+	}
+
+	ms_speech_metrics_counter(&writer, context, "ms_speech_sent_bytes_total", "Bytes written to the service.", MS_SPEECH_METRIC_BYTES_SENT);
+	ms_speech_metrics_counter(&writer, context, "ms_speech_received_bytes_total", "Bytes received from the service.", MS_SPEECH_METRIC_BYTES_RECEIVED);
+	ms_speech_metrics_counter(&writer, context, "ms_speech_sent_frames_total", "Websocket frames written to the service.", MS_SPEECH_METRIC_FRAMES_SENT);
+	ms_speech_metrics_counter(&writer, context, "ms_speech_received_frames_total", "Websocket frames received from the service.", MS_SPEECH_METRIC_FRAMES_RECEIVED);
+
+	const char *directions[2] = { "sent", "received" };
+	for (int d=0; d<2; d++) {
+		char name[64];
+		snprintf(name, sizeof(name), "ms_speech_%s_messages_total", directions[d]);
+		ms_speech_metrics_header(&writer, name, "counter", d ? "Messages received by path." : "Messages sent by path.");
+		for (int i=0; i<MS_SPEECH_METRICS_NUM_PATHS; i++) {
+			const char **path = ms_speech_metrics_path(i);
+			ms_speech_metrics_printf(&writer,
+									 "%s{path=\"%s\"} %lld\n",
+									 name,
+									 path ? *path : "other",
+									 (long long)ms_speech_metrics_get(context, (d ? MS_SPEECH_METRIC_MESSAGES_RECEIVED : MS_SPEECH_METRIC_MESSAGES_SENT) + i));
+		}
+	}
+
+	ms_speech_metrics_counter(&writer, context, "ms_speech_parse_errors_total", "Service messages that failed to parse.", MS_SPEECH_METRIC_PARSE_ERRORS);
+	ms_speech_metrics_counter(&writer, context, "ms_speech_reconnects_total", "Reconnect attempts scheduled.", MS_SPEECH_METRIC_RECONNECTS);
+	ms_speech_metrics_counter(&writer, context, "ms_speech_send_choked_total", "Writes deferred because the socket was choked.", MS_SPEECH_METRIC_SEND_CHOKED);
+	ms_speech_metrics_counter(&writer, context, "ms_speech_telemetry_dropped_total", "Received messages left out of telemetry once a path reached its cap.", MS_SPEECH_METRIC_TELEMETRY_DROPPED);
+	ms_speech_metrics_counter(&writer, context, "ms_speech_memory_budget_exceeded_total", "Allocations refused by the connection memory budget.", MS_SPEECH_METRIC_MEMORY_BUDGET_EXCEEDED);
+
+	ms_speech_metrics_header(&writer, "ms_speech_callback_seconds_total", "counter", "Time spent in the stream callback and dispatching service messages.");
+	ms_speech_metrics_printf(&writer,
+							 "ms_speech_callback_seconds_total %.6f\n",
+							 ms_speech_metrics_get(context, MS_SPEECH_METRIC_CALLBACK_TIME_US) / 1000000.0);
+
+	ms_speech_metrics_header(&writer, "ms_speech_allocations_total", "counter", "Allocations by object.");
+	ms_speech_metrics_printf(&writer,
+							 "ms_speech_allocations_total{object=\"connection\"} %lld\n"
+							 "ms_speech_allocations_total{object=\"message\"} %lld\n"
+							 "ms_speech_allocations_total{object=\"parsed_message\"} %lld\n",
+							 (long long)ms_speech_metrics_get(context, MS_SPEECH_METRIC_CONNECTION_ALLOCATIONS),
+							 (long long)ms_speech_metrics_get(context, MS_SPEECH_METRIC_MESSAGE_ALLOCATIONS),
+							 (long long)ms_speech_metrics_get(context, MS_SPEECH_METRIC_PARSED_MESSAGE_ALLOCATIONS));
+
+	return (int)writer.length;
+}
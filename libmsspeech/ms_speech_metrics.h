@@ -0,0 +1,77 @@
+/*
+
+Copyright 2017 technicianted
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+*/
+#ifndef ms_speech_metrics_h
+#define ms_speech_metrics_h
+
+#include <stdint.h>
+
+#include "ms_speech_priv.h"
+
+#define MS_SPEECH_METRICS_SHARDS 16
+#define MS_SPEECH_METRICS_NUM_PATHS 11
+#define MS_SPEECH_METRICS_NUM_STATUSES (MS_SPEECH_CLIENT_TURN_PENDING + 1)
+
+typedef enum {
+	MS_SPEECH_METRIC_BYTES_SENT,
+	MS_SPEECH_METRIC_BYTES_RECEIVED,
+	MS_SPEECH_METRIC_FRAMES_SENT,
+	MS_SPEECH_METRIC_FRAMES_RECEIVED,
+	MS_SPEECH_METRIC_PARSE_ERRORS,
+	MS_SPEECH_METRIC_RECONNECTS,
+	MS_SPEECH_METRIC_CALLBACK_TIME_US,
+	MS_SPEECH_METRIC_SEND_CHOKED,
+	MS_SPEECH_METRIC_CONNECTION_ALLOCATIONS,
+	MS_SPEECH_METRIC_MESSAGE_ALLOCATIONS,
+	MS_SPEECH_METRIC_PARSED_MESSAGE_ALLOCATIONS,
+	MS_SPEECH_METRIC_TELEMETRY_DROPPED,
+	MS_SPEECH_METRIC_MEMORY_BUDGET_EXCEEDED,
+	// per message path, the last entry counting unknown paths
+	MS_SPEECH_METRIC_MESSAGES_SENT,
+	MS_SPEECH_METRIC_MESSAGES_RECEIVED = MS_SPEECH_METRIC_MESSAGES_SENT + MS_SPEECH_METRICS_NUM_PATHS,
+	// gauge per client_status_t
+	MS_SPEECH_METRIC_CONNECTIONS = MS_SPEECH_METRIC_MESSAGES_RECEIVED + MS_SPEECH_METRICS_NUM_PATHS,
+	MS_SPEECH_METRIC_COUNT = MS_SPEECH_METRIC_CONNECTIONS + MS_SPEECH_METRICS_NUM_STATUSES
+} ms_speech_metric_t;
+
+// one cache line aligned shard per group of threads, summed on read
+typedef struct {
+	int64_t values[MS_SPEECH_METRIC_COUNT];
+} __attribute__((aligned(64))) ms_speech_metrics_shard_t;
+
+struct ms_speech_metrics_st {
+	ms_speech_metrics_shard_t shards[MS_SPEECH_METRICS_SHARDS];
+};
+
+int ms_speech_metrics_shard_index(void);
+
+static inline void ms_speech_metrics_add(ms_speech_context_t context, ms_speech_metric_t metric, int64_t value)
+{
+	// shards are optional, counting stops if they could not be allocated
+	if (!context->metrics)
+		return;
+
+	ms_speech_metrics_shard_t *shard = &context->metrics->shards[ms_speech_metrics_shard_index()];
+	__atomic_fetch_add(&shard->values[metric], value, __ATOMIC_RELAXED);
+}
+
+void ms_speech_metrics_initialize(ms_speech_context_t context);
+void ms_speech_metrics_destroy(ms_speech_context_t context);
+void ms_speech_metrics_count_message(ms_speech_context_t context, ms_speech_metric_t metric, const char *path);
+void ms_speech_metrics_handle_status(ms_speech_connection_t connection, client_status_t old_status, client_status_t status);
+void ms_speech_metrics_handle_connection_created(ms_speech_connection_t connection);
+void ms_speech_metrics_handle_connection_destroyed(ms_speech_connection_t connection);
+
+#endif /* ms_speech_metrics_h */
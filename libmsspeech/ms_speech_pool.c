@@ -0,0 +1,263 @@
+/*
+
+Copyright 2017 technicianted
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+*/
+
+#include <errno.h>
+
+#include "compat.h"
+#include "ms_speech_pool.h"
+#include "ms_speech_guid.h"
+#include "ms_speech_logging_priv.h"
+#include "ms_speech_timestamp.h"
+
+static void pool_connection_error(ms_speech_connection_t connection, unsigned int http_status, const char *error_message, void *user_data);
+static void pool_connection_closed(ms_speech_connection_t connection, void *user_data);
+static void pool_connection_timeout(ms_speech_connection_t connection, ms_speech_timeout_t timeout, void *user_data);
+static void pool_client_ready(ms_speech_connection_t connection, void *user_data);
+static void ms_speech_pool_refill(ms_speech_pool_t pool, uint64_t now);
+static int ms_speech_pool_is_ready(ms_speech_connection_t connection);
+
+ms_speech_pool_t ms_speech_create_pool(ms_speech_context_t context, const char *uri, ms_speech_client_callbacks_t *callbacks, int size)
+{
+	if (size <= 0)
+		return NULL;
+
+	ms_speech_pool_t pool = (ms_speech_pool_t)malloc(sizeof(struct ms_speech_pool_st));
+	memset(pool, 0, sizeof(struct ms_speech_pool_st));
+	pool->context = context;
+	pool->uri = strdup(uri);
+	pool->size = size;
+	pool->slots = (ms_speech_connection_t *)calloc(size, sizeof(ms_speech_connection_t));
+	pool->keepalive_interval_ms = MS_SPEECH_POOL_DEFAULT_KEEPALIVE_MS;
+	pool->retry_ms = MS_SPEECH_POOL_MIN_RETRY_MS;
+
+	// only the callbacks that make sense before a connection is handed
+	// out are kept, the pool takes over the connection lifecycle ones
+	pool->callbacks.user_data = callbacks->user_data;
+	pool->callbacks.provide_authentication_header = callbacks->provide_authentication_header;
+	pool->callbacks.message_overlay = callbacks->message_overlay;
+	pool->callbacks.message_overlay_writer = callbacks->message_overlay_writer;
+	pool->callbacks.speech_config_key = callbacks->speech_config_key;
+	pool->callbacks.log = callbacks->log;
+	pool->callbacks.connection_error = &pool_connection_error;
+	pool->callbacks.connection_closed = &pool_connection_closed;
+	pool->callbacks.connection_timeout = &pool_connection_timeout;
+	pool->callbacks.client_ready = &pool_client_ready;
+
+	pool->next = context->pools;
+	context->pools = pool;
+
+	uint64_t now = ms_speech_get_monotonic_ms();
+	pool->next_keepalive = now + pool->keepalive_interval_ms;
+	ms_speech_pool_refill(pool, now);
+
+	return pool;
+}
+
+void ms_speech_destroy_pool(ms_speech_pool_t pool)
+{
+	ms_speech_pool_t *p = &pool->context->pools;
+	while (*p && *p != pool)
+		p = &(*p)->next;
+	if (*p)
+		*p = pool->next;
+
+	for (int i=0; i<pool->size; i++) {
+		if (pool->slots[i]) {
+			pool->slots[i]->pool = NULL;
+			ms_speech_disconnect(pool->slots[i]);
+		}
+	}
+
+	free(pool->slots);
+	free(pool->uri);
+	free(pool);
+}
+
+void ms_speech_pool_set_keepalive(ms_speech_pool_t pool, int interval_ms)
+{
+	pool->keepalive_interval_ms = interval_ms;
+	pool->next_keepalive = ms_speech_get_monotonic_ms() + interval_ms;
+}
+
+int ms_speech_pool_acquire(ms_speech_pool_t pool, ms_speech_client_callbacks_t *callbacks, ms_speech_connection_t *conn)
+{
+	*conn = NULL;
+
+	ms_speech_connection_t connection = NULL;
+	for (int i=0; i<pool->size; i++) {
+		if (pool->slots[i] && ms_speech_pool_is_ready(pool->slots[i])) {
+			connection = pool->slots[i];
+			pool->slots[i] = NULL;
+			break;
+		}
+	}
+
+	if (!connection) {
+		ms_speech_log(MS_SPEECH_LOG_INFO,
+					  "No warm connection available in pool for %s, connecting",
+					  pool->uri);
+		return ms_speech_connect(pool->context, pool->uri, callbacks, conn);
+	}
+
+	// refill on next service step
+	pool->next_refill = 0;
+
+	connection->pool = NULL;
+	memcpy(connection->callbacks, callbacks, sizeof(ms_speech_client_callbacks_t));
+	ms_speech_connection_log(connection,
+							 MS_SPEECH_LOG_DEBUG,
+							 "Acquired warm connection from pool");
+
+	*conn = connection;
+
+	if (connection->callbacks->client_ready)
+		connection->callbacks->client_ready(connection, connection->callbacks->user_data);
+
+	return 0;
+}
+
+int ms_speech_pool_available(ms_speech_pool_t pool)
+{
+	int available = 0;
+	for (int i=0; i<pool->size; i++) {
+		if (pool->slots[i] && ms_speech_pool_is_ready(pool->slots[i]))
+			available++;
+	}
+
+	return available;
+}
+
+void ms_speech_pool_service(ms_speech_context_t context)
+{
+	uint64_t now = ms_speech_get_monotonic_ms();
+	for (ms_speech_pool_t pool = context->pools; pool; pool = pool->next) {
+		if (now >= pool->next_refill)
+			ms_speech_pool_refill(pool, now);
+
+		if (pool->keepalive_interval_ms > 0 && now >= pool->next_keepalive) {
+			for (int i=0; i<pool->size; i++) {
+				ms_speech_connection_t connection = pool->slots[i];
+				if (connection && ms_speech_pool_is_ready(connection)) {
+					connection->ping_pending = 1;
+					lws_callback_on_writable(connection->wsi);
+				}
+			}
+			pool->next_keepalive = now + pool->keepalive_interval_ms;
+		}
+	}
+}
+
+void ms_speech_pool_handle_connection_lost(ms_speech_connection_t connection)
+{
+	ms_speech_pool_t pool = connection->pool;
+	for (int i=0; i<pool->size; i++) {
+		if (pool->slots[i] == connection) {
+			pool->slots[i] = NULL;
+			break;
+		}
+	}
+
+	// back off so that a dead endpoint does not turn into a connect loop
+	pool->next_refill = ms_speech_get_monotonic_ms() + pool->retry_ms;
+	pool->retry_ms *= 2;
+	if (pool->retry_ms > MS_SPEECH_POOL_MAX_RETRY_MS)
+		pool->retry_ms = MS_SPEECH_POOL_MAX_RETRY_MS;
+
+	connection->pool = NULL;
+	ms_speech_disconnect(connection);
+}
+
+static void ms_speech_pool_refill(ms_speech_pool_t pool, uint64_t now)
+{
+	char ids[MS_SPEECH_POOL_ID_BATCH][MS_SPEECH_GUID_SIZE];
+	int num_ids = 0;
+	int next_id = 0;
+
+	for (int i=0; i<pool->size; i++) {
+		if (pool->slots[i])
+			continue;
+
+		ms_speech_connection_t connection = NULL;
+		if (ms_speech_connect(pool->context, pool->uri, &pool->callbacks, &connection) ||
+			(!connection->wsi && !connection->resolving && !connection->token_waiting && !connection->race)) {
+			ms_speech_log(MS_SPEECH_LOG_ERR,
+						  "Unable to create pooled connection to %s",
+						  pool->uri);
+			if (connection)
+				ms_speech_disconnect(connection);
+			pool->next_refill = now + pool->retry_ms;
+			return;
+		}
+		connection->pool = pool;
+		pool->slots[i] = connection;
+
+		// the handshake is sent later, the ID can still be set
+		if (next_id == num_ids) {
+			num_ids = ms_speech_generate_guids(ids[0], sizeof(ids[0]), MS_SPEECH_POOL_ID_BATCH, 0);
+			next_id = 0;
+		}
+		memcpy(connection->connection_id, ids[next_id++], MS_SPEECH_GUID_SIZE);
+		connection->connection_id_reserved = 1;
+	}
+
+	pool->next_refill = UINT64_MAX;
+}
+
+static int ms_speech_pool_is_ready(ms_speech_connection_t connection)
+{
+	return connection->connection_status == MS_SPEECH_CLIENT_CONNECTED &&
+		connection->status == MS_SPEECH_CLIENT_IDLE;
+}
+
+static void pool_connection_error(ms_speech_connection_t connection, unsigned int http_status, const char *error_message, void *user_data)
+{
+	if (!connection->pool)
+		return;
+
+	ms_speech_connection_log(connection,
+							 MS_SPEECH_LOG_WARN,
+							 "Pooled connection failed: %s. HTTP status: %d",
+							 error_message ? error_message : "(null)",
+							 http_status);
+	ms_speech_pool_handle_connection_lost(connection);
+}
+
+static void pool_connection_timeout(ms_speech_connection_t connection, ms_speech_timeout_t timeout, void *user_data)
+{
+	if (!connection->pool)
+		return;
+
+	ms_speech_pool_handle_connection_lost(connection);
+}
+
+static void pool_connection_closed(ms_speech_connection_t connection, void *user_data)
+{
+	if (!connection->pool)
+		return;
+
+	ms_speech_connection_log(connection,
+							 MS_SPEECH_LOG_INFO,
+							 "Pooled connection closed");
+	ms_speech_pool_handle_connection_lost(connection);
+}
+
+static void pool_client_ready(ms_speech_connection_t connection, void *user_data)
+{
+	ms_speech_connection_log(connection,
+							 MS_SPEECH_LOG_DEBUG,
+							 "Pooled connection is ready");
+	connection->pool->retry_ms = MS_SPEECH_POOL_MIN_RETRY_MS;
+}
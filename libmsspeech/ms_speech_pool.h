@@ -0,0 +1,52 @@
+/*
+
+Copyright 2017 technicianted
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+*/
+
+#ifndef ms_speech_pool_h
+#define ms_speech_pool_h
+
+#include <stdint.h>
+
+#include "ms_speech_priv.h"
+
+#define MS_SPEECH_POOL_DEFAULT_KEEPALIVE_MS 30000
+#define MS_SPEECH_POOL_MIN_RETRY_MS 500
+#define MS_SPEECH_POOL_MAX_RETRY_MS 30000
+// connection IDs generated at once while refilling
+#define MS_SPEECH_POOL_ID_BATCH 16
+
+struct ms_speech_pool_st {
+	ms_speech_context_t context;
+	char *uri;
+
+	// callbacks used while connections are pooled
+	ms_speech_client_callbacks_t callbacks;
+
+	int size;
+	ms_speech_connection_t *slots;
+
+	int keepalive_interval_ms;
+	uint64_t next_keepalive;
+
+	int retry_ms;
+	uint64_t next_refill;
+
+	struct ms_speech_pool_st *next;
+};
+
+void ms_speech_pool_service(ms_speech_context_t context);
+void ms_speech_pool_handle_connection_lost(ms_speech_connection_t connection);
+
+#endif /* ms_speech_pool_h */
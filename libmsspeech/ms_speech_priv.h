@@ -18,11 +18,18 @@ all copies or substantial portions of the Software.
 #define ms_speech_priv_h
 
 #define MS_SPEECH_STREAM_BUFFER_SIZE 4096
+// objects per slab chunk
+#define MS_SPEECH_CONNECTION_SLAB_CHUNK 16
+#define MS_SPEECH_CALLBACKS_SLAB_CHUNK 32
+#define MS_SPEECH_STREAMING_SLAB_CHUNK 8
+#define MS_SPEECH_TELEMETRY_SLAB_CHUNK 32
 
 #include <json-c/json.h>
 
 #include "libwebsockets.h"
 #include "ms_speech/ms_speech.h"
+#include "ms_speech_timer.h"
+#include "ms_speech_slab.h"
 
 typedef enum {
 	MS_SPEECH_CLIENT_DISCONNECTED,
@@ -36,14 +43,78 @@ typedef enum {
 	MS_SPEECH_CLIENT_IDLE,
 	MS_SPEECH_CLIENT_STREAMING,
 	MS_SPEECH_CLIENT_STREAMING_BLOCKED,
-	MS_SPEECH_CLIENT_TELEMETRY_PENDING
+	MS_SPEECH_CLIENT_TELEMETRY_PENDING,
+	// all audio sent, waiting for turn.end
+	MS_SPEECH_CLIENT_TURN_PENDING
 } client_status_t;
 
+struct ms_speech_pool_st;
+struct ms_speech_reconnect_st;
+struct ms_speech_tls_cache_st;
+struct ms_speech_resolver_st;
+struct ms_speech_race_st;
+struct ms_speech_endpoint_set_st;
+struct ms_speech_latency_st;
+struct ms_speech_histogram_st;
+struct ms_speech_metrics_st;
+struct ms_speech_capture_st;
+
 struct ms_speech_context_st {
 	struct lws_context *context;
 	struct lws_context_creation_info info;
+
+	struct ms_speech_pool_st *pools;
+	// connections waiting for their reconnect backoff to expire
+	ms_speech_connection_t reconnecting;
+	struct ms_speech_tls_cache_st *tls_cache;
+	struct ms_speech_resolver_st *resolver;
+	struct ms_speech_token_provider_st *token_provider;
+
+	int connect_attempt_delay_ms;
+	int connect_max_parallel;
+	// connections racing connect attempts
+	struct ms_speech_race_st *racing;
+
+	ms_speech_timer_wheel_t timers;
+	// wall clock read once per service iteration, 0 until first needed
+	uint64_t clock_us;
+	int in_service;
+	// applied to new connections
+	ms_speech_timeouts_t timeouts;
+	int telemetry_max_entries;
+	// resolved memory profile, defaults filled in
+	ms_speech_memory_profile_t memory;
+	// protocol table carrying the profile's receive buffer size
+	struct lws_protocols protocols[2];
+	// serialized speech.config bodies
+	struct ms_speech_config_cache_st *speech_configs;
+
+	// one histogram per phase
+	struct ms_speech_histogram_st *latency;
+	// connections keep their own histograms too
+	int connection_latency;
+
+	struct ms_speech_metrics_st *metrics;
+	struct ms_speech_capture_st *capture;
+
+	// per connection objects
+	ms_speech_slab_t connection_slab;
+	ms_speech_slab_t callbacks_slab;
+	ms_speech_slab_t streaming_slab;
+	ms_speech_slab_t telemetry_slab;
+	// cleaned up connections, released once the service iteration is over
+	ms_speech_connection_t retired;
 };
 
+typedef struct
+{
+	char *uri;
+	const char *address;
+	int port;
+	char *path;
+	int ssl_connection;
+} ms_speech_endpoint_t;
+
 typedef struct
 {
 	const char *path;
@@ -54,14 +125,20 @@ typedef struct
 	
 	char *body;
 	size_t body_length;
+
+	// serialized frame, the body is written in place when body_in_frame is set
+	char *frame;
+	int body_in_frame;
 } ms_speech_message;
 
 typedef struct
 {
 	ms_speech_audio_stream_callback stream_callback;
 	void *stream_user_data;
-	unsigned char buffer[MS_SPEECH_STREAM_BUFFER_SIZE];
 	int packet_num;
+	// sized by the context memory profile
+	int buffer_size;
+	unsigned char buffer[];
 } ms_speech_streaming_info_t;
 
 struct ms_speech_telemetry_st;
@@ -71,22 +148,87 @@ struct ms_speech_connection_st {
 	ms_speech_context_t context;
 	struct lws *wsi;
 
+	// current endpoint, points into endpoints
 	char *uri;
 	char *path;
+	const char *address;
+	int port;
+	int ssl_connection;
+
+	ms_speech_endpoint_t *endpoints;
+	int num_endpoints;
+	int endpoint;
 	
 	client_connection_status_t connection_status;
 	client_status_t status;
 	char connection_id[48];
+	// connection_id was generated ahead for the next handshake
+	int connection_id_reserved;
 
 	json_tokener *json_tokenizer;
 	ms_speech_parsed_message_t *current_parsed_message;
 	char current_request_id[48];
+	// next request queued while the current turn is finishing
+	char pending_request_id[48];
+	int request_pending;
+	// payload bytes of current_parsed_message buffered so far
+	size_t current_message_size;
 	
 	ms_speech_streaming_info_t *streaming_info;
 	
 	ms_speech_client_callbacks_t *callbacks;
 	
 	ms_speech_telemetry_t *telemetry;
+
+	// owning pool while the connection is kept warm, NULL otherwise
+	struct ms_speech_pool_st *pool;
+	int ping_pending;
+	int disconnecting;
+
+	struct ms_speech_reconnect_st *reconnect;
+
+	// inside lws_client_connect_via_info(), errors lws reports from there
+	// are returned by the connect call instead of being called back
+	int opening;
+	int open_failed;
+	// waiting for the resolver to complete
+	int resolving;
+	ms_speech_connection_t resolve_next;
+	// waiting for the first authentication token
+	int token_waiting;
+	ms_speech_connection_t token_next;
+	struct ms_speech_race_st *race;
+
+	// endpoint set the connection reports health to, NULL if none
+	struct ms_speech_endpoint_set_st *endpoint_set;
+	int endpoint_set_index;
+	uint64_t connect_started_at;
+	uint64_t request_started_at;
+	int result_seen;
+
+	ms_speech_timeouts_t timeouts;
+	ms_speech_timer_t connect_timer;
+	ms_speech_timer_t speech_config_timer;
+	ms_speech_timer_t result_timer;
+	ms_speech_timer_t total_timer;
+	int results_received;
+
+	struct ms_speech_latency_st *latency;
+	// included in the connections gauge
+	int metrics_counted;
+	struct ms_speech_capture_st *capture;
+
+	int retired;
+	ms_speech_connection_t retired_next;
 };
 
+uint64_t ms_speech_context_get_epoch_us(ms_speech_context_t context);
+int ms_speech_connection_open(ms_speech_connection_t connection);
+int ms_speech_connection_connect(ms_speech_connection_t connection, const char *address);
+struct lws *ms_speech_connection_connect_to(ms_speech_connection_t connection, const ms_speech_endpoint_t *endpoint, const char *address);
+void ms_speech_select_endpoint(ms_speech_connection_t connection, int index);
+void ms_speech_connection_abort(ms_speech_connection_t connection);
+void ms_speech_handle_connection_error(ms_speech_connection_t connection, unsigned int http_status, const char *message);
+void ms_speech_release_retired(ms_speech_context_t context);
+
 #endif /* ms_speech_h */
@@ -0,0 +1,218 @@
+/*
+
+Copyright 2017 technicianted
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+*/
+
+#include <errno.h>
+
+#include "compat.h"
+#include "ms_speech_race.h"
+#include "ms_speech_guid.h"
+#include "ms_speech_logging_priv.h"
+#include "ms_speech_timestamp.h"
+
+static int ms_speech_race_launch(struct ms_speech_race_st *race)
+{
+	ms_speech_connection_t connection = race->connection;
+
+	while (race->next_candidate < race->num_candidates) {
+		int index = race->next_candidate++;
+		ms_speech_race_attempt_t *attempt = &race->candidates[index];
+		ms_speech_connection_log(connection,
+								 MS_SPEECH_LOG_DEBUG,
+								 "Connect attempt %d/%d to %s (%s)",
+								 index + 1,
+								 race->num_candidates,
+								 connection->endpoints[attempt->endpoint].address,
+								 attempt->address);
+
+		// lws may report an immediate failure before returning
+		race->launching = 1;
+		attempt->wsi = ms_speech_connection_connect_to(connection, &connection->endpoints[attempt->endpoint], attempt->address);
+		race->launching = 0;
+		if (attempt->wsi) {
+			race->active++;
+			race->next_attempt_at = ms_speech_get_monotonic_ms() + connection->context->connect_attempt_delay_ms;
+			return 0;
+		}
+	}
+
+	race->next_attempt_at = UINT64_MAX;
+	return -1;
+}
+
+int ms_speech_race_start(ms_speech_connection_t connection, const char *address)
+{
+	ms_speech_context_t context = connection->context;
+	if (context->connect_attempt_delay_ms < 0)
+		return 1;
+
+	int num_endpoints = connection->num_endpoints;
+	char (*addresses)[MS_SPEECH_RESOLVER_MAX_ADDRESSES][MS_SPEECH_RESOLVER_ADDRESS_SIZE] = malloc(num_endpoints * sizeof(*addresses));
+	int *counts = (int *)calloc(num_endpoints, sizeof(int));
+
+	for (int e=0; e<num_endpoints; e++) {
+		char (*list)[MS_SPEECH_RESOLVER_ADDRESS_SIZE] = addresses[e];
+		if (e != connection->endpoint || !address) {
+			counts[e] = ms_speech_resolver_get_addresses(context, connection->endpoints[e].address, list, MS_SPEECH_RESOLVER_MAX_ADDRESSES);
+			continue;
+		}
+
+		// the address picked by the resolver goes first
+		char resolved[MS_SPEECH_RESOLVER_MAX_ADDRESSES][MS_SPEECH_RESOLVER_ADDRESS_SIZE];
+		int num_resolved = ms_speech_resolver_get_addresses(context, connection->address, resolved, MS_SPEECH_RESOLVER_MAX_ADDRESSES);
+		snprintf(list[counts[e]++], MS_SPEECH_RESOLVER_ADDRESS_SIZE, "%s", address);
+		for (int i=0; i<num_resolved && counts[e] < MS_SPEECH_RESOLVER_MAX_ADDRESSES; i++) {
+			if (strcmp(resolved[i], address))
+				strcpy(list[counts[e]++], resolved[i]);
+		}
+	}
+
+	struct ms_speech_race_st *race = (struct ms_speech_race_st *)malloc(sizeof(struct ms_speech_race_st));
+	memset(race, 0, sizeof(struct ms_speech_race_st));
+	race->connection = connection;
+
+	// round robin over endpoints starting at the current one
+	for (int round=0; round<MS_SPEECH_RESOLVER_MAX_ADDRESSES; round++) {
+		for (int k=0; k<num_endpoints && race->num_candidates < MS_SPEECH_RACE_MAX_CANDIDATES; k++) {
+			int e = (connection->endpoint + k) % num_endpoints;
+			if (round >= counts[e])
+				continue;
+
+			ms_speech_race_attempt_t *attempt = &race->candidates[race->num_candidates++];
+			attempt->endpoint = e;
+			strcpy(attempt->address, addresses[e][round]);
+		}
+	}
+	free(addresses);
+	free(counts);
+
+	// a single path is connected to directly
+	if (race->num_candidates < (address ? 2 : 1)) {
+		free(race);
+		return 1;
+	}
+
+	// every attempt presents the same connection ID
+	ms_speech_generate_guid(connection->connection_id, sizeof(connection->connection_id), 0);
+
+	connection->race = race;
+	race->next = context->racing;
+	context->racing = race;
+
+	if (ms_speech_race_launch(race) && !race->active) {
+		ms_speech_race_cancel(connection);
+		return -ECONNREFUSED;
+	}
+
+	return 0;
+}
+
+void ms_speech_race_service(ms_speech_context_t context)
+{
+	uint64_t now = ms_speech_get_monotonic_ms();
+
+	struct ms_speech_race_st *race = context->racing;
+	while (race) {
+		if (now >= race->next_attempt_at && race->active < context->connect_max_parallel &&
+			ms_speech_race_launch(race) && !race->active) {
+			ms_speech_connection_t connection = race->connection;
+			ms_speech_race_cancel(connection);
+			ms_speech_handle_connection_error(connection, 0, "Unable to connect");
+			// callbacks may have disconnected other racing connections,
+			// those already launched are not due again
+			race = context->racing;
+			continue;
+		}
+		race = race->next;
+	}
+}
+
+int ms_speech_race_handle_callback(ms_speech_connection_t connection, struct lws *wsi, enum lws_callback_reasons reason)
+{
+	struct ms_speech_race_st *race = connection->race;
+	if (!race)
+		return 0;
+
+	ms_speech_race_attempt_t *attempt = NULL;
+	for (int i=0; i<race->next_candidate; i++) {
+		if (race->candidates[i].wsi == wsi) {
+			attempt = &race->candidates[i];
+			break;
+		}
+	}
+	if (!attempt)
+		return race->launching && reason == LWS_CALLBACK_CLIENT_CONNECTION_ERROR;
+
+	switch (reason) {
+		case LWS_CALLBACK_CLIENT_ESTABLISHED:
+			attempt->wsi = NULL;
+			connection->wsi = wsi;
+			if (attempt->endpoint != connection->endpoint)
+				ms_speech_select_endpoint(connection, attempt->endpoint);
+			ms_speech_connection_log(connection,
+									 MS_SPEECH_LOG_DEBUG,
+									 "Connect attempt %d to %s won",
+									 (int)(attempt - race->candidates) + 1,
+									 attempt->address);
+
+			ms_speech_race_cancel(connection);
+			return 0;
+
+		case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
+			attempt->wsi = NULL;
+			race->active--;
+			ms_speech_connection_log(connection,
+									 MS_SPEECH_LOG_DEBUG,
+									 "Connect attempt %d to %s failed",
+									 (int)(attempt - race->candidates) + 1,
+									 attempt->address);
+
+			// do not wait for the stagger delay once a path has failed
+			if (!ms_speech_race_launch(race) || race->active > 0)
+				return 1;
+
+			ms_speech_race_cancel(connection);
+			return 0;
+
+		default:
+			return 0;
+	}
+}
+
+void ms_speech_race_cancel(ms_speech_connection_t connection)
+{
+	struct ms_speech_race_st *race = connection->race;
+	if (!race)
+		return;
+
+	// losers are detached so that their close is not seen as ours
+	for (int i=0; i<race->next_candidate; i++) {
+		struct lws *wsi = race->candidates[i].wsi;
+		if (!wsi)
+			continue;
+
+		lws_set_wsi_user(wsi, NULL);
+		lws_set_timeout(wsi, PENDING_TIMEOUT_AWAITING_SERVER_RESPONSE, LWS_TO_KILL_ASYNC);
+	}
+
+	struct ms_speech_race_st **p = &connection->context->racing;
+	while (*p && *p != race)
+		p = &(*p)->next;
+	if (*p)
+		*p = race->next;
+
+	free(race);
+	connection->race = NULL;
+}
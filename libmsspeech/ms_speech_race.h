@@ -0,0 +1,53 @@
+/*
+
+Copyright 2017 technicianted
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+*/
+
+#ifndef ms_speech_race_h
+#define ms_speech_race_h
+
+#include <stdint.h>
+
+#include "ms_speech_priv.h"
+#include "ms_speech_resolver.h"
+
+#define MS_SPEECH_RACE_MAX_CANDIDATES 16
+#define MS_SPEECH_RACE_DEFAULT_DELAY_MS 250
+#define MS_SPEECH_RACE_DEFAULT_PARALLEL 4
+
+typedef struct {
+	int endpoint;
+	char address[MS_SPEECH_RESOLVER_ADDRESS_SIZE];
+	struct lws *wsi;
+} ms_speech_race_attempt_t;
+
+struct ms_speech_race_st {
+	ms_speech_connection_t connection;
+
+	ms_speech_race_attempt_t candidates[MS_SPEECH_RACE_MAX_CANDIDATES];
+	int num_candidates;
+	int next_candidate;
+	int active;
+	int launching;
+	uint64_t next_attempt_at;
+
+	struct ms_speech_race_st *next;
+};
+
+int ms_speech_race_start(ms_speech_connection_t connection, const char *address);
+void ms_speech_race_service(ms_speech_context_t context);
+int ms_speech_race_handle_callback(ms_speech_connection_t connection, struct lws *wsi, enum lws_callback_reasons reason);
+void ms_speech_race_cancel(ms_speech_connection_t connection);
+
+#endif /* ms_speech_race_h */
@@ -0,0 +1,342 @@
+/*
+
+Copyright 2017 technicianted
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+*/
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include "ms_speech_reconnect.h"
+#include "ms_speech_logging_priv.h"
+#include "ms_speech_metrics.h"
+#include "ms_speech_memory.h"
+#include "ms_speech_status_control.h"
+#include "ms_speech_timestamp.h"
+
+static void ms_speech_reconnect_unlink(ms_speech_connection_t connection);
+static void ms_speech_reconnect_drop(struct ms_speech_reconnect_st *reconnect, size_t len);
+
+int ms_speech_set_reconnect_policy(ms_speech_connection_t connection, const ms_speech_reconnect_policy_t *policy)
+{
+	if (connection->status == MS_SPEECH_CLIENT_STREAMING ||
+		connection->status == MS_SPEECH_CLIENT_STREAMING_BLOCKED ||
+		connection->status == MS_SPEECH_CLIENT_TURN_PENDING) {
+		ms_speech_connection_log(connection,
+								 MS_SPEECH_LOG_WARN,
+								 "Cannot change reconnect policy while streaming");
+		return EPERM;
+	}
+
+	ms_speech_reconnect_destroy(connection);
+	if (policy == NULL || policy->max_attempts <= 0)
+		return 0;
+
+	struct ms_speech_reconnect_st *reconnect = (struct ms_speech_reconnect_st *)malloc(sizeof(struct ms_speech_reconnect_st));
+	memset(reconnect, 0, sizeof(struct ms_speech_reconnect_st));
+	reconnect->policy = *policy;
+	if (reconnect->policy.initial_backoff_ms <= 0)
+		reconnect->policy.initial_backoff_ms = 100;
+	if (reconnect->policy.max_backoff_ms < reconnect->policy.initial_backoff_ms)
+		reconnect->policy.max_backoff_ms = reconnect->policy.initial_backoff_ms;
+	if (reconnect->policy.replay_buffer_size == 0)
+		reconnect->policy.replay_buffer_size = MS_SPEECH_RECONNECT_DEFAULT_REPLAY_BUFFER_SIZE;
+	if (reconnect->policy.audio_bytes_per_second <= 0)
+		reconnect->policy.audio_bytes_per_second = MS_SPEECH_RECONNECT_DEFAULT_BYTES_PER_SECOND;
+
+	if (ms_speech_memory_reserve(connection, sizeof(struct ms_speech_reconnect_st) + reconnect->policy.replay_buffer_size)) {
+		ms_speech_connection_log(connection,
+								 MS_SPEECH_LOG_WARN,
+								 "Replay buffer of %zu bytes exceeds connection memory budget",
+								 reconnect->policy.replay_buffer_size);
+		free(reconnect);
+		return -ENOBUFS;
+	}
+
+	reconnect->capacity = reconnect->policy.replay_buffer_size;
+	reconnect->buffer = (unsigned char *)malloc(reconnect->capacity);
+	reconnect->bytes_per_second = reconnect->policy.audio_bytes_per_second;
+	reconnect->random_seed = (unsigned int)(ms_speech_get_monotonic_ms() ^ (uintptr_t)connection);
+	connection->reconnect = reconnect;
+
+	return 0;
+}
+
+void ms_speech_reconnect_destroy(ms_speech_connection_t connection)
+{
+	if (connection->reconnect) {
+		ms_speech_reconnect_unlink(connection);
+		free(connection->reconnect->buffer);
+		free(connection->reconnect);
+		connection->reconnect = NULL;
+	}
+}
+
+void ms_speech_reconnect_reset(ms_speech_connection_t connection)
+{
+	struct ms_speech_reconnect_st *reconnect = connection->reconnect;
+	if (!reconnect)
+		return;
+
+	reconnect->start = 0;
+	reconnect->length = 0;
+	reconnect->base_offset = 0;
+	reconnect->header_length = 0;
+	reconnect->bytes_per_second = reconnect->policy.audio_bytes_per_second;
+	reconnect->audio_seen = 0;
+	reconnect->replaying = 0;
+	reconnect->offset_base = 0;
+}
+
+void ms_speech_reconnect_service(ms_speech_context_t context)
+{
+	uint64_t now = ms_speech_get_monotonic_ms();
+	ms_speech_connection_t *p = &context->reconnecting;
+	while (*p) {
+		ms_speech_connection_t connection = *p;
+		struct ms_speech_reconnect_st *reconnect = connection->reconnect;
+		if (now < reconnect->reconnect_at) {
+			p = &reconnect->next;
+			continue;
+		}
+
+		*p = reconnect->next;
+		reconnect->next = NULL;
+		reconnect->reconnect_at = 0;
+
+		ms_speech_connection_log(connection,
+								 MS_SPEECH_LOG_INFO,
+								 "Reconnecting, attempt %d",
+								 reconnect->attempt);
+		if (ms_speech_connection_open(connection) && !ms_speech_reconnect_schedule(connection)) {
+			ms_speech_set_connection_status(connection, MS_SPEECH_CLIENT_DISCONNECTED);
+			ms_speech_set_status(connection, MS_SPEECH_CLIENT_IDLE);
+			if (connection->callbacks->connection_error) {
+				connection->callbacks->connection_error(connection, 0, "Unable to reconnect", connection->callbacks->user_data);
+				// the callback may have disconnected the connection p points into
+				p = &context->reconnecting;
+			}
+		}
+	}
+}
+
+int ms_speech_reconnect_schedule(ms_speech_connection_t connection)
+{
+	struct ms_speech_reconnect_st *reconnect = connection->reconnect;
+	if (!reconnect)
+		return 0;
+
+	if (!reconnect->reconnecting) {
+		// only requests that still have audio in flight are recovered
+		if (connection->status != MS_SPEECH_CLIENT_STREAMING &&
+			connection->status != MS_SPEECH_CLIENT_STREAMING_BLOCKED &&
+			connection->status != MS_SPEECH_CLIENT_TURN_PENDING)
+			return 0;
+
+		reconnect->reconnecting = 1;
+		reconnect->resume_status = connection->status;
+		reconnect->attempt = 0;
+	}
+
+	if (reconnect->attempt >= reconnect->policy.max_attempts) {
+		ms_speech_connection_log(connection,
+								 MS_SPEECH_LOG_ERR,
+								 "Giving up after %d reconnect attempts",
+								 reconnect->attempt);
+		reconnect->reconnecting = 0;
+		reconnect->replaying = 0;
+		return 0;
+	}
+
+	// equal jitter, half of the exponential backoff plus a random share of the other half
+	int64_t delay_ms = reconnect->policy.initial_backoff_ms;
+	for (int i=0; i<reconnect->attempt && delay_ms < reconnect->policy.max_backoff_ms; i++)
+		delay_ms *= 2;
+	if (delay_ms > reconnect->policy.max_backoff_ms)
+		delay_ms = reconnect->policy.max_backoff_ms;
+	delay_ms = delay_ms / 2 + rand_r(&reconnect->random_seed) % (delay_ms / 2 + 1);
+
+	reconnect->attempt++;
+	ms_speech_metrics_add(connection->context, MS_SPEECH_METRIC_RECONNECTS, 1);
+	reconnect->reconnect_at = ms_speech_get_monotonic_ms() + delay_ms;
+	ms_speech_reconnect_unlink(connection);
+	reconnect->next = connection->context->reconnecting;
+	connection->context->reconnecting = connection;
+
+	ms_speech_connection_log(connection,
+							 MS_SPEECH_LOG_WARN,
+							 "Connection lost, reconnecting in %d ms (attempt %d/%d)",
+							 (int)delay_ms,
+							 reconnect->attempt,
+							 reconnect->policy.max_attempts);
+	if (connection->callbacks->connection_reconnecting)
+		connection->callbacks->connection_reconnecting(connection, reconnect->attempt, (int)delay_ms, connection->callbacks->user_data);
+
+	return 1;
+}
+
+void ms_speech_reconnect_cancel(ms_speech_connection_t connection)
+{
+	struct ms_speech_reconnect_st *reconnect = connection->reconnect;
+	if (!reconnect)
+		return;
+
+	ms_speech_reconnect_unlink(connection);
+	reconnect->reconnecting = 0;
+	reconnect->replaying = 0;
+	reconnect->reconnect_at = 0;
+}
+
+int ms_speech_reconnect_resume(ms_speech_connection_t connection)
+{
+	struct ms_speech_reconnect_st *reconnect = connection->reconnect;
+	if (!reconnect || !reconnect->reconnecting)
+		return 0;
+
+	if (reconnect->resume_status == MS_SPEECH_CLIENT_STREAMING_BLOCKED)
+		reconnect->resume_status = MS_SPEECH_CLIENT_STREAMING;
+
+	return 1;
+}
+
+void ms_speech_reconnect_record_audio(ms_speech_connection_t connection, const unsigned char *buffer, int len)
+{
+	struct ms_speech_reconnect_st *reconnect = connection->reconnect;
+	if (!reconnect || len <= 0)
+		return;
+
+	if (!reconnect->audio_seen) {
+		reconnect->audio_seen = 1;
+		if (len >= MS_SPEECH_RECONNECT_WAV_HEADER_SIZE && !memcmp(buffer, "RIFF", 4)) {
+			memcpy(reconnect->header, buffer, MS_SPEECH_RECONNECT_WAV_HEADER_SIZE);
+			reconnect->header_length = MS_SPEECH_RECONNECT_WAV_HEADER_SIZE;
+			int byte_rate = buffer[28] | (buffer[29] << 8) | (buffer[30] << 16) | (buffer[31] << 24);
+			if (byte_rate > 0)
+				reconnect->bytes_per_second = byte_rate;
+			buffer += MS_SPEECH_RECONNECT_WAV_HEADER_SIZE;
+			len -= MS_SPEECH_RECONNECT_WAV_HEADER_SIZE;
+		}
+	}
+
+	if ((size_t)len > reconnect->capacity) {
+		ms_speech_reconnect_drop(reconnect, reconnect->length);
+		reconnect->base_offset += len - reconnect->capacity;
+		buffer += len - reconnect->capacity;
+		len = (int)reconnect->capacity;
+	}
+	if (reconnect->length + len > reconnect->capacity)
+		ms_speech_reconnect_drop(reconnect, reconnect->length + len - reconnect->capacity);
+
+	size_t end = (reconnect->start + reconnect->length) % reconnect->capacity;
+	size_t first = reconnect->capacity - end;
+	if (first > (size_t)len)
+		first = len;
+	memcpy(reconnect->buffer + end, buffer, first);
+	memcpy(reconnect->buffer, buffer + first, len - first);
+	reconnect->length += len;
+}
+
+void ms_speech_reconnect_start_replay(ms_speech_connection_t connection)
+{
+	struct ms_speech_reconnect_st *reconnect = connection->reconnect;
+	reconnect->replaying = 1;
+	reconnect->replay_header_pending = reconnect->header_length > 0;
+	reconnect->replay_position = 0;
+	reconnect->offset_base = (double)reconnect->base_offset / reconnect->bytes_per_second;
+
+	ms_speech_connection_log(connection,
+							 MS_SPEECH_LOG_INFO,
+							 "Reconnected, replaying %zu bytes of audio from offset %f",
+							 reconnect->length,
+							 reconnect->offset_base);
+}
+
+int ms_speech_reconnect_replay(ms_speech_connection_t connection, unsigned char *buffer, int len)
+{
+	struct ms_speech_reconnect_st *reconnect = connection->reconnect;
+	int written = 0;
+
+	if (reconnect->replay_header_pending) {
+		memcpy(buffer, reconnect->header, reconnect->header_length);
+		written = (int)reconnect->header_length;
+		reconnect->replay_header_pending = 0;
+	}
+
+	while (written < len && reconnect->replay_position < reconnect->length) {
+		size_t position = (reconnect->start + reconnect->replay_position) % reconnect->capacity;
+		size_t chunk = reconnect->capacity - position;
+		if (chunk > reconnect->length - reconnect->replay_position)
+			chunk = reconnect->length - reconnect->replay_position;
+		if (chunk > (size_t)(len - written))
+			chunk = len - written;
+		memcpy(buffer + written, reconnect->buffer + position, chunk);
+		written += chunk;
+		reconnect->replay_position += chunk;
+	}
+
+	return written;
+}
+
+client_status_t ms_speech_reconnect_finish_replay(ms_speech_connection_t connection)
+{
+	struct ms_speech_reconnect_st *reconnect = connection->reconnect;
+	reconnect->replaying = 0;
+	reconnect->reconnecting = 0;
+	reconnect->attempt = 0;
+
+	ms_speech_connection_log(connection,
+							 MS_SPEECH_LOG_INFO,
+							 "Replay complete, resuming with status %d",
+							 reconnect->resume_status);
+
+	return reconnect->resume_status;
+}
+
+double ms_speech_reconnect_offset_base(ms_speech_connection_t connection)
+{
+	return connection->reconnect ? connection->reconnect->offset_base : 0;
+}
+
+void ms_speech_reconnect_handle_phrase(ms_speech_connection_t connection, const ms_speech_phrase_timing_t *timing)
+{
+	struct ms_speech_reconnect_st *reconnect = connection->reconnect;
+	if (!reconnect)
+		return;
+
+	// audio up to the end of a final phrase never needs to be replayed
+	uint64_t finalized = (uint64_t)((timing->offset + timing->duration) * reconnect->bytes_per_second);
+	if (finalized > reconnect->base_offset) {
+		uint64_t len = finalized - reconnect->base_offset;
+		ms_speech_reconnect_drop(reconnect, len > reconnect->length ? reconnect->length : (size_t)len);
+	}
+}
+
+static void ms_speech_reconnect_unlink(ms_speech_connection_t connection)
+{
+	ms_speech_connection_t *p = &connection->context->reconnecting;
+	while (*p && *p != connection)
+		p = &(*p)->reconnect->next;
+	if (*p)
+		*p = connection->reconnect->next;
+	connection->reconnect->next = NULL;
+}
+
+static void ms_speech_reconnect_drop(struct ms_speech_reconnect_st *reconnect, size_t len)
+{
+	reconnect->start = (reconnect->start + len) % reconnect->capacity;
+	reconnect->length -= len;
+	reconnect->base_offset += len;
+	if (reconnect->replaying) {
+		reconnect->replay_position = reconnect->replay_position > len ? reconnect->replay_position - len : 0;
+	}
+}
@@ -0,0 +1,73 @@
+/*
+
+Copyright 2017 technicianted
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+*/
+
+#ifndef ms_speech_reconnect_h
+#define ms_speech_reconnect_h
+
+#include <stdint.h>
+
+#include "ms_speech_priv.h"
+
+#define MS_SPEECH_RECONNECT_DEFAULT_REPLAY_BUFFER_SIZE (32000 * 30)
+#define MS_SPEECH_RECONNECT_DEFAULT_BYTES_PER_SECOND 32000
+#define MS_SPEECH_RECONNECT_WAV_HEADER_SIZE 44
+
+struct ms_speech_reconnect_st {
+	ms_speech_reconnect_policy_t policy;
+	unsigned int random_seed;
+
+	// ring of audio sent since the last final result
+	unsigned char *buffer;
+	size_t capacity;
+	size_t start;
+	size_t length;
+	// position of the ring start on the original audio timeline, in bytes
+	uint64_t base_offset;
+
+	// RIFF header of the current request, resent ahead of replayed audio
+	unsigned char header[MS_SPEECH_RECONNECT_WAV_HEADER_SIZE];
+	size_t header_length;
+	int bytes_per_second;
+	int audio_seen;
+
+	int reconnecting;
+	int attempt;
+	uint64_t reconnect_at;
+	client_status_t resume_status;
+
+	int replaying;
+	int replay_header_pending;
+	size_t replay_position;
+	// added to result offsets to map them on the original timeline
+	double offset_base;
+
+	ms_speech_connection_t next;
+};
+
+void ms_speech_reconnect_destroy(ms_speech_connection_t connection);
+void ms_speech_reconnect_reset(ms_speech_connection_t connection);
+void ms_speech_reconnect_service(ms_speech_context_t context);
+int ms_speech_reconnect_schedule(ms_speech_connection_t connection);
+void ms_speech_reconnect_cancel(ms_speech_connection_t connection);
+int ms_speech_reconnect_resume(ms_speech_connection_t connection);
+void ms_speech_reconnect_record_audio(ms_speech_connection_t connection, const unsigned char *buffer, int len);
+void ms_speech_reconnect_start_replay(ms_speech_connection_t connection);
+int ms_speech_reconnect_replay(ms_speech_connection_t connection, unsigned char *buffer, int len);
+client_status_t ms_speech_reconnect_finish_replay(ms_speech_connection_t connection);
+double ms_speech_reconnect_offset_base(ms_speech_connection_t connection);
+void ms_speech_reconnect_handle_phrase(ms_speech_connection_t connection, const ms_speech_phrase_timing_t *timing);
+
+#endif /* ms_speech_reconnect_h */
@@ -0,0 +1,365 @@
+/*
+
+Copyright 2017 technicianted
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+*/
+
+#include <errno.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "compat.h"
+#include "ms_speech_resolver.h"
+#include "ms_speech_logging_priv.h"
+#include "ms_speech_timestamp.h"
+
+static void *ms_speech_resolver_thread(void *arg);
+static int ms_speech_resolver_request(struct ms_speech_resolver_st *resolver, ms_speech_resolver_entry_t *entry);
+static void ms_speech_resolver_free_requests(ms_speech_resolver_request_t *request);
+
+void ms_speech_resolver_initialize(ms_speech_context_t context, int ttl_ms)
+{
+	struct ms_speech_resolver_st *resolver = (struct ms_speech_resolver_st *)malloc(sizeof(struct ms_speech_resolver_st));
+	memset(resolver, 0, sizeof(struct ms_speech_resolver_st));
+	resolver->context = context;
+	resolver->ttl_ms = ttl_ms > 0 ? ttl_ms : MS_SPEECH_RESOLVER_DEFAULT_TTL_MS;
+	pthread_mutex_init(&resolver->lock, NULL);
+	pthread_cond_init(&resolver->cond, NULL);
+
+	context->resolver = resolver;
+}
+
+void ms_speech_resolver_destroy(ms_speech_context_t context)
+{
+	struct ms_speech_resolver_st *resolver = context->resolver;
+	if (!resolver)
+		return;
+
+	if (resolver->thread_started) {
+		pthread_mutex_lock(&resolver->lock);
+		resolver->stopping = 1;
+		pthread_cond_signal(&resolver->cond);
+		pthread_mutex_unlock(&resolver->lock);
+		pthread_join(resolver->thread, NULL);
+	}
+
+	ms_speech_resolver_free_requests(resolver->requests);
+	ms_speech_resolver_free_requests(resolver->completions);
+	while (resolver->entries) {
+		ms_speech_resolver_entry_t *entry = resolver->entries;
+		resolver->entries = entry->next;
+		free(entry->host);
+		free(entry);
+	}
+
+	pthread_cond_destroy(&resolver->cond);
+	pthread_mutex_destroy(&resolver->lock);
+	free(resolver);
+	context->resolver = NULL;
+}
+
+int ms_speech_context_preresolve(ms_speech_context_t context, const char *uri)
+{
+	char *uri_copy = strdup(uri);
+	const char *prot;
+	const char *address;
+	const char *path;
+	int port;
+	int r = lws_parse_uri(uri_copy, &prot, &address, &port, &path);
+	if (!r)
+		r = ms_speech_resolver_prefetch(context, address);
+	else
+		r = -EINVAL;
+
+	free(uri_copy);
+	return r;
+}
+
+ms_speech_resolver_entry_t *ms_speech_resolver_find(ms_speech_context_t context, const char *host)
+{
+	for (ms_speech_resolver_entry_t *entry = context->resolver->entries; entry; entry = entry->next) {
+		if (!strcasecmp(entry->host, host))
+			return entry;
+	}
+
+	return NULL;
+}
+
+static ms_speech_resolver_entry_t *ms_speech_resolver_get_entry(ms_speech_context_t context, const char *host)
+{
+	ms_speech_resolver_entry_t *entry = ms_speech_resolver_find(context, host);
+	if (!entry) {
+		entry = (ms_speech_resolver_entry_t *)malloc(sizeof(ms_speech_resolver_entry_t));
+		memset(entry, 0, sizeof(ms_speech_resolver_entry_t));
+		entry->host = strdup(host);
+		entry->next = context->resolver->entries;
+		context->resolver->entries = entry;
+	}
+
+	return entry;
+}
+
+static int ms_speech_resolver_is_numeric(const char *host)
+{
+	struct in6_addr address;
+	return inet_pton(AF_INET, host, &address) == 1 || inet_pton(AF_INET6, host, &address) == 1;
+}
+
+int ms_speech_resolver_prefetch(ms_speech_context_t context, const char *host)
+{
+	if (ms_speech_resolver_is_numeric(host))
+		return 0;
+
+	ms_speech_resolver_entry_t *entry = ms_speech_resolver_get_entry(context, host);
+	if (entry->pending || ms_speech_get_monotonic_ms() < entry->expires)
+		return 0;
+
+	return ms_speech_resolver_request(context->resolver, entry);
+}
+
+int ms_speech_resolver_lookup(ms_speech_connection_t connection, char *address, size_t len)
+{
+	if (ms_speech_resolver_is_numeric(connection->address)) {
+		snprintf(address, len, "%s", connection->address);
+		return 0;
+	}
+
+	struct ms_speech_resolver_st *resolver = connection->context->resolver;
+	ms_speech_resolver_entry_t *entry = ms_speech_resolver_get_entry(connection->context, connection->address);
+	uint64_t now = ms_speech_get_monotonic_ms();
+
+	if (entry->num_addresses > 0) {
+		// stale entries are still used while they are being refreshed
+		if (now >= entry->expires && !entry->pending)
+			ms_speech_resolver_request(resolver, entry);
+
+		snprintf(address, len, "%s", entry->addresses[entry->next_address % entry->num_addresses]);
+		entry->next_address++;
+		return 0;
+	}
+
+	if (!entry->pending && now < entry->expires)
+		return -EHOSTUNREACH;
+
+	if (!entry->pending && ms_speech_resolver_request(resolver, entry))
+		return -EHOSTUNREACH;
+
+	ms_speech_connection_log(connection,
+							 MS_SPEECH_LOG_DEBUG,
+							 "Waiting for %s to be resolved",
+							 connection->address);
+	connection->resolve_next = resolver->waiting;
+	resolver->waiting = connection;
+	connection->resolving = 1;
+
+	return -EINPROGRESS;
+}
+
+int ms_speech_resolver_get_addresses(ms_speech_context_t context, const char *host, char addresses[][MS_SPEECH_RESOLVER_ADDRESS_SIZE], int max)
+{
+	if (ms_speech_resolver_is_numeric(host)) {
+		snprintf(addresses[0], MS_SPEECH_RESOLVER_ADDRESS_SIZE, "%s", host);
+		return 1;
+	}
+
+	ms_speech_resolver_entry_t *entry = ms_speech_resolver_find(context, host);
+	if (!entry || entry->num_addresses == 0) {
+		ms_speech_resolver_prefetch(context, host);
+		return 0;
+	}
+
+	// alternate address families so that a broken one does not stall the other
+	int used[MS_SPEECH_RESOLVER_MAX_ADDRESSES] = { 0 };
+	int last_v6 = -1;
+	int n = 0;
+	while (n < max && n < entry->num_addresses) {
+		int pick = -1;
+		for (int i=0; i<entry->num_addresses; i++) {
+			int j = (entry->next_address + i) % entry->num_addresses;
+			if (used[j])
+				continue;
+			if (pick < 0)
+				pick = j;
+			if ((strchr(entry->addresses[j], ':') != NULL) != last_v6) {
+				pick = j;
+				break;
+			}
+		}
+
+		used[pick] = 1;
+		last_v6 = strchr(entry->addresses[pick], ':') != NULL;
+		strcpy(addresses[n++], entry->addresses[pick]);
+	}
+
+	return n;
+}
+
+void ms_speech_resolver_cancel(ms_speech_connection_t connection)
+{
+	if (!connection->resolving)
+		return;
+
+	ms_speech_connection_t *p = &connection->context->resolver->waiting;
+	while (*p && *p != connection)
+		p = &(*p)->resolve_next;
+	if (*p)
+		*p = connection->resolve_next;
+	connection->resolve_next = NULL;
+	connection->resolving = 0;
+}
+
+void ms_speech_resolver_service(ms_speech_context_t context)
+{
+	struct ms_speech_resolver_st *resolver = context->resolver;
+	if (!resolver->thread_started)
+		return;
+
+	pthread_mutex_lock(&resolver->lock);
+	ms_speech_resolver_request_t *completions = resolver->completions;
+	resolver->completions = NULL;
+	pthread_mutex_unlock(&resolver->lock);
+
+	uint64_t now = ms_speech_get_monotonic_ms();
+	while (completions) {
+		ms_speech_resolver_request_t *completion = completions;
+		completions = completion->next;
+
+		ms_speech_resolver_entry_t *entry = ms_speech_resolver_get_entry(context, completion->host);
+		entry->pending = 0;
+		if (completion->num_addresses > 0) {
+			memcpy(entry->addresses, completion->addresses, sizeof(entry->addresses));
+			entry->num_addresses = completion->num_addresses;
+			entry->expires = now + resolver->ttl_ms;
+		} else if (entry->num_addresses == 0) {
+			entry->expires = now + MS_SPEECH_RESOLVER_NEGATIVE_TTL_MS;
+		} else {
+			// keep serving the last good answer for a while
+			entry->expires = now + MS_SPEECH_RESOLVER_NEGATIVE_TTL_MS;
+		}
+
+		ms_speech_log(completion->num_addresses > 0 ? MS_SPEECH_LOG_DEBUG : MS_SPEECH_LOG_WARN,
+					  "Resolved %s: %d addresses, %s",
+					  completion->host,
+					  completion->num_addresses,
+					  completion->error ? gai_strerror(completion->error) : "ok");
+
+		// resume connections that were waiting on this host
+		ms_speech_connection_t *p = &resolver->waiting;
+		while (*p) {
+			ms_speech_connection_t connection = *p;
+			if (strcasecmp(connection->address, entry->host)) {
+				p = &connection->resolve_next;
+				continue;
+			}
+
+			*p = connection->resolve_next;
+			connection->resolve_next = NULL;
+			connection->resolving = 0;
+			if (!ms_speech_connection_open(connection))
+				continue;
+			ms_speech_handle_connection_error(connection,
+											  0,
+											  entry->num_addresses > 0 ? "Unable to connect" : "Unable to resolve host");
+			// the list may have changed underneath us
+			p = &resolver->waiting;
+		}
+
+		free(completion->host);
+		free(completion);
+	}
+}
+
+static int ms_speech_resolver_request(struct ms_speech_resolver_st *resolver, ms_speech_resolver_entry_t *entry)
+{
+	pthread_mutex_lock(&resolver->lock);
+	if (!resolver->thread_started) {
+		if (pthread_create(&resolver->thread, NULL, &ms_speech_resolver_thread, resolver)) {
+			pthread_mutex_unlock(&resolver->lock);
+			ms_speech_log(MS_SPEECH_LOG_ERR,
+						  "Unable to start resolver thread");
+			return -EAGAIN;
+		}
+		resolver->thread_started = 1;
+	}
+
+	ms_speech_resolver_request_t *request = (ms_speech_resolver_request_t *)malloc(sizeof(ms_speech_resolver_request_t));
+	memset(request, 0, sizeof(ms_speech_resolver_request_t));
+	request->host = strdup(entry->host);
+
+	ms_speech_resolver_request_t **p = &resolver->requests;
+	while (*p)
+		p = &(*p)->next;
+	*p = request;
+	pthread_cond_signal(&resolver->cond);
+	pthread_mutex_unlock(&resolver->lock);
+
+	entry->pending = 1;
+
+	return 0;
+}
+
+static void *ms_speech_resolver_thread(void *arg)
+{
+	struct ms_speech_resolver_st *resolver = (struct ms_speech_resolver_st *)arg;
+
+	pthread_mutex_lock(&resolver->lock);
+	while (!resolver->stopping) {
+		if (!resolver->requests) {
+			pthread_cond_wait(&resolver->cond, &resolver->lock);
+			continue;
+		}
+
+		ms_speech_resolver_request_t *request = resolver->requests;
+		resolver->requests = request->next;
+		request->next = NULL;
+		pthread_mutex_unlock(&resolver->lock);
+
+		struct addrinfo hints;
+		struct addrinfo *result = NULL;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		request->error = getaddrinfo(request->host, NULL, &hints, &result);
+		for (struct addrinfo *ai = result; ai && request->num_addresses < MS_SPEECH_RESOLVER_MAX_ADDRESSES; ai = ai->ai_next) {
+			const void *address = NULL;
+			if (ai->ai_family == AF_INET)
+				address = &((struct sockaddr_in *)ai->ai_addr)->sin_addr;
+			else if (ai->ai_family == AF_INET6)
+				address = &((struct sockaddr_in6 *)ai->ai_addr)->sin6_addr;
+			if (address && inet_ntop(ai->ai_family, address, request->addresses[request->num_addresses], MS_SPEECH_RESOLVER_ADDRESS_SIZE))
+				request->num_addresses++;
+		}
+		if (result)
+			freeaddrinfo(result);
+
+		pthread_mutex_lock(&resolver->lock);
+		request->next = resolver->completions;
+		resolver->completions = request;
+		if (!resolver->stopping)
+			lws_cancel_service(resolver->context->context);
+	}
+	pthread_mutex_unlock(&resolver->lock);
+
+	return NULL;
+}
+
+static void ms_speech_resolver_free_requests(ms_speech_resolver_request_t *request)
+{
+	while (request) {
+		ms_speech_resolver_request_t *next = request->next;
+		free(request->host);
+		free(request);
+		request = next;
+	}
+}
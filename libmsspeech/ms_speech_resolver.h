@@ -0,0 +1,78 @@
+/*
+
+Copyright 2017 technicianted
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+*/
+
+#ifndef ms_speech_resolver_h
+#define ms_speech_resolver_h
+
+#include <pthread.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "ms_speech_priv.h"
+
+#define MS_SPEECH_RESOLVER_MAX_ADDRESSES 8
+#define MS_SPEECH_RESOLVER_ADDRESS_SIZE INET6_ADDRSTRLEN
+#define MS_SPEECH_RESOLVER_DEFAULT_TTL_MS 60000
+#define MS_SPEECH_RESOLVER_NEGATIVE_TTL_MS 5000
+
+typedef struct ms_speech_resolver_entry_st {
+	char *host;
+	char addresses[MS_SPEECH_RESOLVER_MAX_ADDRESSES][MS_SPEECH_RESOLVER_ADDRESS_SIZE];
+	int num_addresses;
+	int next_address;
+	uint64_t expires;
+	int pending;
+
+	struct ms_speech_resolver_entry_st *next;
+} ms_speech_resolver_entry_t;
+
+typedef struct ms_speech_resolver_request_st {
+	char *host;
+	int error;
+	char addresses[MS_SPEECH_RESOLVER_MAX_ADDRESSES][MS_SPEECH_RESOLVER_ADDRESS_SIZE];
+	int num_addresses;
+
+	struct ms_speech_resolver_request_st *next;
+} ms_speech_resolver_request_t;
+
+struct ms_speech_resolver_st {
+	ms_speech_context_t context;
+	int ttl_ms;
+
+	// owned by the service thread
+	ms_speech_resolver_entry_t *entries;
+	ms_speech_connection_t waiting;
+
+	// shared with the resolver thread
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	int thread_started;
+	int stopping;
+	ms_speech_resolver_request_t *requests;
+	ms_speech_resolver_request_t *completions;
+};
+
+void ms_speech_resolver_initialize(ms_speech_context_t context, int ttl_ms);
+void ms_speech_resolver_destroy(ms_speech_context_t context);
+void ms_speech_resolver_service(ms_speech_context_t context);
+int ms_speech_resolver_prefetch(ms_speech_context_t context, const char *host);
+int ms_speech_resolver_lookup(ms_speech_connection_t connection, char *address, size_t len);
+void ms_speech_resolver_cancel(ms_speech_connection_t connection);
+int ms_speech_resolver_get_addresses(ms_speech_context_t context, const char *host, char addresses[][MS_SPEECH_RESOLVER_ADDRESS_SIZE], int max);
+ms_speech_resolver_entry_t *ms_speech_resolver_find(ms_speech_context_t context, const char *host);
+
+#endif /* ms_speech_resolver_h */
@@ -0,0 +1,96 @@
+/*
+
+Copyright 2017 technicianted
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+*/
+#include <stdlib.h>
+#include <string.h>
+
+#include "ms_speech_priv.h"
+#include "ms_speech_slab.h"
+#include "ms_speech_logging_priv.h"
+
+// objects follow the chunk header at the first aligned offset
+#define MS_SPEECH_SLAB_HEADER_SIZE \
+	((sizeof(ms_speech_slab_chunk_t) + MS_SPEECH_SLAB_ALIGNMENT - 1) & ~(size_t)(MS_SPEECH_SLAB_ALIGNMENT - 1))
+
+void ms_speech_slab_initialize(ms_speech_slab_t *slab, const char *name, size_t object_size, int objects_per_chunk)
+{
+	memset(slab, 0, sizeof(ms_speech_slab_t));
+	slab->name = name;
+	if (object_size < sizeof(void *))
+		object_size = sizeof(void *);
+	slab->object_size = (object_size + MS_SPEECH_SLAB_ALIGNMENT - 1) & ~(size_t)(MS_SPEECH_SLAB_ALIGNMENT - 1);
+	slab->objects_per_chunk = objects_per_chunk > 0 ? objects_per_chunk : 1;
+}
+
+void ms_speech_slab_destroy(ms_speech_slab_t *slab)
+{
+	if (slab->in_use)
+		ms_speech_log(MS_SPEECH_LOG_WARN,
+					  "Releasing %lu %s objects still in use",
+					  slab->in_use,
+					  slab->name);
+
+	while (slab->chunks) {
+		ms_speech_slab_chunk_t *chunk = slab->chunks;
+		slab->chunks = chunk->next;
+		free(chunk);
+	}
+	slab->free_list = NULL;
+	slab->in_use = 0;
+	slab->capacity = 0;
+}
+
+static int ms_speech_slab_grow(ms_speech_slab_t *slab)
+{
+	ms_speech_slab_chunk_t *chunk = (ms_speech_slab_chunk_t *)malloc(MS_SPEECH_SLAB_HEADER_SIZE + slab->object_size * slab->objects_per_chunk);
+	if (!chunk)
+		return -1;
+	chunk->next = slab->chunks;
+	slab->chunks = chunk;
+
+	// thread the new objects in address order
+	char *objects = (char *)chunk + MS_SPEECH_SLAB_HEADER_SIZE;
+	for (int i=slab->objects_per_chunk - 1; i>=0; i--) {
+		void *object = objects + i * slab->object_size;
+		*(void **)object = slab->free_list;
+		slab->free_list = object;
+	}
+	slab->capacity += slab->objects_per_chunk;
+
+	return 0;
+}
+
+void *ms_speech_slab_alloc(ms_speech_slab_t *slab)
+{
+	if (!slab->free_list && ms_speech_slab_grow(slab))
+		return NULL;
+
+	void *object = slab->free_list;
+	slab->free_list = *(void **)object;
+	slab->in_use++;
+	memset(object, 0, slab->object_size);
+
+	return object;
+}
+
+void ms_speech_slab_free(ms_speech_slab_t *slab, void *object)
+{
+	if (!object)
+		return;
+
+	*(void **)object = slab->free_list;
+	slab->free_list = object;
+	slab->in_use--;
+}
@@ -0,0 +1,46 @@
+/*
+
+Copyright 2017 technicianted
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+*/
+#ifndef ms_speech_slab_h
+#define ms_speech_slab_h
+
+#include <stddef.h>
+
+#define MS_SPEECH_SLAB_ALIGNMENT 16
+
+// fixed size objects carved out of chunks, freed objects are kept on a
+// free list and chunks are only released when the slab is destroyed
+typedef struct ms_speech_slab_chunk_st {
+	struct ms_speech_slab_chunk_st *next;
+} ms_speech_slab_chunk_t;
+
+typedef struct {
+	const char *name;
+	size_t object_size;
+	int objects_per_chunk;
+
+	void *free_list;
+	ms_speech_slab_chunk_t *chunks;
+
+	unsigned long in_use;
+	unsigned long capacity;
+} ms_speech_slab_t;
+
+void ms_speech_slab_initialize(ms_speech_slab_t *slab, const char *name, size_t object_size, int objects_per_chunk);
+void ms_speech_slab_destroy(ms_speech_slab_t *slab);
+void *ms_speech_slab_alloc(ms_speech_slab_t *slab);
+void ms_speech_slab_free(ms_speech_slab_t *slab, void *object);
+
+#endif /* ms_speech_slab_h */
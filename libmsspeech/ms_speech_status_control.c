@@ -16,9 +16,13 @@ all copies or substantial portions of the Software.
 
 #include "ms_speech_status_control.h"
 #include "ms_speech_logging_priv.h"
+#include "ms_speech_latency.h"
+#include "ms_speech_metrics.h"
 
 void ms_speech_set_status(ms_speech_connection_t connection, client_status_t status)
 {
+	ms_speech_latency_handle_status(connection, connection->status, status);
+	ms_speech_metrics_handle_status(connection, connection->status, status);
 	connection->status = status;
 	ms_speech_connection_log(connection,
 							 MS_SPEECH_LOG_DEBUG,
@@ -14,8 +14,14 @@ all copies or substantial portions of the Software.
 
 */
 
+#include <errno.h>
+
+#include "compat.h"
 #include "ms_speech_telemetry.h"
 #include "ms_speech_timestamp.h"
+#include "ms_speech_logging_priv.h"
+#include "ms_speech_metrics.h"
+#include "ms_speech_memory.h"
 #include "message_constants.h"
 #include "client_messages.h"
 
@@ -27,99 +33,167 @@ const char *MS_SPEECH_TELEMETRY_KEY_START_TIME = "Start";
 const char *MS_SPEECH_TELEMETRY_KEY_END_TIME = "End";
 const char *MS_SPEECH_TELEMETRY_KEY_ERROR = "Error";
 
-void ms_speech_telemetry_initialize(ms_speech_connection_t connection)
+int ms_speech_telemetry_initialize(ms_speech_connection_t connection)
 {
-	connection->telemetry = (ms_speech_telemetry_t *)malloc(sizeof(ms_speech_telemetry_t));
-	connection->telemetry->received_messages = json_object_new_object();
-	connection->telemetry->microphone = json_object_new_object();
-	json_object_object_add(connection->telemetry->microphone,
-						   MS_SPEECH_TELEMETRY_KEY_METRIC_NAME,
-						   json_object_new_string(MS_SPEECH_TELEMETRY_KEY_MICROPHONE));
+	connection->telemetry = (ms_speech_telemetry_t *)ms_speech_slab_alloc(&connection->context->telemetry_slab);
+	if (!connection->telemetry)
+		return -ENOMEM;
+
+	connection->telemetry->max_entries = connection->context->telemetry_max_entries;
+	return 0;
 }
 
 void ms_speech_telemetry_destroy(ms_speech_connection_t connection)
 {
 	if (connection->telemetry) {
-		if (connection->telemetry->received_messages)
-			json_object_put(connection->telemetry->received_messages);
-		if (connection->telemetry->microphone)
-			json_object_put(connection->telemetry->microphone);
-		free(connection->telemetry);
+		for (int i=0; i<connection->telemetry->num_paths; i++)
+			free(connection->telemetry->paths[i].timestamps);
+		ms_speech_slab_free(&connection->context->telemetry_slab, connection->telemetry);
 		connection->telemetry = NULL;
 	}
 }
 
+void ms_speech_telemetry_reset(ms_speech_connection_t connection)
+{
+	ms_speech_telemetry_t *telemetry = connection->telemetry;
+
+	// path slots and their storage are reused by the next turn
+	for (int i=0; i<telemetry->num_paths; i++)
+		telemetry->paths[i].count = 0;
+	telemetry->dropped = 0;
+	telemetry->microphone_start = 0;
+	telemetry->microphone_end = 0;
+	telemetry->microphone_error = 0;
+}
+
+static ms_speech_telemetry_path_t *ms_speech_telemetry_get_path(ms_speech_telemetry_t *telemetry, const char *path)
+{
+	for (int i=0; i<telemetry->num_paths; i++) {
+		if (!strcasecmp(telemetry->paths[i].path, path))
+			return &telemetry->paths[i];
+	}
+
+	if (telemetry->num_paths == MS_SPEECH_TELEMETRY_MAX_PATHS)
+		return NULL;
+
+	ms_speech_telemetry_path_t *entry = &telemetry->paths[telemetry->num_paths++];
+	snprintf(entry->path, sizeof(entry->path), "%s", path);
+	return entry;
+}
+
+static void ms_speech_telemetry_drop(ms_speech_connection_t connection)
+{
+	connection->telemetry->dropped++;
+	ms_speech_metrics_add(connection->context, MS_SPEECH_METRIC_TELEMETRY_DROPPED, 1);
+}
+
 void ms_speech_telemetry_handle_response_message(ms_speech_connection_t connection, ms_speech_parsed_message_t *parsed_message)
 {
-	json_object *path_object = NULL;
-	if (!json_object_object_get_ex(connection->telemetry->received_messages,
-								   parsed_message->path,
-								   &path_object)) {
-		path_object = json_object_new_array();
-		json_object_object_add(connection->telemetry->received_messages,
-							   parsed_message->path,
-							   path_object);
+	ms_speech_telemetry_t *telemetry = connection->telemetry;
+	ms_speech_telemetry_path_t *entry = ms_speech_telemetry_get_path(telemetry, parsed_message->path);
+	if (!entry || entry->count >= telemetry->max_entries) {
+		ms_speech_telemetry_drop(connection);
+		return;
 	}
-	
-	char buffer[32];
-	ms_speech_get_timestamp(buffer, sizeof(buffer));
-	json_object *timestamp_json = json_object_new_string(buffer);
-	json_object_array_add(path_object,
-						  timestamp_json);
+
+	if (entry->count == entry->capacity) {
+		int capacity = entry->capacity ? entry->capacity * 2 : MS_SPEECH_TELEMETRY_INITIAL_ENTRIES;
+		if (capacity > telemetry->max_entries)
+			capacity = telemetry->max_entries;
+		if (ms_speech_memory_reserve(connection, (capacity - entry->capacity) * sizeof(uint64_t))) {
+			ms_speech_telemetry_drop(connection);
+			return;
+		}
+		uint64_t *timestamps = (uint64_t *)realloc(entry->timestamps, capacity * sizeof(uint64_t));
+		if (!timestamps) {
+			ms_speech_telemetry_drop(connection);
+			return;
+		}
+		entry->timestamps = timestamps;
+		entry->capacity = capacity;
+	}
+
+	entry->timestamps[entry->count++] = ms_speech_context_get_epoch_us(connection->context);
 }
 
 void ms_speech_telemetry_handle_stream_start_request(ms_speech_connection_t connection)
 {
-	char buffer[32];
-	ms_speech_get_timestamp(buffer, sizeof(buffer));
-	json_object *timestamp_json = json_object_new_string(buffer);
-	json_object_object_add(connection->telemetry->microphone,
-						   MS_SPEECH_TELEMETRY_KEY_START_TIME,
-						   timestamp_json);
+	connection->telemetry->microphone_start = ms_speech_context_get_epoch_us(connection->context);
 }
 
 void ms_speech_telemetry_handle_stream_stop_request(ms_speech_connection_t connection, int user_error)
+{
+	connection->telemetry->microphone_end = ms_speech_context_get_epoch_us(connection->context);
+	connection->telemetry->microphone_error = user_error;
+}
+
+static void ms_speech_telemetry_write_timestamp(ms_speech_json_writer_t writer, uint64_t epoch_us)
 {
 	char buffer[32];
-	ms_speech_get_timestamp(buffer, sizeof(buffer));
-	json_object *timestamp_json = json_object_new_string(buffer);
-	json_object_object_add(connection->telemetry->microphone,
-						   MS_SPEECH_TELEMETRY_KEY_END_TIME,
-						   timestamp_json);
-	if (user_error) {
-		json_object *error_json = json_object_new_string(strerror(user_error));
-		json_object_object_add(connection->telemetry->microphone,
-							   MS_SPEECH_TELEMETRY_KEY_ERROR,
-							   error_json);
-	} else if (json_object_object_get_ex(connection->telemetry->microphone,
-										 MS_SPEECH_TELEMETRY_KEY_ERROR,
-										 NULL)) {
-		json_object_object_del(connection->telemetry->microphone,
-							   MS_SPEECH_TELEMETRY_KEY_ERROR);
-	}
+	ms_speech_format_timestamp(epoch_us, buffer, sizeof(buffer));
+	ms_speech_json_string(writer, buffer);
 }
 
 int ms_speech_telemetry_set_message(ms_speech_connection_t connection, ms_speech_message *message)
 {
+	ms_speech_telemetry_t *telemetry = connection->telemetry;
+
 	message->path = MS_SPEECH_MESSAGE_PATH_TELEMETRY;
 	message->binary = 0;
 	message->content_type = MS_SPEECH_MESSAGE_CONTENT_TYPE_JSON;
 	
-	json_object *telemetry_json = json_object_new_object();
-	json_object_object_add(telemetry_json,
-						   MS_SPEECH_TELEMETRY_KEY_RECEIVED_MESSAGE,
-						   connection->telemetry->received_messages);
-	json_object *metrics_array = json_object_new_array();
-	json_object_array_add(metrics_array,
-						  connection->telemetry->microphone);
-	json_object_object_add(telemetry_json,
-						   MS_SPEECH_TELEMETRY_KEY_METRICS,
-						   metrics_array);
-	const char * json_string = json_object_to_json_string_ext(telemetry_json, JSON_C_TO_STRING_PLAIN);
-	ms_speech_set_message_body(message,
-							   (const unsigned char *)json_string,
-							   strlen(json_string));
+	if (telemetry->dropped) {
+		ms_speech_connection_log(connection,
+								 MS_SPEECH_LOG_INFO,
+								 "Telemetry dropped %lu received messages",
+								 telemetry->dropped);
+	}
+
+	// sized so that the body is written without growing
+	size_t size_hint = MS_SPEECH_TELEMETRY_FIXED_SIZE;
+	for (int i=0; i<telemetry->num_paths; i++)
+		size_hint += MS_SPEECH_TELEMETRY_PATH_SIZE + 4 + telemetry->paths[i].count * MS_SPEECH_TELEMETRY_TIMESTAMP_SIZE;
+
+	struct ms_speech_json_writer_st writer;
+	ms_speech_begin_message_json(message, &writer, size_hint);
+	ms_speech_json_begin_object(&writer);
+
+	ms_speech_json_key(&writer, MS_SPEECH_TELEMETRY_KEY_RECEIVED_MESSAGE);
+	ms_speech_json_begin_object(&writer);
+	for (int i=0; i<telemetry->num_paths; i++) {
+		ms_speech_telemetry_path_t *entry = &telemetry->paths[i];
+		if (!entry->count)
+			continue;
+
+		ms_speech_json_key(&writer, entry->path);
+		ms_speech_json_begin_array(&writer);
+		for (int t=0; t<entry->count; t++)
+			ms_speech_telemetry_write_timestamp(&writer, entry->timestamps[t]);
+		ms_speech_json_end_array(&writer);
+	}
+	ms_speech_json_end_object(&writer);
+
+	ms_speech_json_key(&writer, MS_SPEECH_TELEMETRY_KEY_METRICS);
+	ms_speech_json_begin_array(&writer);
+	ms_speech_json_begin_object(&writer);
+	ms_speech_json_key(&writer, MS_SPEECH_TELEMETRY_KEY_METRIC_NAME);
+	ms_speech_json_string(&writer, MS_SPEECH_TELEMETRY_KEY_MICROPHONE);
+	if (telemetry->microphone_start) {
+		ms_speech_json_key(&writer, MS_SPEECH_TELEMETRY_KEY_START_TIME);
+		ms_speech_telemetry_write_timestamp(&writer, telemetry->microphone_start);
+	}
+	if (telemetry->microphone_end) {
+		ms_speech_json_key(&writer, MS_SPEECH_TELEMETRY_KEY_END_TIME);
+		ms_speech_telemetry_write_timestamp(&writer, telemetry->microphone_end);
+	}
+	if (telemetry->microphone_error) {
+		ms_speech_json_key(&writer, MS_SPEECH_TELEMETRY_KEY_ERROR);
+		ms_speech_json_string(&writer, strerror(telemetry->microphone_error));
+	}
+	ms_speech_json_end_object(&writer);
+	ms_speech_json_end_array(&writer);
+
+	ms_speech_json_end_object(&writer);
 	
-	return 0;
+	return ms_speech_end_message_json(message, &writer);
 }
-
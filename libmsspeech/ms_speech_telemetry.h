@@ -18,15 +18,42 @@ all copies or substantial portions of the Software.
 #define ms_speech_telemetry_h
 
 #include <stdio.h>
+#include <stdint.h>
+
 #include "ms_speech_priv.h"
 
+#define MS_SPEECH_TELEMETRY_MAX_PATHS 12
+#define MS_SPEECH_TELEMETRY_PATH_SIZE 32
+#define MS_SPEECH_TELEMETRY_DEFAULT_MAX_ENTRIES 256
+#define MS_SPEECH_TELEMETRY_INITIAL_ENTRIES 8
+// serialized sizes used to size the telemetry message up front
+#define MS_SPEECH_TELEMETRY_TIMESTAMP_SIZE 32
+#define MS_SPEECH_TELEMETRY_FIXED_SIZE 256
+
+typedef struct {
+	char path[MS_SPEECH_TELEMETRY_PATH_SIZE];
+	// receive times in epoch microseconds, capacity grows up to the cap
+	// and is kept across turns
+	uint64_t *timestamps;
+	int count;
+	int capacity;
+} ms_speech_telemetry_path_t;
+
 struct ms_speech_telemetry_st {
-	json_object *received_messages;
-	json_object *microphone;
+	ms_speech_telemetry_path_t paths[MS_SPEECH_TELEMETRY_MAX_PATHS];
+	int num_paths;
+	int max_entries;
+	// received messages not recorded this turn
+	unsigned long dropped;
+
+	uint64_t microphone_start;
+	uint64_t microphone_end;
+	int microphone_error;
 };
 
-void ms_speech_telemetry_initialize(ms_speech_connection_t connection);
+int ms_speech_telemetry_initialize(ms_speech_connection_t connection);
 void ms_speech_telemetry_destroy(ms_speech_connection_t connection);
+void ms_speech_telemetry_reset(ms_speech_connection_t connection);
 void ms_speech_telemetry_handle_response_message(ms_speech_connection_t connection, ms_speech_parsed_message_t *parsed_message);
 void ms_speech_telemetry_handle_stream_start_request(ms_speech_connection_t connection);
 void ms_speech_telemetry_handle_stream_stop_request(ms_speech_connection_t connection, int user_error);
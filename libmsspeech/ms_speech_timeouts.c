@@ -0,0 +1,146 @@
+/*
+
+Copyright 2017 technicianted
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+*/
+
+#include <errno.h>
+
+#include "compat.h"
+#include "ms_speech_timeouts.h"
+#include "ms_speech_logging_priv.h"
+#include "ms_speech_endpoint_set.h"
+
+static const char *ms_speech_timeout_names[] = {
+	"connect",
+	"speech.config",
+	"first result",
+	"result gap",
+	"total"
+};
+
+static void ms_speech_timeouts_expire(ms_speech_connection_t connection, ms_speech_timeout_t timeout)
+{
+	ms_speech_connection_log(connection,
+							 MS_SPEECH_LOG_WARN,
+							 "Timed out waiting for %s",
+							 ms_speech_timeout_names[timeout]);
+
+	// a hanging endpoint counts as failing, the total limit caps the request itself
+	if (timeout != MS_SPEECH_TIMEOUT_TOTAL)
+		ms_speech_endpoint_set_handle_error(connection);
+
+	ms_speech_timeouts_cancel(connection);
+	ms_speech_connection_abort(connection);
+
+	// applications without the timeout callback learn about it as an error
+	if (connection->callbacks->connection_timeout)
+		connection->callbacks->connection_timeout(connection, timeout, connection->callbacks->user_data);
+	else if (connection->callbacks->connection_error)
+		connection->callbacks->connection_error(connection, 0, "Timed out", connection->callbacks->user_data);
+}
+
+static void ms_speech_timeouts_connect_expired(void *data)
+{
+	ms_speech_timeouts_expire((ms_speech_connection_t)data, MS_SPEECH_TIMEOUT_CONNECT);
+}
+
+static void ms_speech_timeouts_speech_config_expired(void *data)
+{
+	ms_speech_timeouts_expire((ms_speech_connection_t)data, MS_SPEECH_TIMEOUT_SPEECH_CONFIG);
+}
+
+static void ms_speech_timeouts_result_expired(void *data)
+{
+	ms_speech_connection_t connection = (ms_speech_connection_t)data;
+	ms_speech_timeouts_expire(connection,
+							  connection->results_received ? MS_SPEECH_TIMEOUT_RESULT_GAP : MS_SPEECH_TIMEOUT_FIRST_RESULT);
+}
+
+static void ms_speech_timeouts_total_expired(void *data)
+{
+	ms_speech_timeouts_expire((ms_speech_connection_t)data, MS_SPEECH_TIMEOUT_TOTAL);
+}
+
+static void ms_speech_timeouts_arm(ms_speech_connection_t connection, ms_speech_timer_t *timer, int timeout_ms)
+{
+	if (timeout_ms > 0)
+		ms_speech_timer_arm(&connection->context->timers, timer, timeout_ms);
+}
+
+int ms_speech_set_timeouts(ms_speech_connection_t connection, const ms_speech_timeouts_t *timeouts)
+{
+	if (timeouts)
+		connection->timeouts = *timeouts;
+	else
+		memset(&connection->timeouts, 0, sizeof(ms_speech_timeouts_t));
+
+	// a pending connect is held to the new limit from now on
+	ms_speech_timer_cancel(&connection->context->timers, &connection->connect_timer);
+	if (connection->connection_status == MS_SPEECH_CLIENT_CONNECTING)
+		ms_speech_timeouts_arm(connection, &connection->connect_timer, connection->timeouts.connect_ms);
+
+	return 0;
+}
+
+void ms_speech_timeouts_initialize(ms_speech_connection_t connection)
+{
+	connection->timeouts = connection->context->timeouts;
+	ms_speech_timer_initialize(&connection->connect_timer, &ms_speech_timeouts_connect_expired, connection);
+	ms_speech_timer_initialize(&connection->speech_config_timer, &ms_speech_timeouts_speech_config_expired, connection);
+	ms_speech_timer_initialize(&connection->result_timer, &ms_speech_timeouts_result_expired, connection);
+	ms_speech_timer_initialize(&connection->total_timer, &ms_speech_timeouts_total_expired, connection);
+}
+
+void ms_speech_timeouts_handle_connecting(ms_speech_connection_t connection)
+{
+	ms_speech_timeouts_arm(connection, &connection->connect_timer, connection->timeouts.connect_ms);
+}
+
+void ms_speech_timeouts_handle_connected(ms_speech_connection_t connection)
+{
+	ms_speech_timer_cancel(&connection->context->timers, &connection->connect_timer);
+}
+
+void ms_speech_timeouts_handle_request(ms_speech_connection_t connection)
+{
+	connection->results_received = 0;
+	ms_speech_timeouts_arm(connection, &connection->speech_config_timer, connection->timeouts.speech_config_ms);
+	ms_speech_timeouts_arm(connection, &connection->result_timer, connection->timeouts.first_result_ms);
+	ms_speech_timeouts_arm(connection, &connection->total_timer, connection->timeouts.total_ms);
+}
+
+void ms_speech_timeouts_handle_turn_start(ms_speech_connection_t connection)
+{
+	ms_speech_timer_cancel(&connection->context->timers, &connection->speech_config_timer);
+}
+
+void ms_speech_timeouts_handle_result(ms_speech_connection_t connection)
+{
+	connection->results_received++;
+	ms_speech_timer_cancel(&connection->context->timers, &connection->result_timer);
+	ms_speech_timeouts_arm(connection, &connection->result_timer, connection->timeouts.result_gap_ms);
+}
+
+void ms_speech_timeouts_handle_turn_end(ms_speech_connection_t connection)
+{
+	ms_speech_timer_cancel(&connection->context->timers, &connection->speech_config_timer);
+	ms_speech_timer_cancel(&connection->context->timers, &connection->result_timer);
+	ms_speech_timer_cancel(&connection->context->timers, &connection->total_timer);
+}
+
+void ms_speech_timeouts_cancel(ms_speech_connection_t connection)
+{
+	ms_speech_timer_cancel(&connection->context->timers, &connection->connect_timer);
+	ms_speech_timeouts_handle_turn_end(connection);
+}
@@ -0,0 +1,31 @@
+/*
+
+Copyright 2017 technicianted
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+*/
+
+#ifndef ms_speech_timeouts_h
+#define ms_speech_timeouts_h
+
+#include "ms_speech_priv.h"
+
+void ms_speech_timeouts_initialize(ms_speech_connection_t connection);
+void ms_speech_timeouts_handle_connecting(ms_speech_connection_t connection);
+void ms_speech_timeouts_handle_connected(ms_speech_connection_t connection);
+void ms_speech_timeouts_handle_request(ms_speech_connection_t connection);
+void ms_speech_timeouts_handle_turn_start(ms_speech_connection_t connection);
+void ms_speech_timeouts_handle_result(ms_speech_connection_t connection);
+void ms_speech_timeouts_handle_turn_end(ms_speech_connection_t connection);
+void ms_speech_timeouts_cancel(ms_speech_connection_t connection);
+
+#endif /* ms_speech_timeouts_h */
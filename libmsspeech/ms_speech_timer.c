@@ -0,0 +1,109 @@
+/*
+
+Copyright 2017 technicianted
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+*/
+
+#include <string.h>
+
+#include "ms_speech_timer.h"
+#include "ms_speech_timestamp.h"
+
+static void ms_speech_timer_link(ms_speech_timer_t **head, ms_speech_timer_t *timer)
+{
+	timer->next = *head;
+	if (timer->next)
+		timer->next->pprev = &timer->next;
+	timer->pprev = head;
+	*head = timer;
+}
+
+static void ms_speech_timer_unlink(ms_speech_timer_t *timer)
+{
+	*timer->pprev = timer->next;
+	if (timer->next)
+		timer->next->pprev = timer->pprev;
+	timer->pprev = NULL;
+	timer->next = NULL;
+}
+
+void ms_speech_timer_wheel_initialize(ms_speech_timer_wheel_t *wheel)
+{
+	memset(wheel, 0, sizeof(ms_speech_timer_wheel_t));
+	wheel->current_tick = ms_speech_get_monotonic_ms() / MS_SPEECH_TIMER_TICK_MS;
+}
+
+void ms_speech_timer_initialize(ms_speech_timer_t *timer, ms_speech_timer_callback callback, void *data)
+{
+	memset(timer, 0, sizeof(ms_speech_timer_t));
+	timer->callback = callback;
+	timer->data = data;
+}
+
+void ms_speech_timer_arm(ms_speech_timer_wheel_t *wheel, ms_speech_timer_t *timer, int delay_ms)
+{
+	ms_speech_timer_cancel(wheel, timer);
+
+	timer->expires = ms_speech_get_monotonic_ms() + (delay_ms > 0 ? delay_ms : 0);
+	uint64_t tick = (timer->expires + MS_SPEECH_TIMER_TICK_MS - 1) / MS_SPEECH_TIMER_TICK_MS;
+	if (tick < wheel->current_tick)
+		tick = wheel->current_tick;
+
+	ms_speech_timer_link(&wheel->slots[tick % MS_SPEECH_TIMER_SLOTS], timer);
+	wheel->count++;
+}
+
+void ms_speech_timer_cancel(ms_speech_timer_wheel_t *wheel, ms_speech_timer_t *timer)
+{
+	if (!timer->pprev)
+		return;
+
+	ms_speech_timer_unlink(timer);
+	wheel->count--;
+}
+
+void ms_speech_timer_wheel_service(ms_speech_timer_wheel_t *wheel)
+{
+	uint64_t now = ms_speech_get_monotonic_ms();
+	uint64_t now_tick = now / MS_SPEECH_TIMER_TICK_MS;
+
+	if (!wheel->count) {
+		wheel->current_tick = now_tick + 1;
+		return;
+	}
+
+	// after a long stall every slot only needs a single visit
+	if (now_tick >= wheel->current_tick + MS_SPEECH_TIMER_SLOTS)
+		wheel->current_tick = now_tick - MS_SPEECH_TIMER_SLOTS + 1;
+
+	ms_speech_timer_t *expired = NULL;
+	for (; wheel->current_tick <= now_tick; wheel->current_tick++) {
+		ms_speech_timer_t *timer = wheel->slots[wheel->current_tick % MS_SPEECH_TIMER_SLOTS];
+		while (timer) {
+			ms_speech_timer_t *next = timer->next;
+			if (timer->expires <= now) {
+				ms_speech_timer_unlink(timer);
+				ms_speech_timer_link(&expired, timer);
+			}
+			timer = next;
+		}
+	}
+
+	// expired timers stay cancelable while earlier callbacks run
+	while (expired) {
+		ms_speech_timer_t *timer = expired;
+		ms_speech_timer_unlink(timer);
+		wheel->count--;
+		timer->callback(timer->data);
+	}
+}
@@ -0,0 +1,50 @@
+/*
+
+Copyright 2017 technicianted
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+*/
+
+#ifndef ms_speech_timer_h
+#define ms_speech_timer_h
+
+#include <stdint.h>
+
+#define MS_SPEECH_TIMER_TICK_MS 10
+#define MS_SPEECH_TIMER_SLOTS 256
+
+typedef void (*ms_speech_timer_callback)(void *data);
+
+typedef struct ms_speech_timer_st {
+	uint64_t expires;
+	ms_speech_timer_callback callback;
+	void *data;
+
+	// NULL while not armed
+	struct ms_speech_timer_st **pprev;
+	struct ms_speech_timer_st *next;
+} ms_speech_timer_t;
+
+// hashed timer wheel, timers beyond one revolution wait in their slot
+typedef struct {
+	ms_speech_timer_t *slots[MS_SPEECH_TIMER_SLOTS];
+	uint64_t current_tick;
+	int count;
+} ms_speech_timer_wheel_t;
+
+void ms_speech_timer_wheel_initialize(ms_speech_timer_wheel_t *wheel);
+void ms_speech_timer_wheel_service(ms_speech_timer_wheel_t *wheel);
+void ms_speech_timer_initialize(ms_speech_timer_t *timer, ms_speech_timer_callback callback, void *data);
+void ms_speech_timer_arm(ms_speech_timer_wheel_t *wheel, ms_speech_timer_t *timer, int delay_ms);
+void ms_speech_timer_cancel(ms_speech_timer_wheel_t *wheel, ms_speech_timer_t *timer);
+
+#endif /* ms_speech_timer_h */
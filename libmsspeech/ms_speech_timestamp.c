@@ -17,22 +17,82 @@ all copies or substantial portions of the Software.
 #include <sys/time.h>
 #include <time.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "ms_speech_timestamp.h"
 
+// date and time up to the seconds, rendered again only when they change
+typedef struct {
+	time_t epoch_s;
+	int valid;
+	char prefix[MS_SPEECH_TIMESTAMP_PREFIX_SIZE];
+	int prefix_length;
+} ms_speech_timestamp_cache_t;
+
+static __thread ms_speech_timestamp_cache_t timestamp_cache;
+
 int ms_speech_get_timestamp(char *buffer, size_t len)
+{
+	return ms_speech_format_timestamp(ms_speech_get_epoch_us(), buffer, len);
+}
+
+int ms_speech_format_timestamp(uint64_t epoch_us, char *buffer, size_t len)
+{
+	ms_speech_timestamp_cache_t *cache = &timestamp_cache;
+	time_t epoch_s = (time_t)(epoch_us / 1000000);
+
+	if (!cache->valid || cache->epoch_s != epoch_s) {
+		struct tm info;
+		gmtime_r(&epoch_s, &info);
+		cache->prefix_length = snprintf(cache->prefix, sizeof(cache->prefix), "%04d-%02d-%02dT%02d:%02d:%02d.",
+										info.tm_year + 1900,
+										info.tm_mon + 1,
+										info.tm_mday,
+										info.tm_hour,
+										info.tm_min,
+										info.tm_sec);
+		cache->epoch_s = epoch_s;
+		cache->valid = 1;
+	}
+
+	// seven fraction digits, the last one is always zero at microsecond resolution
+	int length = cache->prefix_length + 7;
+	if (len < (size_t)length + 1) {
+		if (len)
+			buffer[0] = '\0';
+		return length;
+	}
+
+	memcpy(buffer, cache->prefix, cache->prefix_length);
+	char *p = buffer + cache->prefix_length;
+	unsigned int fraction = (unsigned int)(epoch_us % 1000000);
+	for (int i=5; i>=0; i--) {
+		p[i] = '0' + fraction % 10;
+		fraction /= 10;
+	}
+	p[6] = '0';
+	p[7] = '\0';
+
+	return length;
+}
+
+uint64_t ms_speech_get_epoch_us()
 {
 	struct timeval tv;
-	struct tm info;
-	
 	gettimeofday(&tv, NULL);
-	gmtime_r(&tv.tv_sec, &info);
-	double seconds = (double)info.tm_sec + tv.tv_usec / 1000000.0;
-	return snprintf(buffer, len, "%04d-%02d-%02dT%02d:%02d:%0.7f",
-					info.tm_year + 1900,
-					info.tm_mon + 1,
-					info.tm_mday,
-					info.tm_hour,
-					info.tm_min,
-					seconds);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+uint64_t ms_speech_get_monotonic_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t ms_speech_get_monotonic_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
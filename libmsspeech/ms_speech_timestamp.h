@@ -17,6 +17,16 @@ all copies or substantial portions of the Software.
 #ifndef ms_speech_timestamp_h
 #define ms_speech_timestamp_h
 
+#include <stdint.h>
+#include <stddef.h>
+
+// "YYYY-MM-DDTHH:MM:SS." with room for years past 9999
+#define MS_SPEECH_TIMESTAMP_PREFIX_SIZE 32
+
 int ms_speech_get_timestamp(char *buffer, size_t len);
+int ms_speech_format_timestamp(uint64_t epoch_us, char *buffer, size_t len);
+uint64_t ms_speech_get_epoch_us();
+uint64_t ms_speech_get_monotonic_ms();
+uint64_t ms_speech_get_monotonic_us();
 
 #endif /* ms_speech_timestamp_h */
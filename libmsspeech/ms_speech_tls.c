@@ -0,0 +1,337 @@
+/*
+
+Copyright 2017 technicianted
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+*/
+
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "ms_speech_tls.h"
+#include "ms_speech_logging_priv.h"
+#include "ms_speech_timestamp.h"
+
+#if defined(LWS_OPENSSL_SUPPORT) && !defined(LWS_WITH_MBEDTLS)
+#define MS_SPEECH_TLS_SESSION_CACHE
+#include <openssl/ssl.h>
+#endif
+
+void ms_speech_context_get_tls_stats(ms_speech_context_t context, ms_speech_tls_stats_t *stats)
+{
+	memset(stats, 0, sizeof(ms_speech_tls_stats_t));
+	if (!context->tls_cache)
+		return;
+
+	stats->full_handshakes = context->tls_cache->full_handshakes;
+	stats->resumed_handshakes = context->tls_cache->resumed_handshakes;
+	for (int i=0; i<MS_SPEECH_TLS_CACHE_SIZE; i++) {
+		if (context->tls_cache->entries[i].session)
+			stats->cached_sessions++;
+	}
+}
+
+#ifdef MS_SPEECH_TLS_SESSION_CACHE
+
+static int ms_speech_tls_ctx_index = -1;
+static int ms_speech_tls_ssl_index = -1;
+static pthread_once_t ms_speech_tls_once = PTHREAD_ONCE_INIT;
+
+static void ms_speech_tls_free_info(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int index, long argl, void *argp)
+{
+	free(ptr);
+}
+
+static void ms_speech_tls_new_ssl(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int index, long argl, void *argp);
+
+static void ms_speech_tls_init_index()
+{
+	ms_speech_tls_ctx_index = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+	ms_speech_tls_ssl_index = SSL_get_ex_new_index(0, NULL, &ms_speech_tls_new_ssl, NULL, &ms_speech_tls_free_info);
+}
+
+int ms_speech_tls_get_handshake_times(struct lws *wsi, uint64_t *start_us, uint64_t *done_us)
+{
+	SSL *ssl = lws_get_ssl(wsi);
+	if (!ssl || ms_speech_tls_ssl_index < 0)
+		return -1;
+
+	ms_speech_tls_ssl_info_t *info = (ms_speech_tls_ssl_info_t *)SSL_get_ex_data(ssl, ms_speech_tls_ssl_index);
+	if (!info || !info->handshake_done_us)
+		return -1;
+
+	*start_us = info->handshake_start_us;
+	*done_us = info->handshake_done_us;
+	return 0;
+}
+
+static ms_speech_context_t ms_speech_tls_get_context(SSL *ssl)
+{
+	return (ms_speech_context_t)SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), ms_speech_tls_ctx_index);
+}
+
+static int ms_speech_tls_get_key(SSL *ssl, char *key, size_t len)
+{
+	// SNI carries the endpoint host even when connecting to a resolved address
+	const char *host = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+	if (!host)
+		return -1;
+
+	int port = 0;
+	struct sockaddr_storage address;
+	socklen_t address_len = sizeof(address);
+	if (!getpeername(SSL_get_fd(ssl), (struct sockaddr *)&address, &address_len)) {
+		if (address.ss_family == AF_INET)
+			port = ntohs(((struct sockaddr_in *)&address)->sin_port);
+		else if (address.ss_family == AF_INET6)
+			port = ntohs(((struct sockaddr_in6 *)&address)->sin6_port);
+	}
+
+	int r = snprintf(key, len, "%s:%d", host, port);
+	return (r < 0 || (size_t)r >= len) ? -1 : 0;
+}
+
+// the most recently cached session of key
+static ms_speech_tls_cache_entry_t *ms_speech_tls_lookup(struct ms_speech_tls_cache_st *cache, const char *key)
+{
+	ms_speech_tls_cache_entry_t *found = NULL;
+	for (int i=0; i<MS_SPEECH_TLS_CACHE_SIZE; i++) {
+		ms_speech_tls_cache_entry_t *entry = &cache->entries[i];
+		if (entry->session && !strcmp(entry->key, key) && (!found || entry->last_used > found->last_used))
+			found = entry;
+	}
+
+	return found;
+}
+
+// lws gives no callback between creating the client SSL and its handshake.
+// SSL_new runs this before the hostname is set, so the key comes from the
+// attempts in flight and resuming is skipped when they are to several keys.
+static void ms_speech_tls_new_ssl(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int index, long argl, void *argp)
+{
+	SSL *ssl = (SSL *)parent;
+	ms_speech_context_t context = ms_speech_tls_get_context(ssl);
+	if (!context || !context->tls_cache || SSL_is_server(ssl))
+		return;
+
+	struct ms_speech_tls_cache_st *cache = context->tls_cache;
+	if (!cache->num_attempts)
+		return;
+
+	const char *key = cache->attempts[0].key;
+	for (int i=1; i<cache->num_attempts; i++) {
+		if (strcmp(cache->attempts[i].key, key))
+			return;
+	}
+
+	// the session leaves the cache, a resumed handshake may consume it
+	ms_speech_tls_cache_entry_t *entry = ms_speech_tls_lookup(cache, key);
+	if (entry) {
+		SSL_set_session(ssl, (SSL_SESSION *)entry->session);
+		SSL_SESSION_free((SSL_SESSION *)entry->session);
+		entry->session = NULL;
+	}
+}
+
+static int ms_speech_tls_new_session(SSL *ssl, SSL_SESSION *session)
+{
+	ms_speech_context_t context = ms_speech_tls_get_context(ssl);
+	char key[MS_SPEECH_TLS_CACHE_KEY_SIZE];
+	if (!context || !context->tls_cache || ms_speech_tls_get_key(ssl, key, sizeof(key)))
+		return 0;
+
+	struct ms_speech_tls_cache_st *cache = context->tls_cache;
+	// evict least recently used
+	ms_speech_tls_cache_entry_t *entry = &cache->entries[0];
+	for (int i=0; i<MS_SPEECH_TLS_CACHE_SIZE; i++) {
+		if (!cache->entries[i].session) {
+			entry = &cache->entries[i];
+			break;
+		}
+		if (cache->entries[i].last_used < entry->last_used)
+			entry = &cache->entries[i];
+	}
+
+	if (entry->session)
+		SSL_SESSION_free((SSL_SESSION *)entry->session);
+	strcpy(entry->key, key);
+	entry->session = session;
+	entry->last_used = ++cache->use_counter;
+
+	ms_speech_log(MS_SPEECH_LOG_DEBUG,
+				  "Cached TLS session for %s",
+				  key);
+
+	// we keep the reference
+	return 1;
+}
+
+static void ms_speech_tls_info_callback(const SSL *const_ssl, int where, int ret)
+{
+	SSL *ssl = (SSL *)const_ssl;
+	ms_speech_context_t context = ms_speech_tls_get_context(ssl);
+	if (!context || !context->tls_cache)
+		return;
+
+	struct ms_speech_tls_cache_st *cache = context->tls_cache;
+	ms_speech_tls_ssl_info_t *info = (ms_speech_tls_ssl_info_t *)SSL_get_ex_data(ssl, ms_speech_tls_ssl_index);
+	if (where & SSL_CB_HANDSHAKE_START) {
+		if (SSL_is_server(ssl))
+			return;
+
+		if (!info) {
+			info = (ms_speech_tls_ssl_info_t *)calloc(1, sizeof(ms_speech_tls_ssl_info_t));
+			if (!info)
+				return;
+			info->handshake_start_us = ms_speech_get_monotonic_us();
+			SSL_set_ex_data(ssl, ms_speech_tls_ssl_index, info);
+		}
+	} else if (where & SSL_CB_HANDSHAKE_DONE) {
+		// post-handshake messages may signal done again, count once
+		if (!info || info->handshake_done_us)
+			return;
+		info->handshake_done_us = ms_speech_get_monotonic_us();
+
+		if (SSL_session_reused(ssl))
+			cache->resumed_handshakes++;
+		else
+			cache->full_handshakes++;
+	}
+}
+
+void ms_speech_tls_attach(ms_speech_context_t context, void *ssl_ctx)
+{
+	SSL_CTX *ctx = (SSL_CTX *)ssl_ctx;
+	pthread_once(&ms_speech_tls_once, &ms_speech_tls_init_index);
+
+	if (!context->tls_cache) {
+		context->tls_cache = (struct ms_speech_tls_cache_st *)malloc(sizeof(struct ms_speech_tls_cache_st));
+		memset(context->tls_cache, 0, sizeof(struct ms_speech_tls_cache_st));
+	}
+
+	SSL_CTX_set_ex_data(ctx, ms_speech_tls_ctx_index, context);
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ctx, &ms_speech_tls_new_session);
+	SSL_CTX_set_info_callback(ctx, &ms_speech_tls_info_callback);
+}
+
+void ms_speech_tls_begin_attempt(ms_speech_context_t context, const ms_speech_endpoint_t *endpoint)
+{
+	struct ms_speech_tls_cache_st *cache = context->tls_cache;
+	if (!cache || !endpoint->ssl_connection)
+		return;
+
+	if (cache->num_attempts == cache->max_attempts) {
+		int max_attempts = cache->max_attempts ? cache->max_attempts * 2 : 16;
+		ms_speech_tls_attempt_t *attempts = (ms_speech_tls_attempt_t *)realloc(cache->attempts, max_attempts * sizeof(ms_speech_tls_attempt_t));
+		if (!attempts)
+			return;
+		cache->attempts = attempts;
+		cache->max_attempts = max_attempts;
+	}
+
+	ms_speech_tls_attempt_t *attempt = &cache->attempts[cache->num_attempts];
+	int r = snprintf(attempt->key, sizeof(attempt->key), "%s:%d", endpoint->address, endpoint->port);
+	if (r < 0 || (size_t)r >= sizeof(attempt->key))
+		return;
+	attempt->wsi = NULL;
+	cache->num_attempts++;
+}
+
+static ms_speech_tls_attempt_t *ms_speech_tls_find_attempt(struct ms_speech_tls_cache_st *cache, struct lws *wsi)
+{
+	for (int i=0; i<cache->num_attempts; i++) {
+		if (cache->attempts[i].wsi == wsi)
+			return &cache->attempts[i];
+	}
+
+	return NULL;
+}
+
+static void ms_speech_tls_remove_attempt(struct ms_speech_tls_cache_st *cache, ms_speech_tls_attempt_t *attempt)
+{
+	*attempt = cache->attempts[--cache->num_attempts];
+}
+
+void ms_speech_tls_bind_attempt(ms_speech_context_t context, struct lws *wsi)
+{
+	struct ms_speech_tls_cache_st *cache = context->tls_cache;
+	if (!cache)
+		return;
+
+	// gone already when lws failed the attempt before returning
+	ms_speech_tls_attempt_t *attempt = ms_speech_tls_find_attempt(cache, NULL);
+	if (!attempt)
+		return;
+
+	if (wsi)
+		attempt->wsi = wsi;
+	else
+		ms_speech_tls_remove_attempt(cache, attempt);
+}
+
+void ms_speech_tls_end_attempt(ms_speech_context_t context, struct lws *wsi)
+{
+	struct ms_speech_tls_cache_st *cache = context->tls_cache;
+	if (!cache || !wsi)
+		return;
+
+	ms_speech_tls_attempt_t *attempt = ms_speech_tls_find_attempt(cache, wsi);
+	if (!attempt)
+		attempt = ms_speech_tls_find_attempt(cache, NULL);
+	if (attempt)
+		ms_speech_tls_remove_attempt(cache, attempt);
+}
+
+void ms_speech_tls_destroy(ms_speech_context_t context)
+{
+	if (!context->tls_cache)
+		return;
+
+	for (int i=0; i<MS_SPEECH_TLS_CACHE_SIZE; i++) {
+		if (context->tls_cache->entries[i].session)
+			SSL_SESSION_free((SSL_SESSION *)context->tls_cache->entries[i].session);
+	}
+	free(context->tls_cache->attempts);
+	free(context->tls_cache);
+	context->tls_cache = NULL;
+}
+
+#else
+
+int ms_speech_tls_get_handshake_times(struct lws *wsi, uint64_t *start_us, uint64_t *done_us)
+{
+	return -1;
+}
+
+void ms_speech_tls_attach(ms_speech_context_t context, void *ssl_ctx)
+{
+}
+
+void ms_speech_tls_begin_attempt(ms_speech_context_t context, const ms_speech_endpoint_t *endpoint)
+{
+}
+
+void ms_speech_tls_bind_attempt(ms_speech_context_t context, struct lws *wsi)
+{
+}
+
+void ms_speech_tls_end_attempt(ms_speech_context_t context, struct lws *wsi)
+{
+}
+
+void ms_speech_tls_destroy(ms_speech_context_t context)
+{
+}
+
+#endif
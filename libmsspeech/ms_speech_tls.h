@@ -0,0 +1,64 @@
+/*
+
+Copyright 2017 technicianted
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+*/
+
+#ifndef ms_speech_tls_h
+#define ms_speech_tls_h
+
+#include <stdint.h>
+
+#include "ms_speech_priv.h"
+
+#define MS_SPEECH_TLS_CACHE_SIZE 32
+#define MS_SPEECH_TLS_CACHE_KEY_SIZE 272
+
+typedef struct {
+	char key[MS_SPEECH_TLS_CACHE_KEY_SIZE];
+	void *session;
+	unsigned long last_used;
+} ms_speech_tls_cache_entry_t;
+
+// a TLS connect attempt, wsi is NULL while lws_client_connect_via_info runs
+typedef struct {
+	struct lws *wsi;
+	char key[MS_SPEECH_TLS_CACHE_KEY_SIZE];
+} ms_speech_tls_attempt_t;
+
+struct ms_speech_tls_cache_st {
+	// a key may have several sessions, each is handed to a single connection
+	ms_speech_tls_cache_entry_t entries[MS_SPEECH_TLS_CACHE_SIZE];
+	unsigned long use_counter;
+
+	ms_speech_tls_attempt_t *attempts;
+	int num_attempts;
+	int max_attempts;
+
+	unsigned long full_handshakes;
+	unsigned long resumed_handshakes;
+};
+
+typedef struct {
+	uint64_t handshake_start_us;
+	uint64_t handshake_done_us;
+} ms_speech_tls_ssl_info_t;
+
+int ms_speech_tls_get_handshake_times(struct lws *wsi, uint64_t *start_us, uint64_t *done_us);
+void ms_speech_tls_attach(ms_speech_context_t context, void *ssl_ctx);
+void ms_speech_tls_begin_attempt(ms_speech_context_t context, const ms_speech_endpoint_t *endpoint);
+void ms_speech_tls_bind_attempt(ms_speech_context_t context, struct lws *wsi);
+void ms_speech_tls_end_attempt(ms_speech_context_t context, struct lws *wsi);
+void ms_speech_tls_destroy(ms_speech_context_t context);
+
+#endif /* ms_speech_tls_h */
@@ -0,0 +1,236 @@
+/*
+
+Copyright 2017 technicianted
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+*/
+#include <errno.h>
+#include <time.h>
+
+#include "compat.h"
+#include "ms_speech_token.h"
+#include "ms_speech_logging_priv.h"
+#include "ms_speech_timestamp.h"
+
+static void *ms_speech_token_thread(void *arg);
+
+int ms_speech_context_set_token_provider(ms_speech_context_t context, ms_speech_token_fetch_callback fetch, int refresh_ahead_ms, void *user_data)
+{
+	if (!fetch)
+		return -EINVAL;
+	if (context->token_provider)
+		return -EBUSY;
+
+	struct ms_speech_token_provider_st *provider = (struct ms_speech_token_provider_st *)malloc(sizeof(struct ms_speech_token_provider_st));
+	memset(provider, 0, sizeof(struct ms_speech_token_provider_st));
+	provider->context = context;
+	provider->fetch = fetch;
+	provider->user_data = user_data;
+	provider->refresh_ahead_ms = refresh_ahead_ms > 0 ? refresh_ahead_ms : MS_SPEECH_TOKEN_DEFAULT_REFRESH_AHEAD_MS;
+
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&provider->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_mutex_init(&provider->lock, NULL);
+
+	if (pthread_create(&provider->thread, NULL, &ms_speech_token_thread, provider)) {
+		ms_speech_log(MS_SPEECH_LOG_ERR,
+					  "Unable to start token refresh thread");
+		pthread_cond_destroy(&provider->cond);
+		pthread_mutex_destroy(&provider->lock);
+		free(provider);
+		return -EAGAIN;
+	}
+
+	context->token_provider = provider;
+
+	return 0;
+}
+
+void ms_speech_token_destroy(ms_speech_context_t context)
+{
+	struct ms_speech_token_provider_st *provider = context->token_provider;
+	if (!provider)
+		return;
+
+	// an ongoing fetch is waited for
+	pthread_mutex_lock(&provider->lock);
+	provider->stopping = 1;
+	pthread_cond_signal(&provider->cond);
+	pthread_mutex_unlock(&provider->lock);
+	pthread_join(provider->thread, NULL);
+
+	free(provider->current);
+	free(provider->fetched);
+	pthread_cond_destroy(&provider->cond);
+	pthread_mutex_destroy(&provider->lock);
+	free(provider);
+	context->token_provider = NULL;
+}
+
+const char *ms_speech_token_get_header(ms_speech_context_t context, int *expired)
+{
+	struct ms_speech_token_provider_st *provider = context->token_provider;
+	if (!provider)
+		return NULL;
+
+	ms_speech_token_t *fetched = __atomic_exchange_n(&provider->fetched, NULL, __ATOMIC_ACQUIRE);
+	if (fetched) {
+		free(provider->current);
+		provider->current = fetched;
+	}
+	if (!provider->current)
+		return NULL;
+
+	if (expired)
+		*expired = ms_speech_get_monotonic_ms() >= provider->current->expires_at;
+	return provider->current->header;
+}
+
+int ms_speech_token_wait(ms_speech_connection_t connection)
+{
+	struct ms_speech_token_provider_st *provider = connection->context->token_provider;
+	if (!provider || connection->callbacks->provide_authentication_header)
+		return 0;
+	// an expired token is certain to be rejected, wait for its refresh instead
+	int expired = 0;
+	if (ms_speech_token_get_header(connection->context, &expired) && !expired)
+		return 0;
+
+	ms_speech_connection_log(connection,
+							 MS_SPEECH_LOG_DEBUG,
+							 "Waiting for a valid authentication token");
+	connection->token_next = provider->waiting;
+	provider->waiting = connection;
+	connection->token_waiting = 1;
+
+	return 1;
+}
+
+static int ms_speech_token_unlink(ms_speech_connection_t *p, ms_speech_connection_t connection)
+{
+	while (*p && *p != connection)
+		p = &(*p)->token_next;
+	if (!*p)
+		return 0;
+
+	*p = connection->token_next;
+	return 1;
+}
+
+void ms_speech_token_cancel(ms_speech_connection_t connection)
+{
+	if (!connection->token_waiting)
+		return;
+
+	struct ms_speech_token_provider_st *provider = connection->context->token_provider;
+	if (!ms_speech_token_unlink(&provider->waiting, connection))
+		ms_speech_token_unlink(&provider->resuming, connection);
+	connection->token_next = NULL;
+	connection->token_waiting = 0;
+}
+
+void ms_speech_token_service(ms_speech_context_t context)
+{
+	struct ms_speech_token_provider_st *provider = context->token_provider;
+	if (!provider)
+		return;
+
+	int expired = 0;
+	const char *header = ms_speech_token_get_header(context, &expired);
+	if (expired)
+		header = NULL;
+	unsigned long failures = __atomic_load_n(&provider->failures, __ATOMIC_ACQUIRE);
+	int failed = failures != provider->failures_seen;
+	provider->failures_seen = failures;
+	if (failed)
+		ms_speech_log(header ? MS_SPEECH_LOG_WARN : MS_SPEECH_LOG_ERR,
+					  "Unable to fetch authentication token");
+
+	// waiting connections fail once a fetch has failed without a valid token
+	if (!provider->waiting || (!header && !failed))
+		return;
+
+	// callbacks below may connect again, those wait for the next round
+	provider->resuming = provider->waiting;
+	provider->waiting = NULL;
+	while (provider->resuming) {
+		ms_speech_connection_t connection = provider->resuming;
+		provider->resuming = connection->token_next;
+		connection->token_next = NULL;
+		connection->token_waiting = 0;
+
+		if (header && !ms_speech_connection_open(connection))
+			continue;
+		ms_speech_handle_connection_error(connection,
+										  0,
+										  header ? "Unable to connect" : "Unable to fetch authentication token");
+	}
+}
+
+static void *ms_speech_token_thread(void *arg)
+{
+	struct ms_speech_token_provider_st *provider = (struct ms_speech_token_provider_st *)arg;
+	int retry_ms = MS_SPEECH_TOKEN_MIN_RETRY_MS;
+
+	pthread_mutex_lock(&provider->lock);
+	while (!provider->stopping) {
+		pthread_mutex_unlock(&provider->lock);
+
+		ms_speech_token_t *token = (ms_speech_token_t *)malloc(sizeof(ms_speech_token_t));
+		token->header[0] = '\0';
+		int expires_in_ms = 0;
+		int r = provider->fetch(token->header, sizeof(token->header), &expires_in_ms, provider->user_data);
+		token->header[sizeof(token->header) - 1] = '\0';
+
+		int wait_ms;
+		if (!r && token->header[0] && expires_in_ms > 0) {
+			token->expires_at = ms_speech_get_monotonic_ms() + expires_in_ms;
+			// a token the service thread has not picked up yet is superseded
+			free(__atomic_exchange_n(&provider->fetched, token, __ATOMIC_ACQ_REL));
+			retry_ms = MS_SPEECH_TOKEN_MIN_RETRY_MS;
+
+			// short lived tokens are refreshed halfway through
+			wait_ms = expires_in_ms - provider->refresh_ahead_ms;
+			if (wait_ms < expires_in_ms / 2)
+				wait_ms = expires_in_ms / 2;
+		} else {
+			free(token);
+			__atomic_add_fetch(&provider->failures, 1, __ATOMIC_RELEASE);
+			wait_ms = retry_ms;
+			retry_ms *= 2;
+			if (retry_ms > MS_SPEECH_TOKEN_MAX_RETRY_MS)
+				retry_ms = MS_SPEECH_TOKEN_MAX_RETRY_MS;
+		}
+
+		struct timespec deadline;
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += wait_ms / 1000;
+		deadline.tv_nsec += (long)(wait_ms % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+
+		pthread_mutex_lock(&provider->lock);
+		if (provider->stopping)
+			break;
+		lws_cancel_service(provider->context->context);
+		while (!provider->stopping && pthread_cond_timedwait(&provider->cond, &provider->lock, &deadline) != ETIMEDOUT)
+			;
+	}
+	pthread_mutex_unlock(&provider->lock);
+
+	return NULL;
+}
@@ -0,0 +1,64 @@
+/*
+
+Copyright 2017 technicianted
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+*/
+#ifndef ms_speech_token_h
+#define ms_speech_token_h
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "ms_speech_priv.h"
+
+#define MS_SPEECH_TOKEN_MAX_HEADER_SIZE 4096
+#define MS_SPEECH_TOKEN_DEFAULT_REFRESH_AHEAD_MS 60000
+#define MS_SPEECH_TOKEN_MIN_RETRY_MS 1000
+#define MS_SPEECH_TOKEN_MAX_RETRY_MS 30000
+
+// immutable once published
+typedef struct {
+	uint64_t expires_at;
+	char header[MS_SPEECH_TOKEN_MAX_HEADER_SIZE];
+} ms_speech_token_t;
+
+struct ms_speech_token_provider_st {
+	ms_speech_context_t context;
+	ms_speech_token_fetch_callback fetch;
+	void *user_data;
+	int refresh_ahead_ms;
+
+	// owned by the service thread
+	ms_speech_token_t *current;
+	ms_speech_connection_t waiting;
+	ms_speech_connection_t resuming;
+	unsigned long failures_seen;
+
+	// handed over by the refresh thread with atomic exchanges
+	ms_speech_token_t *fetched;
+	unsigned long failures;
+
+	// only used to sleep and stop the refresh thread
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	int stopping;
+};
+
+void ms_speech_token_destroy(ms_speech_context_t context);
+void ms_speech_token_service(ms_speech_context_t context);
+int ms_speech_token_wait(ms_speech_connection_t connection);
+void ms_speech_token_cancel(ms_speech_connection_t connection);
+const char *ms_speech_token_get_header(ms_speech_context_t context, int *expired);
+
+#endif /* ms_speech_token_h */
@@ -24,6 +24,18 @@ all copies or substantial portions of the Software.
 #include "response_messages_priv.h"
 #include "ms_speech_logging_priv.h"
 #include "ms_speech_telemetry.h"
+#include "ms_speech_status_control.h"
+#include "ms_speech_reconnect.h"
+#include "ms_speech_resolver.h"
+#include "ms_speech_token.h"
+#include "ms_speech_race.h"
+#include "ms_speech_endpoint_set.h"
+#include "ms_speech_timeouts.h"
+#include "ms_speech_latency.h"
+#include "ms_speech_metrics.h"
+#include "ms_speech_capture.h"
+#include "ms_speech_timestamp.h"
+#include "ms_speech_memory.h"
 
 static int ms_speech_handle_speech_startdetected(ms_speech_connection_t connection, ms_speech_parsed_message_t *parsed_message);
 static int ms_speech_handle_speech_enddetected(ms_speech_connection_t connection, ms_speech_parsed_message_t *parsed_message);
@@ -34,7 +46,6 @@ static int ms_speech_handle_turn_start(ms_speech_connection_t connection, ms_spe
 static int ms_speech_handle_turn_end(ms_speech_connection_t connection, ms_speech_parsed_message_t *parsed_message);
 
 static int ms_speech_parse_response_message(ms_speech_connection_t connection, void *buffer, size_t len, ms_speech_parsed_message_t **parsed_message);
-static void ms_speech_destroy_parsed_message(ms_speech_parsed_message_t *parsed_message);
 static char * trim_string(char *string);
 
 int ms_speech_handle_resonse_message(ms_speech_connection_t connection, void *buffer, size_t len)
@@ -45,9 +56,13 @@ int ms_speech_handle_resonse_message(ms_speech_connection_t connection, void *bu
 		// partial message, return success
 		return 0;
 	} else if (r) {
+		ms_speech_metrics_add(connection->context, MS_SPEECH_METRIC_PARSE_ERRORS, 1);
 		return r;
 	}
 
+	uint64_t dispatch_started = ms_speech_get_monotonic_us();
+	ms_speech_metrics_add(connection->context, MS_SPEECH_METRIC_PARSED_MESSAGE_ALLOCATIONS, 1);
+	ms_speech_metrics_count_message(connection->context, MS_SPEECH_METRIC_MESSAGES_RECEIVED, parsed_message->path);
 	ms_speech_telemetry_handle_response_message(connection, parsed_message);
 	
 	if (!strcasecmp(parsed_message->path, MS_SPEECH_MESSAGE_PATH_SPEECH_STARTDETECTED))
@@ -66,12 +81,18 @@ int ms_speech_handle_resonse_message(ms_speech_connection_t connection, void *bu
 		r = ms_speech_handle_turn_end(connection, parsed_message);
 	
 	ms_speech_destroy_parsed_message(parsed_message);
+	ms_speech_metrics_add(connection->context, MS_SPEECH_METRIC_CALLBACK_TIME_US, ms_speech_get_monotonic_us() - dispatch_started);
+	if (r == -EINVAL)
+		ms_speech_metrics_add(connection->context, MS_SPEECH_METRIC_PARSE_ERRORS, 1);
 	
 	return r;
 }
 
 void ms_speech_handle_connection_cleanup(ms_speech_connection_t connection)
 {
+	if (connection->retired)
+		return;
+
 	if (connection->json_tokenizer != NULL) {
 		json_tokener_free(connection->json_tokenizer);
 		connection->json_tokenizer = NULL;
@@ -80,13 +101,31 @@ void ms_speech_handle_connection_cleanup(ms_speech_connection_t connection)
 		ms_speech_destroy_parsed_message(connection->current_parsed_message);
 		connection->current_parsed_message = NULL;
 	}
-	if (connection->callbacks != NULL) {
-		free(connection->callbacks);
-	}
+	ms_speech_slab_free(&connection->context->callbacks_slab, connection->callbacks);
+	connection->callbacks = NULL;
+	ms_speech_slab_free(&connection->context->streaming_slab, connection->streaming_info);
+	connection->streaming_info = NULL;
+	ms_speech_reconnect_destroy(connection);
+	ms_speech_resolver_cancel(connection);
+	ms_speech_token_cancel(connection);
+	ms_speech_race_cancel(connection);
+	ms_speech_endpoint_set_release(connection);
+	ms_speech_timeouts_cancel(connection);
+	ms_speech_telemetry_destroy(connection);
+	ms_speech_latency_destroy(connection);
+	ms_speech_metrics_handle_connection_destroyed(connection);
+	ms_speech_connection_stop_capture(connection);
+
+	// callers up the stack may still look at the connection
+	connection->retired = 1;
+	connection->retired_next = connection->context->retired;
+	connection->context->retired = connection;
 }
 
 static int ms_speech_handle_speech_startdetected(ms_speech_connection_t connection, ms_speech_parsed_message_t *parsed_message)
 {
+	ms_speech_latency_mark(connection, MS_SPEECH_PHASE_START_DETECTED);
+
 	ms_speech_startdetected_message_t message;
 	message.parsed_message = parsed_message;
 	
@@ -100,7 +139,7 @@ static int ms_speech_handle_speech_startdetected(ms_speech_connection_t connecti
 
 		return -EINVAL;
 	} else {
-		message.offset = json_object_get_double(value_json) / 10000000.0;
+		message.offset = json_object_get_double(value_json) / 10000000.0 + ms_speech_reconnect_offset_base(connection);
 	}
 
 	if (connection->callbacks->speech_startdetected)
@@ -111,6 +150,8 @@ static int ms_speech_handle_speech_startdetected(ms_speech_connection_t connecti
 
 static int ms_speech_handle_speech_enddetected(ms_speech_connection_t connection, ms_speech_parsed_message_t *parsed_message)
 {
+	ms_speech_latency_mark(connection, MS_SPEECH_PHASE_END_DETECTED);
+
 	ms_speech_enddetected_message_t message;
 	message.parsed_message = parsed_message;
 	
@@ -124,7 +165,7 @@ static int ms_speech_handle_speech_enddetected(ms_speech_connection_t connection
 
 //		return -EINVAL;
 	} else {
-		message.offset = json_object_get_double(value_json) / 10000000.0;
+		message.offset = json_object_get_double(value_json) / 10000000.0 + ms_speech_reconnect_offset_base(connection);
 	}
 
 	if (connection->callbacks->speech_enddetected)
@@ -144,7 +185,7 @@ static int ms_speech_extract_phrase_time(ms_speech_connection_t connection, stru
 
 		return -EINVAL;
 	} else {
-		timing->offset = json_object_get_double(value_json) / 10000000.0;
+		timing->offset = json_object_get_double(value_json) / 10000000.0 + ms_speech_reconnect_offset_base(connection);
 	}
 
 	if (!json_object_object_get_ex(json, MS_SPEECH_MESSAGE_KEY_PHRASE_DURATION, &value_json) ||
@@ -163,6 +204,10 @@ static int ms_speech_extract_phrase_time(ms_speech_connection_t connection, stru
 
 static int ms_speech_handle_speech_hypothesis(ms_speech_connection_t connection, ms_speech_parsed_message_t *parsed_message)
 {
+	ms_speech_endpoint_set_handle_result(connection);
+	ms_speech_timeouts_handle_result(connection);
+	ms_speech_latency_mark(connection, MS_SPEECH_PHASE_FIRST_HYPOTHESIS);
+
 	if (parsed_message->json_payload == NULL) {
 		ms_speech_connection_log(connection,
 								 MS_SPEECH_LOG_ERR,
@@ -188,6 +233,7 @@ static int ms_speech_handle_speech_hypothesis(ms_speech_connection_t connection,
 	message.text = json_object_get_string(value_json);
 	if (ms_speech_extract_phrase_time(connection, parsed_message->json_payload, &message.time))
 		return -EINVAL;
+	message.result_latency_ms = ms_speech_latency_handle_result(connection, MS_SPEECH_PHASE_HYPOTHESIS_LAG, &message.time);
 
 	if (connection->callbacks->speech_hypothesis)
 		connection->callbacks->speech_hypothesis(connection, &message, connection->callbacks->user_data);
@@ -197,6 +243,9 @@ static int ms_speech_handle_speech_hypothesis(ms_speech_connection_t connection,
 
 static int ms_speech_handle_speech_fragment(ms_speech_connection_t connection, ms_speech_parsed_message_t *parsed_message)
 {
+	ms_speech_endpoint_set_handle_result(connection);
+	ms_speech_timeouts_handle_result(connection);
+
 	if (parsed_message->json_payload == NULL) {
 		ms_speech_connection_log(connection,
 								 MS_SPEECH_LOG_ERR,
@@ -222,6 +271,7 @@ static int ms_speech_handle_speech_fragment(ms_speech_connection_t connection, m
 	message.text = json_object_get_string(value_json);
 	if (ms_speech_extract_phrase_time(connection, parsed_message->json_payload, &message.time))
 		return -EINVAL;
+	message.result_latency_ms = ms_speech_latency_handle_result(connection, MS_SPEECH_PHASE_HYPOTHESIS_LAG, &message.time);
 
 	if (connection->callbacks->speech_fragment)
 		connection->callbacks->speech_fragment(connection, &message, connection->callbacks->user_data);
@@ -231,6 +281,10 @@ static int ms_speech_handle_speech_fragment(ms_speech_connection_t connection, m
 
 static int ms_speech_handle_speech_result(ms_speech_connection_t connection, ms_speech_parsed_message_t *parsed_message)
 {
+	ms_speech_endpoint_set_handle_result(connection);
+	ms_speech_timeouts_handle_result(connection);
+	ms_speech_latency_mark(connection, MS_SPEECH_PHASE_FINAL_PHRASE);
+
 	if ((parsed_message->json_payload == NULL) ||
 		json_object_get_type(parsed_message->json_payload) != json_type_object) {
 		ms_speech_connection_log(connection,
@@ -244,6 +298,7 @@ static int ms_speech_handle_speech_result(ms_speech_connection_t connection, ms_
 	ms_speech_result_message_t message;
 	memset(&message, 0, sizeof(message));
 	message.parsed_message = parsed_message;
+	message.result_latency_ms = NAN;
 	
 	struct json_object *reco_status_json = NULL;
 	if (!json_object_object_get_ex(parsed_message->json_payload, MS_SPEECH_MESSAGE_KEY_RECOGNITION_STATUS, &reco_status_json) ||
@@ -271,8 +326,8 @@ static int ms_speech_handle_speech_result(ms_speech_connection_t connection, ms_
 		ms_speech_connection_log(connection,
 								 MS_SPEECH_LOG_ERR,
 								 "%s recognition status is of unknown value: %s",
-								 reco_status,
-								 MS_SPEECH_MESSAGE_PATH_SPEECH_PHRASE);
+								 MS_SPEECH_MESSAGE_PATH_SPEECH_PHRASE,
+								 reco_status);
 		
 		return -EINVAL;
 	}
@@ -320,8 +375,8 @@ static int ms_speech_handle_speech_result(ms_speech_connection_t connection, ms_
 						ms_speech_connection_log(connection,
 												 MS_SPEECH_LOG_ERR,
 												 "%s nbest entry %d is not of type object",
-												 i,
-												 MS_SPEECH_MESSAGE_PATH_SPEECH_PHRASE);
+												 MS_SPEECH_MESSAGE_PATH_SPEECH_PHRASE,
+												 i);
 						
 						r = -EINVAL;
 						break;
@@ -334,8 +389,8 @@ static int ms_speech_handle_speech_result(ms_speech_connection_t connection, ms_
 						ms_speech_connection_log(connection,
 												 MS_SPEECH_LOG_ERR,
 												 "%s nbest entry %d: confidence is not of type double",
-												 i,
-												 MS_SPEECH_MESSAGE_PATH_SPEECH_PHRASE);
+												 MS_SPEECH_MESSAGE_PATH_SPEECH_PHRASE,
+												 i);
 						r = -EINVAL;
 						break;
 					}
@@ -348,8 +403,8 @@ static int ms_speech_handle_speech_result(ms_speech_connection_t connection, ms_
 						ms_speech_connection_log(connection,
 												 MS_SPEECH_LOG_ERR,
 												 "%s nbest entry %d: lexical is not of type string",
-												 i,
-												 MS_SPEECH_MESSAGE_PATH_SPEECH_PHRASE);
+												 MS_SPEECH_MESSAGE_PATH_SPEECH_PHRASE,
+												 i);
 						
 						r = -EINVAL;
 						break;
@@ -363,8 +418,8 @@ static int ms_speech_handle_speech_result(ms_speech_connection_t connection, ms_
 						ms_speech_connection_log(connection,
 												 MS_SPEECH_LOG_ERR,
 												 "%s nbest entry %d: itn is not of type string",
-												 i,
-												 MS_SPEECH_MESSAGE_PATH_SPEECH_PHRASE);
+												 MS_SPEECH_MESSAGE_PATH_SPEECH_PHRASE,
+												 i);
 						
 						r = -EINVAL;
 						break;
@@ -378,8 +433,8 @@ static int ms_speech_handle_speech_result(ms_speech_connection_t connection, ms_
 						ms_speech_connection_log(connection,
 												 MS_SPEECH_LOG_ERR,
 												 "%s nbest entry %d: masked itn is not of type string",
-												 i,
-												 MS_SPEECH_MESSAGE_PATH_SPEECH_PHRASE);
+												 MS_SPEECH_MESSAGE_PATH_SPEECH_PHRASE,
+												 i);
 						
 						r = -EINVAL;
 						break;
@@ -393,8 +448,8 @@ static int ms_speech_handle_speech_result(ms_speech_connection_t connection, ms_
 						ms_speech_connection_log(connection,
 												 MS_SPEECH_LOG_ERR,
 												 "%s nbest entry %d: display is not of type string",
-												 i,
-												 MS_SPEECH_MESSAGE_PATH_SPEECH_PHRASE);
+												 MS_SPEECH_MESSAGE_PATH_SPEECH_PHRASE,
+												 i);
 						
 						r = -EINVAL;
 						break;
@@ -415,6 +470,11 @@ static int ms_speech_handle_speech_result(ms_speech_connection_t connection, ms_
 		}
 	}
 	
+	if (!r && message.num_phrase_results > 0) {
+		message.result_latency_ms = ms_speech_latency_handle_result(connection, MS_SPEECH_PHASE_PHRASE_LAG, &message.phrase_results[0].time);
+		ms_speech_reconnect_handle_phrase(connection, &message.phrase_results[0].time);
+	}
+	
 	if (!r) {
 		if (connection->callbacks->speech_result)
 			connection->callbacks->speech_result(connection, &message, connection->callbacks->user_data);
@@ -431,6 +491,7 @@ static int ms_speech_handle_turn_start(ms_speech_connection_t connection, ms_spe
 	ms_speech_turn_start_message_t message;
 	message.parsed_message = parsed_message;
 
+	ms_speech_timeouts_handle_turn_start(connection);
 
 	int r = 0;
 	struct json_object *context_json = NULL;
@@ -471,11 +532,15 @@ static int ms_speech_handle_turn_end(ms_speech_connection_t connection, ms_speec
 	ms_speech_turn_end_message_t message;
 	message.parsed_message = parsed_message;
 
+	// we'll send telemetry in all cases. set it before calling back so that
+	// a new stream started from the callback is queued behind it
+	ms_speech_set_status(connection, MS_SPEECH_CLIENT_TELEMETRY_PENDING);
+	ms_speech_timeouts_handle_turn_end(connection);
+	ms_speech_latency_mark(connection, MS_SPEECH_PHASE_TURN_END);
+
 	if (connection->callbacks->turn_end)
 		connection->callbacks->turn_end(connection, &message, connection->callbacks->user_data);
 	
-	// we'll send telemetry in all cases
-	connection->status = MS_SPEECH_CLIENT_TELEMETRY_PENDING;	
 	return -EAGAIN;
 }
 
@@ -517,7 +582,7 @@ static int ms_speech_extract_headder_fields(ms_speech_connection_t connection, m
 	return 0;
 }
 
-static int ms_speech_extract_headers(ms_speech_connection_t connection, char *start, size_t len, ms_speech_header_t **parsed_headers, int *num)
+int ms_speech_extract_headers(ms_speech_connection_t connection, char *start, size_t len, ms_speech_header_t **parsed_headers, int *num)
 {
 	*parsed_headers = NULL;
 	*num = 0;
@@ -531,7 +596,7 @@ static int ms_speech_extract_headers(ms_speech_connection_t connection, char *st
 			ms_speech_connection_log(connection,
 									 MS_SPEECH_LOG_WARN | MS_SPEECH_LOG_HEADER,
 									 "Skipping invalid header format: %.*s",
-									 end - start,
+									 (int)(end - start),
 									 start);
 			// TODO: be more strict?
 			continue;
@@ -556,12 +621,12 @@ static int ms_speech_extract_headers(ms_speech_connection_t connection, char *st
 	return 0;
 }
 
-static int ms_speech_parse_payload(ms_speech_connection_t connection, char *payload, size_t len, struct json_object **json_payload)
+int ms_speech_parse_payload(ms_speech_connection_t connection, char *payload, size_t len, struct json_object **json_payload)
 {
 	*json_payload = NULL;
 	
 	if (connection->json_tokenizer == NULL)
-		connection->json_tokenizer = json_tokener_new();
+		connection->json_tokenizer = json_tokener_new_ex(connection->context->memory.json_max_depth);
 	
 	*json_payload = json_tokener_parse_ex(connection->json_tokenizer, payload, (int)len);
 	enum json_tokener_error jerr = json_tokener_get_error(connection->json_tokenizer);
@@ -616,6 +681,7 @@ static int ms_speech_parse_response_message(ms_speech_connection_t connection, v
 		
 		connection->current_parsed_message->headers = parsed_headers;
 		connection->current_parsed_message->num_headers = num_headers;
+		connection->current_message_size = headers_len;
 		r = ms_speech_extract_headder_fields(connection, connection->current_parsed_message);
 
 		payload_start = headers_end + 4;
@@ -629,8 +695,20 @@ static int ms_speech_parse_response_message(ms_speech_connection_t connection, v
 	if (!r) {
 		struct json_object *json_payload = NULL;
 		if (payload_size > 0) {
-			// parse json payload
-			r = ms_speech_parse_payload(connection, payload_start, payload_size, &json_payload);
+			// the tokenizer holds on to partial payloads until the final fragment
+			r = ms_speech_memory_reserve(connection, payload_size);
+			if (r) {
+				ms_speech_connection_log(connection,
+										 MS_SPEECH_LOG_ERR,
+										 "Service message exceeds connection memory budget after %zu bytes",
+										 connection->current_message_size + payload_size);
+				if (connection->json_tokenizer)
+					json_tokener_reset(connection->json_tokenizer);
+			} else {
+				connection->current_message_size += payload_size;
+				// parse json payload
+				r = ms_speech_parse_payload(connection, payload_start, payload_size, &json_payload);
+			}
 		}
 		
 		if (r == -EAGAIN) {
@@ -652,11 +730,12 @@ static int ms_speech_parse_response_message(ms_speech_connection_t connection, v
 		*parsed_message = connection->current_parsed_message;
 		connection->current_parsed_message = NULL;
 	}
+	connection->current_message_size = 0;
 	
 	return r;
 }
 
-static void ms_speech_destroy_parsed_message(ms_speech_parsed_message_t *parsed_message)
+void ms_speech_destroy_parsed_message(ms_speech_parsed_message_t *parsed_message)
 {
 	if (parsed_message->headers != NULL) {
 		for(int i=0; i<parsed_message->num_headers; i++) {
@@ -23,4 +23,9 @@ all copies or substantial portions of the Software.
 int ms_speech_handle_resonse_message(ms_speech_connection_t connection, void *buffer, size_t len);
 void ms_speech_handle_connection_cleanup(ms_speech_connection_t connection);
 
+// parsing steps, exposed for the benchmarks
+int ms_speech_extract_headers(ms_speech_connection_t connection, char *start, size_t len, ms_speech_header_t **parsed_headers, int *num);
+int ms_speech_parse_payload(ms_speech_connection_t connection, char *payload, size_t len, struct json_object **json_payload);
+void ms_speech_destroy_parsed_message(ms_speech_parsed_message_t *parsed_message);
+
 #endif /* response_messages_priv_h */
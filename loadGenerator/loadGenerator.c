@@ -0,0 +1,603 @@
+/*
+
+Copyright 2017 technicianted
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+#include "ms_speech/ms_speech.h"
+
+#define WAV_HEADER_SIZE 44
+#define MAX_FILES 64
+// simulated round trip to the token service
+#define FAKE_TOKEN_LATENCY_MS 50
+
+typedef struct {
+	unsigned char *data;
+	size_t length;
+	int bytes_per_second;
+} wav_file_t;
+
+typedef struct {
+	double *values;
+	size_t count;
+	size_t capacity;
+} samples_t;
+
+struct worker_st;
+
+typedef struct {
+	struct worker_st *worker;
+	ms_speech_connection_t connection;
+	ms_speech_client_callbacks_t callbacks;
+	int index;
+
+	uint64_t connect_started_us;
+	int connected;
+	int failed;
+	int recycle;
+	int finished;
+	int turns;
+
+	// current request
+	wav_file_t *file;
+	size_t offset;
+	uint64_t stream_started_us;
+	uint64_t audio_ended_us;
+	uint64_t last_phrase_us;
+	int hypothesis_seen;
+	int blocked;
+} stream_t;
+
+typedef struct worker_st {
+	pthread_t thread;
+	ms_speech_context_t context;
+	stream_t *streams;
+	int num_streams;
+
+	unsigned long connects;
+	unsigned long connect_errors;
+	unsigned long disconnects;
+	unsigned long turns;
+	uint64_t audio_bytes;
+	double audio_seconds;
+
+	samples_t connect_ms;
+	samples_t first_hypothesis_ms;
+	samples_t final_result_ms;
+} worker_t;
+
+static const char *uri = "ws://localhost:8080/speech/recognition/interactive/cognitiveservices/v1?language=en-US";
+static const char *subscription_key = "loadgen";
+static int num_connections = 1;
+static int num_threads = 1;
+static double pace = 1.0;
+static int chunk_ms = 100;
+static int duration_s = 30;
+static int max_turns = 0;
+static int reconnect_per_turn = 0;
+static int token_lifetime_ms = 0;
+static unsigned long tokens_issued = 0;
+static int log_level = 0;
+
+static wav_file_t files[MAX_FILES];
+static int num_files = 0;
+
+static volatile int done = 0;
+
+static uint64_t monotonic_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void samples_add(samples_t *samples, double value)
+{
+	if (samples->count == samples->capacity) {
+		samples->capacity = samples->capacity ? samples->capacity * 2 : 1024;
+		samples->values = (double *)realloc(samples->values, samples->capacity * sizeof(double));
+	}
+	samples->values[samples->count++] = value;
+}
+
+static void samples_merge(samples_t *to, const samples_t *from)
+{
+	for (size_t i=0; i<from->count; i++)
+		samples_add(to, from->values[i]);
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static double samples_percentile(const samples_t *samples, double p)
+{
+	if (!samples->count)
+		return NAN;
+
+	size_t rank = (size_t)ceil(p * samples->count);
+	return samples->values[rank ? rank - 1 : 0];
+}
+
+static int load_wav(const char *path, wav_file_t *file)
+{
+	FILE *f = fopen(path, "rb");
+	if (!f)
+		return -1;
+
+	fseek(f, 0, SEEK_END);
+	long length = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	if (length <= WAV_HEADER_SIZE) {
+		fclose(f);
+		return -1;
+	}
+
+	file->data = (unsigned char *)malloc(length);
+	file->length = fread(file->data, 1, length, f);
+	fclose(f);
+
+	const unsigned char *header = file->data;
+	if (file->length != (size_t)length || memcmp(header, "RIFF", 4) || memcmp(header + 8, "WAVE", 4))
+		return -1;
+
+	file->bytes_per_second = header[28] | (header[29] << 8) | (header[30] << 16) | (header[31] << 24);
+	return file->bytes_per_second > 0 ? 0 : -1;
+}
+
+static long rss_bytes(void)
+{
+	long pages = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (f) {
+		if (fscanf(f, "%*s %ld", &pages) != 1)
+			pages = 0;
+		fclose(f);
+	}
+	return pages * sysconf(_SC_PAGESIZE);
+}
+
+static double cpu_seconds(void)
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+		usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+static int stream_callback(ms_speech_connection_t connection, unsigned char *buffer, int len, void *stream_user_data)
+{
+	stream_t *stream = (stream_t *)stream_user_data;
+	wav_file_t *file = stream->file;
+	uint64_t now = monotonic_us();
+
+	if (!stream->stream_started_us)
+		stream->stream_started_us = now;
+
+	size_t remaining = file->length - stream->offset;
+	if (!remaining) {
+		stream->audio_ended_us = now;
+		stream->worker->audio_seconds += (double)(file->length - WAV_HEADER_SIZE) / file->bytes_per_second;
+		return 0;
+	}
+
+	size_t available = remaining;
+	if (pace > 0) {
+		// audio becomes available as if it were captured live
+		double elapsed = (now - stream->stream_started_us) / 1e6;
+		size_t allowed = WAV_HEADER_SIZE + (size_t)(elapsed * pace * file->bytes_per_second);
+		if (allowed > file->length)
+			allowed = file->length;
+		available = allowed > stream->offset ? allowed - stream->offset : 0;
+
+		size_t chunk = (size_t)file->bytes_per_second * chunk_ms / 1000;
+		if (available < remaining && (available < chunk || !available)) {
+			stream->blocked = 1;
+			return -EAGAIN;
+		}
+	}
+
+	size_t n = available < (size_t)len ? available : (size_t)len;
+	memcpy(buffer, file->data + stream->offset, n);
+	stream->offset += n;
+	stream->worker->audio_bytes += n;
+
+	return (int)n;
+}
+
+static void start_request(stream_t *stream)
+{
+	stream->file = &files[(stream->index + stream->turns) % num_files];
+	stream->offset = 0;
+	stream->stream_started_us = 0;
+	stream->audio_ended_us = 0;
+	stream->last_phrase_us = 0;
+	stream->hypothesis_seen = 0;
+	stream->blocked = 0;
+
+	if (ms_speech_start_stream(stream->connection, &stream_callback, NULL, stream))
+		stream->failed = 1;
+}
+
+static void connect_stream(stream_t *stream)
+{
+	stream->connected = 0;
+	stream->failed = 0;
+	stream->recycle = 0;
+	stream->connect_started_us = monotonic_us();
+	if (ms_speech_connect(stream->worker->context, uri, &stream->callbacks, &stream->connection)) {
+		stream->connection = NULL;
+		stream->failed = 1;
+		stream->worker->connect_errors++;
+	}
+}
+
+static const char * auth_token(ms_speech_connection_t connection, void *user_data, size_t max_len)
+{
+	static __thread char buffer[1024];
+	snprintf(buffer, sizeof(buffer), "Ocp-Apim-Subscription-Key: %s", subscription_key);
+	return buffer;
+}
+
+// local stand-in for a token service, shared by all connections of a context
+static int fake_token(char *header, size_t max_len, int *expires_in_ms, void *user_data)
+{
+	usleep(FAKE_TOKEN_LATENCY_MS * 1000);
+	unsigned long n = __atomic_add_fetch(&tokens_issued, 1, __ATOMIC_RELAXED);
+	snprintf(header, max_len, "Authorization: Bearer loadgen-%lu", n);
+	*expires_in_ms = token_lifetime_ms;
+	return 0;
+}
+
+static void client_ready(ms_speech_connection_t connection, void *user_data)
+{
+	stream_t *stream = (stream_t *)user_data;
+	if (connection != stream->connection)
+		return;
+
+	stream->connected = 1;
+	stream->worker->connects++;
+	samples_add(&stream->worker->connect_ms, (monotonic_us() - stream->connect_started_us) / 1000.0);
+
+	start_request(stream);
+}
+
+static void connection_error(ms_speech_connection_t connection, unsigned int http_status, const char *error_message, void *user_data)
+{
+	stream_t *stream = (stream_t *)user_data;
+	if (connection != stream->connection)
+		return;
+
+	if (log_level)
+		printf("Stream %d: connection failed: %d %s\n", stream->index, http_status, error_message ? error_message : "");
+	stream->failed = 1;
+	stream->worker->connect_errors++;
+}
+
+static void connection_closed(ms_speech_connection_t connection, void *user_data)
+{
+	stream_t *stream = (stream_t *)user_data;
+	if (connection != stream->connection)
+		return;
+
+	if (log_level)
+		printf("Stream %d: connection closed\n", stream->index);
+	stream->failed = 1;
+	stream->worker->disconnects++;
+}
+
+static void connection_timeout(ms_speech_connection_t connection, ms_speech_timeout_t timeout, void *user_data)
+{
+	stream_t *stream = (stream_t *)user_data;
+	if (connection != stream->connection)
+		return;
+
+	stream->failed = 1;
+	stream->worker->disconnects++;
+}
+
+static void speech_hypothesis(ms_speech_connection_t connection, ms_speech_hypothesis_message_t *message, void *user_data)
+{
+	stream_t *stream = (stream_t *)user_data;
+	if (connection != stream->connection || stream->hypothesis_seen || !stream->stream_started_us)
+		return;
+
+	stream->hypothesis_seen = 1;
+	samples_add(&stream->worker->first_hypothesis_ms, (monotonic_us() - stream->stream_started_us) / 1000.0);
+}
+
+static void speech_result(ms_speech_connection_t connection, ms_speech_result_message_t *message, void *user_data)
+{
+	stream_t *stream = (stream_t *)user_data;
+	if (connection != stream->connection)
+		return;
+
+	stream->last_phrase_us = monotonic_us();
+}
+
+static void turn_end(ms_speech_connection_t connection, ms_speech_turn_end_message_t *message, void *user_data)
+{
+	stream_t *stream = (stream_t *)user_data;
+	if (connection != stream->connection)
+		return;
+
+	// the final result is the last phrase after all audio went out
+	if (stream->audio_ended_us && stream->last_phrase_us >= stream->audio_ended_us)
+		samples_add(&stream->worker->final_result_ms, (stream->last_phrase_us - stream->audio_ended_us) / 1000.0);
+
+	stream->worker->turns++;
+	stream->turns++;
+	if (max_turns && stream->turns >= max_turns) {
+		stream->finished = 1;
+		return;
+	}
+
+	if (reconnect_per_turn)
+		stream->recycle = 1;
+	else
+		start_request(stream);
+}
+
+static void global_log(ms_speech_log_level_t level, const char *message)
+{
+	printf("%s\n", message);
+}
+
+static void *worker_main(void *arg)
+{
+	worker_t *worker = (worker_t *)arg;
+
+	for (int i=0; i<worker->num_streams; i++)
+		connect_stream(&worker->streams[i]);
+
+	while (!done) {
+		ms_speech_service_step(worker->context, pace > 0 ? 5 : 0);
+
+		int active = 0;
+		for (int i=0; i<worker->num_streams; i++) {
+			stream_t *stream = &worker->streams[i];
+			if (stream->finished)
+				continue;
+			active++;
+
+			if (stream->failed || stream->recycle) {
+				if (stream->connection)
+					ms_speech_disconnect(stream->connection);
+				stream->connection = NULL;
+				connect_stream(stream);
+			} else if (stream->blocked) {
+				stream->blocked = 0;
+				ms_speech_resume_stream(stream->connection);
+			}
+		}
+		if (!active)
+			break;
+	}
+
+	for (int i=0; i<worker->num_streams; i++) {
+		if (worker->streams[i].connection)
+			ms_speech_disconnect(worker->streams[i].connection);
+	}
+	ms_speech_service_step(worker->context, 0);
+	ms_speech_destroy_context(worker->context);
+
+	return NULL;
+}
+
+static void print_latency(const char *name, samples_t *samples)
+{
+	qsort(samples->values, samples->count, sizeof(double), &compare_doubles);
+	printf("%-24s n=%zu p50=%.2f p99=%.2f p999=%.2f max=%.2f ms\n",
+		   name,
+		   samples->count,
+		   samples_percentile(samples, 0.5),
+		   samples_percentile(samples, 0.99),
+		   samples_percentile(samples, 0.999),
+		   samples_percentile(samples, 1.0));
+}
+
+static int parse_opt(int argc, char **argv)
+{
+	int key;
+	while ((key = getopt(argc, argv, "u:k:n:c:f:x:b:t:r:RT:d")) != -1) {
+		switch (key) {
+			case 'u':
+				uri = optarg;
+				break;
+
+			case 'k':
+				subscription_key = optarg;
+				break;
+
+			case 'n':
+				num_connections = atoi(optarg);
+				break;
+
+			case 'c':
+				num_threads = atoi(optarg);
+				break;
+
+			case 'f':
+				if (num_files == MAX_FILES) {
+					printf("Too many audio files\n");
+					return -1;
+				}
+				if (load_wav(optarg, &files[num_files])) {
+					printf("Unable to load WAV file %s\n", optarg);
+					return -1;
+				}
+				num_files++;
+				break;
+
+			case 'x':
+				pace = atof(optarg);
+				break;
+
+			case 'b':
+				chunk_ms = atoi(optarg);
+				break;
+
+			case 't':
+				duration_s = atoi(optarg);
+				break;
+
+			case 'r':
+				max_turns = atoi(optarg);
+				break;
+
+			case 'R':
+				reconnect_per_turn = 1;
+				break;
+
+			case 'T':
+				token_lifetime_ms = atoi(optarg);
+				break;
+
+			case 'd':
+				log_level = 65535;
+				break;
+
+			default:
+				return -1;
+		}
+	}
+
+	if (!num_files || num_connections < 1 || num_threads < 1 || pace < 0 || duration_s < 1)
+		return -1;
+	if (num_threads > num_connections)
+		num_threads = num_connections;
+
+	return 0;
+}
+
+static void usage()
+{
+	printf("Usage: msspeech-loadgen [OPTION...] -f FILE\n");
+	printf("  -f FILE\t\tWAV audio to stream, may be repeated.\n");
+	printf("  -u URI\t\tService URI. Default is the local mock service.\n");
+	printf("  -k KEY\t\tSubscription key.\n");
+	printf("  -n NUM\t\tConcurrent connections. Default is 1.\n");
+	printf("  -c NUM\t\tContexts, each served by its own thread. Default is 1.\n");
+	printf("  -x FACTOR\t\tAudio pacing relative to real time, 0 for unpaced. Default is 1.\n");
+	printf("  -b MS\t\t\tAudio per message when paced. Default is 100.\n");
+	printf("  -t SECONDS\t\tRun time. Default is 30.\n");
+	printf("  -r NUM\t\tTurns per connection, 0 for no limit. Default is 0.\n");
+	printf("  -R\t\t\tReconnect for every turn.\n");
+	printf("  -T MS\t\t\tAuthenticate with fake bearer tokens of this lifetime\n\t\t\tshared through the context token provider.\n");
+	printf("  -d\t\t\tProduce debug output.\n");
+
+	exit(1);
+}
+
+int main(int argc, char * argv[])
+{
+	if (parse_opt(argc, argv))
+		usage();
+
+	ms_speech_set_logging(log_level, &global_log);
+
+	struct rlimit limit;
+	if (!getrlimit(RLIMIT_NOFILE, &limit)) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+
+	worker_t *workers = (worker_t *)calloc(num_threads, sizeof(worker_t));
+	stream_t *streams = (stream_t *)calloc(num_connections, sizeof(stream_t));
+	for (int t=0; t<num_threads; t++) {
+		worker_t *worker = &workers[t];
+		int first = (int)((long)num_connections * t / num_threads);
+		int last = (int)((long)num_connections * (t + 1) / num_threads);
+		worker->context = ms_speech_create_context();
+		if (token_lifetime_ms > 0)
+			ms_speech_context_set_token_provider(worker->context, &fake_token, 0, NULL);
+		worker->streams = &streams[first];
+		worker->num_streams = last - first;
+
+		for (int i=first; i<last; i++) {
+			stream_t *stream = &streams[i];
+			stream->worker = worker;
+			stream->index = i;
+			stream->callbacks.user_data = stream;
+			if (token_lifetime_ms <= 0)
+				stream->callbacks.provide_authentication_header = &auth_token;
+			stream->callbacks.client_ready = &client_ready;
+			stream->callbacks.connection_error = &connection_error;
+			stream->callbacks.connection_closed = &connection_closed;
+			stream->callbacks.connection_timeout = &connection_timeout;
+			stream->callbacks.speech_hypothesis = &speech_hypothesis;
+			stream->callbacks.speech_result = &speech_result;
+			stream->callbacks.turn_end = &turn_end;
+		}
+	}
+
+	long rss_before = rss_bytes();
+	double cpu_before = cpu_seconds();
+	uint64_t started = monotonic_us();
+
+	printf("Streaming to %s over %d connections and %d contexts for %ds\n", uri, num_connections, num_threads, duration_s);
+	for (int t=0; t<num_threads; t++)
+		pthread_create(&workers[t].thread, NULL, &worker_main, &workers[t]);
+
+	// sample resource usage while all streams are still up
+	while (monotonic_us() - started < (uint64_t)duration_s * 1000000)
+		usleep(100000);
+	double wall = (monotonic_us() - started) / 1e6;
+	double cpu = cpu_seconds() - cpu_before;
+	long rss = rss_bytes() - rss_before;
+
+	done = 1;
+	worker_t total;
+	memset(&total, 0, sizeof(total));
+	for (int t=0; t<num_threads; t++) {
+		worker_t *worker = &workers[t];
+		pthread_join(worker->thread, NULL);
+
+		total.connects += worker->connects;
+		total.connect_errors += worker->connect_errors;
+		total.disconnects += worker->disconnects;
+		total.turns += worker->turns;
+		total.audio_bytes += worker->audio_bytes;
+		total.audio_seconds += worker->audio_seconds;
+		samples_merge(&total.connect_ms, &worker->connect_ms);
+		samples_merge(&total.first_hypothesis_ms, &worker->first_hypothesis_ms);
+		samples_merge(&total.final_result_ms, &worker->final_result_ms);
+	}
+
+	printf("connects                 %lu (%.1f/s), errors %lu, drops %lu\n", total.connects, total.connects / wall, total.connect_errors, total.disconnects);
+	printf("turns                    %lu (%.1f/s)\n", total.turns, total.turns / wall);
+	printf("audio                    %.1f s/s, %.1f KB/s\n", total.audio_seconds / wall, total.audio_bytes / wall / 1024);
+	printf("cpu per stream           %.3f%%\n", cpu / wall / num_connections * 100);
+	printf("rss per stream           %.1f KB\n", rss / 1024.0 / num_connections);
+	if (token_lifetime_ms > 0)
+		printf("tokens issued            %lu\n", tokens_issued);
+	print_latency("connect", &total.connect_ms);
+	print_latency("first hypothesis", &total.first_hypothesis_ms);
+	print_latency("final result", &total.final_result_ms);
+
+	return 0;
+}
@@ -0,0 +1,690 @@
+/*
+
+Copyright 2017 technicianted
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/resource.h>
+
+#include <libwebsockets.h>
+#include <json-c/json.h>
+
+// capture format written by ms_speech_context_start_capture()
+#define CAPTURE_MAGIC "MSSPCAP1"
+#define CAPTURE_RECORD_HEADER_SIZE 36
+#define CAPTURE_RECORD_FINAL 0x01
+#define CAPTURE_INCOMING 1
+#define CAPTURE_OPCODE_TEXT 0x1
+
+#define TICKS_PER_MS 10000LL
+#define MAX_MESSAGE_SIZE (1024 * 1024)
+
+typedef enum {
+	// results derived from audio length, texts optionally scripted
+	MODE_AUDIO,
+	// results replayed from a capture with their original timing
+	MODE_REPLAY
+} response_mode_t;
+
+typedef struct response_st {
+	uint64_t due_us;
+	unsigned char *data;
+	size_t length;
+	struct response_st *next;
+} response_t;
+
+typedef struct {
+	// recorded service messages of one turn with their offsets from its start
+	char **messages;
+	uint64_t *offsets_us;
+	int num_messages;
+} replay_turn_t;
+
+typedef struct session_st {
+	struct lws *wsi;
+
+	// reassembly of fragmented client messages
+	unsigned char *message;
+	size_t message_length;
+
+	char request_id[64];
+	uint64_t request_started_us;
+	int bytes_per_second;
+	int audio_seen;
+	uint64_t audio_bytes;
+	uint64_t phrase_start_bytes;
+	uint64_t hypothesis_bytes;
+	int start_detected;
+	int phrase_num;
+
+	response_t *responses;
+	response_t **responses_tail;
+
+	struct session_st *prev;
+	struct session_st *next;
+} session_t;
+
+static int port = 8080;
+static int latency_ms = 0;
+static int hypothesis_ms = 500;
+static int phrase_ms = 3000;
+static response_mode_t mode = MODE_AUDIO;
+static const char *script_file = NULL;
+static const char *replay_file = NULL;
+static const char *cert_file = NULL;
+static const char *key_file = NULL;
+static int log_level = 0;
+static volatile int done = 0;
+
+static char **script_lines = NULL;
+static int num_script_lines = 0;
+static int next_script_line = 0;
+
+static replay_turn_t *replay_turns = NULL;
+static int num_replay_turns = 0;
+static int next_replay_turn = 0;
+
+static session_t *sessions = NULL;
+static unsigned long num_sessions = 0;
+static unsigned long total_sessions = 0;
+static unsigned long total_turns = 0;
+
+static uint64_t monotonic_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void timestamp(char *buffer, size_t len)
+{
+	struct timespec ts;
+	struct tm tm;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	gmtime_r(&ts.tv_sec, &tm);
+	size_t n = strftime(buffer, len, "%Y-%m-%dT%H:%M:%S", &tm);
+	snprintf(buffer + n, len - n, ".%03ldZ", ts.tv_nsec / 1000000);
+}
+
+static void queue_message(session_t *session, uint64_t due_us, const char *message, size_t length)
+{
+	response_t *response = (response_t *)malloc(sizeof(response_t));
+	response->due_us = due_us;
+	response->data = (unsigned char *)malloc(LWS_PRE + length);
+	memcpy(response->data + LWS_PRE, message, length);
+	response->length = length;
+	response->next = NULL;
+
+	*session->responses_tail = response;
+	session->responses_tail = &response->next;
+}
+
+static void queue_response(session_t *session, uint64_t due_us, const char *path, json_object *payload)
+{
+	char time_buffer[64];
+	timestamp(time_buffer, sizeof(time_buffer));
+
+	const char *body = json_object_to_json_string_ext(payload, JSON_C_TO_STRING_PLAIN);
+	size_t length = strlen(path) + strlen(session->request_id) + strlen(time_buffer) + strlen(body) + 128;
+	char *message = (char *)malloc(length);
+	int n = snprintf(message, length,
+					 "Path: %s\r\n"
+					 "X-RequestId: %s\r\n"
+					 "X-Timestamp: %s\r\n"
+					 "Content-Type: application/json; charset=utf-8\r\n"
+					 "\r\n"
+					 "%s",
+					 path,
+					 session->request_id,
+					 time_buffer,
+					 body);
+	queue_message(session, due_us, message, n);
+
+	free(message);
+	json_object_put(payload);
+}
+
+static long long bytes_to_ticks(session_t *session, uint64_t bytes)
+{
+	return (long long)(bytes * 1000 / session->bytes_per_second) * TICKS_PER_MS;
+}
+
+static const char *phrase_text(session_t *session, char *buffer, size_t len, int final)
+{
+	// hypotheses preview the text of the phrase they belong to
+	if (num_script_lines > 0)
+		return script_lines[(final ? next_script_line++ : next_script_line) % num_script_lines];
+
+	snprintf(buffer, len, "phrase %d", session->phrase_num);
+	return buffer;
+}
+
+static void queue_hypothesis(session_t *session, uint64_t due_us)
+{
+	char buffer[64];
+	json_object *payload = json_object_new_object();
+	json_object_object_add(payload, "Text", json_object_new_string(phrase_text(session, buffer, sizeof(buffer), 0)));
+	json_object_object_add(payload, "Offset", json_object_new_int64(bytes_to_ticks(session, session->phrase_start_bytes)));
+	json_object_object_add(payload, "Duration", json_object_new_int64(bytes_to_ticks(session, session->audio_bytes - session->phrase_start_bytes)));
+	queue_response(session, due_us, "speech.hypothesis", payload);
+}
+
+static void queue_phrase(session_t *session, uint64_t due_us)
+{
+	char buffer[64];
+	json_object *payload = json_object_new_object();
+	json_object_object_add(payload, "RecognitionStatus", json_object_new_string("Success"));
+	json_object_object_add(payload, "DisplayText", json_object_new_string(phrase_text(session, buffer, sizeof(buffer), 1)));
+	json_object_object_add(payload, "Offset", json_object_new_int64(bytes_to_ticks(session, session->phrase_start_bytes)));
+	json_object_object_add(payload, "Duration", json_object_new_int64(bytes_to_ticks(session, session->audio_bytes - session->phrase_start_bytes)));
+	queue_response(session, due_us, "speech.phrase", payload);
+
+	session->phrase_num++;
+	session->phrase_start_bytes = session->audio_bytes;
+	session->hypothesis_bytes = session->audio_bytes;
+}
+
+static char *replace_request_id(const char *message, const char *request_id)
+{
+	const char *header = strcasestr(message, "X-RequestId:");
+	const char *end = header ? strstr(header, "\r\n") : NULL;
+	if (!end)
+		return strdup(message);
+
+	size_t prefix = header - message;
+	size_t length = prefix + strlen("X-RequestId: ") + strlen(request_id) + strlen(end) + 1;
+	char *result = (char *)malloc(length);
+	snprintf(result, length, "%.*sX-RequestId: %s%s", (int)prefix, message, request_id, end);
+
+	return result;
+}
+
+static void start_request(session_t *session, const char *request_id)
+{
+	uint64_t now = monotonic_us();
+
+	snprintf(session->request_id, sizeof(session->request_id), "%s", request_id);
+	session->request_started_us = now;
+	session->bytes_per_second = 32000;
+	session->audio_seen = 0;
+	session->audio_bytes = 0;
+	session->phrase_start_bytes = 0;
+	session->hypothesis_bytes = 0;
+	session->start_detected = 0;
+	session->phrase_num = 0;
+	total_turns++;
+
+	if (mode == MODE_REPLAY && num_replay_turns > 0) {
+		// replay a recorded turn with its original timing
+		replay_turn_t *turn = &replay_turns[next_replay_turn++ % num_replay_turns];
+		for (int i=0; i<turn->num_messages; i++) {
+			char *message = replace_request_id(turn->messages[i], request_id);
+			queue_message(session, now + turn->offsets_us[i] + latency_ms * 1000, message, strlen(message));
+			free(message);
+		}
+		return;
+	}
+
+	json_object *payload = json_object_new_object();
+	json_object *context = json_object_new_object();
+	json_object_object_add(context, "serviceTag", json_object_new_string("mock"));
+	json_object_object_add(payload, "context", context);
+	queue_response(session, now + latency_ms * 1000, "turn.start", payload);
+}
+
+static void handle_audio(session_t *session, const unsigned char *audio, size_t length)
+{
+	if (mode == MODE_REPLAY)
+		return;
+
+	uint64_t due = monotonic_us() + latency_ms * 1000;
+
+	if (!session->audio_seen) {
+		session->audio_seen = 1;
+		if (length >= 44 && !memcmp(audio, "RIFF", 4)) {
+			int byte_rate = audio[28] | (audio[29] << 8) | (audio[30] << 16) | (audio[31] << 24);
+			if (byte_rate > 0)
+				session->bytes_per_second = byte_rate;
+			length -= 44;
+		}
+	}
+
+	if (!length) {
+		// end of audio
+		if (session->audio_bytes > session->phrase_start_bytes)
+			queue_phrase(session, due);
+
+		json_object *payload = json_object_new_object();
+		json_object_object_add(payload, "Offset", json_object_new_int64(bytes_to_ticks(session, session->audio_bytes)));
+		queue_response(session, due, "speech.endDetected", payload);
+		queue_response(session, due, "turn.end", json_object_new_object());
+		return;
+	}
+
+	if (!session->start_detected) {
+		session->start_detected = 1;
+		json_object *payload = json_object_new_object();
+		json_object_object_add(payload, "Offset", json_object_new_int64(0));
+		queue_response(session, due, "speech.startDetected", payload);
+	}
+
+	session->audio_bytes += length;
+	uint64_t hypothesis_bytes = (uint64_t)session->bytes_per_second * hypothesis_ms / 1000;
+	uint64_t phrase_bytes = (uint64_t)session->bytes_per_second * phrase_ms / 1000;
+	if (session->audio_bytes - session->phrase_start_bytes >= phrase_bytes) {
+		queue_phrase(session, due);
+	} else if (hypothesis_bytes && session->audio_bytes - session->hypothesis_bytes >= hypothesis_bytes) {
+		session->hypothesis_bytes = session->audio_bytes;
+		queue_hypothesis(session, due);
+	}
+}
+
+static void handle_message(session_t *session, int binary)
+{
+	const char *headers = (const char *)session->message;
+	size_t headers_length = session->message_length;
+	const unsigned char *body = NULL;
+	size_t body_length = 0;
+
+	if (binary) {
+		if (session->message_length < 2)
+			return;
+		headers_length = (session->message[0] << 8) | session->message[1];
+		if (headers_length + 2 > session->message_length)
+			return;
+		headers = (const char *)session->message + 2;
+		body = session->message + 2 + headers_length;
+		body_length = session->message_length - 2 - headers_length;
+	}
+
+	char path[64] = "";
+	char request_id[64] = "";
+	const char *p = headers;
+	const char *end = headers + headers_length;
+	while (p < end) {
+		const char *line_end = memchr(p, '\n', end - p);
+		if (!line_end)
+			line_end = end;
+		size_t line_length = line_end - p;
+		if (line_length && p[line_length - 1] == '\r')
+			line_length--;
+		if (!line_length)
+			break;
+
+		if (line_length > 5 && !strncasecmp(p, "Path:", 5))
+			sscanf(p + 5, " %63[^\r\n]", path);
+		else if (line_length > 12 && !strncasecmp(p, "X-RequestId:", 12))
+			sscanf(p + 12, " %63[^\r\n]", request_id);
+		p = line_end + 1;
+	}
+
+	if (log_level)
+		printf("%p: received %s (%s)\n", (void *)session->wsi, path, request_id);
+
+	if (!strcasecmp(path, "audio")) {
+		if (request_id[0] && strcmp(request_id, session->request_id))
+			start_request(session, request_id);
+		handle_audio(session, body, body_length);
+	}
+	// speech.config and telemetry need no answer
+}
+
+static int callback(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len)
+{
+	session_t *session = (session_t *)user;
+
+	switch (reason) {
+		case LWS_CALLBACK_ESTABLISHED:
+			memset(session, 0, sizeof(session_t));
+			session->wsi = wsi;
+			session->responses_tail = &session->responses;
+			session->next = sessions;
+			if (sessions)
+				sessions->prev = session;
+			sessions = session;
+			num_sessions++;
+			total_sessions++;
+			break;
+
+		case LWS_CALLBACK_RECEIVE:
+			if (session->message_length + len > MAX_MESSAGE_SIZE)
+				return -1;
+			session->message = (unsigned char *)realloc(session->message, session->message_length + len);
+			memcpy(session->message + session->message_length, in, len);
+			session->message_length += len;
+			if (lws_is_final_fragment(wsi) && !lws_remaining_packet_payload(wsi)) {
+				handle_message(session, lws_frame_is_binary(wsi));
+				session->message_length = 0;
+			}
+			break;
+
+		case LWS_CALLBACK_SERVER_WRITEABLE:
+		{
+			response_t *response = session->responses;
+			if (!response || response->due_us > monotonic_us())
+				break;
+
+			session->responses = response->next;
+			if (!session->responses)
+				session->responses_tail = &session->responses;
+			int r = lws_write(wsi, response->data + LWS_PRE, response->length, LWS_WRITE_TEXT);
+			free(response->data);
+			free(response);
+			if (r < 0)
+				return -1;
+			if (session->responses && session->responses->due_us <= monotonic_us())
+				lws_callback_on_writable(wsi);
+			break;
+		}
+
+		case LWS_CALLBACK_CLOSED:
+			if (session->prev)
+				session->prev->next = session->next;
+			else
+				sessions = session->next;
+			if (session->next)
+				session->next->prev = session->prev;
+			num_sessions--;
+
+			while (session->responses) {
+				response_t *next = session->responses->next;
+				free(session->responses->data);
+				free(session->responses);
+				session->responses = next;
+			}
+			free(session->message);
+			break;
+
+		default:
+			break;
+	}
+
+	return 0;
+}
+
+static const struct lws_protocols protocols[] = {
+	{
+		"msspeech",
+		&callback,
+		sizeof(session_t),
+		65536,
+	},
+	{ NULL, NULL, 0, 0 } /* end */
+};
+
+static int load_script(const char *path)
+{
+	FILE *file = fopen(path, "r");
+	if (!file)
+		return -1;
+
+	char line[1024];
+	while (fgets(line, sizeof(line), file)) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if (!line[0])
+			continue;
+		script_lines = (char **)realloc(script_lines, (num_script_lines + 1) * sizeof(char *));
+		script_lines[num_script_lines++] = strdup(line);
+	}
+	fclose(file);
+
+	return num_script_lines > 0 ? 0 : -1;
+}
+
+static uint64_t read_le(const unsigned char *p, int size)
+{
+	uint64_t value = 0;
+	for (int i=size-1; i>=0; i--)
+		value = (value << 8) | p[i];
+	return value;
+}
+
+static int load_replay(const char *path)
+{
+	FILE *file = fopen(path, "rb");
+	if (!file)
+		return -1;
+
+	char magic[8];
+	if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) || memcmp(magic, CAPTURE_MAGIC, sizeof(magic))) {
+		fclose(file);
+		return -1;
+	}
+
+	// service messages of the first connection, split into turns at turn.end
+	unsigned char first_connection[16];
+	int have_connection = 0;
+	replay_turn_t *turn = NULL;
+	uint64_t turn_started_us = 0;
+	char *pending = NULL;
+	size_t pending_length = 0;
+
+	unsigned char header[CAPTURE_RECORD_HEADER_SIZE];
+	while (fread(header, 1, sizeof(header), file) == sizeof(header)) {
+		uint64_t timestamp_us = read_le(header, 8);
+		size_t stored_length = (size_t)read_le(header + 32, 4);
+		unsigned char *payload = (unsigned char *)malloc(stored_length + 1);
+		if (fread(payload, 1, stored_length, file) != stored_length) {
+			free(payload);
+			break;
+		}
+
+		if (!have_connection && header[8] == CAPTURE_INCOMING) {
+			memcpy(first_connection, header + 12, sizeof(first_connection));
+			have_connection = 1;
+		}
+		if (header[8] != CAPTURE_INCOMING || header[9] != CAPTURE_OPCODE_TEXT ||
+			memcmp(first_connection, header + 12, sizeof(first_connection))) {
+			free(payload);
+			continue;
+		}
+
+		pending = (char *)realloc(pending, pending_length + stored_length + 1);
+		memcpy(pending + pending_length, payload, stored_length);
+		pending_length += stored_length;
+		pending[pending_length] = '\0';
+		free(payload);
+		if (!(header[10] & CAPTURE_RECORD_FINAL))
+			continue;
+
+		if (!turn) {
+			replay_turns = (replay_turn_t *)realloc(replay_turns, (num_replay_turns + 1) * sizeof(replay_turn_t));
+			turn = &replay_turns[num_replay_turns++];
+			memset(turn, 0, sizeof(replay_turn_t));
+			turn_started_us = timestamp_us;
+		}
+		turn->messages = (char **)realloc(turn->messages, (turn->num_messages + 1) * sizeof(char *));
+		turn->offsets_us = (uint64_t *)realloc(turn->offsets_us, (turn->num_messages + 1) * sizeof(uint64_t));
+		turn->messages[turn->num_messages] = pending;
+		turn->offsets_us[turn->num_messages] = timestamp_us - turn_started_us;
+		turn->num_messages++;
+
+		if (strcasestr(pending, "Path: turn.end"))
+			turn = NULL;
+		pending = NULL;
+		pending_length = 0;
+	}
+	free(pending);
+	fclose(file);
+
+	return num_replay_turns > 0 ? 0 : -1;
+}
+
+static void on_signal(int sig)
+{
+	done = 1;
+}
+
+static int parse_opt(int argc, char **argv)
+{
+	int key;
+	while ((key = getopt(argc, argv, "p:l:m:s:r:H:P:c:k:d")) != -1) {
+		switch (key) {
+			case 'p':
+				port = atoi(optarg);
+				break;
+
+			case 'l':
+				latency_ms = atoi(optarg);
+				break;
+
+			case 'm':
+				if (!strcmp(optarg, "audio")) {
+					mode = MODE_AUDIO;
+				} else if (!strcmp(optarg, "replay")) {
+					mode = MODE_REPLAY;
+				} else {
+					printf("Invalid mode '%s'\n", optarg);
+					return -1;
+				}
+				break;
+
+			case 's':
+				script_file = optarg;
+				break;
+
+			case 'r':
+				replay_file = optarg;
+				mode = MODE_REPLAY;
+				break;
+
+			case 'H':
+				hypothesis_ms = atoi(optarg);
+				break;
+
+			case 'P':
+				phrase_ms = atoi(optarg);
+				break;
+
+			case 'c':
+				cert_file = optarg;
+				break;
+
+			case 'k':
+				key_file = optarg;
+				break;
+
+			case 'd':
+				log_level = LLL_ERR | LLL_WARN | LLL_NOTICE;
+				break;
+
+			default:
+				return -1;
+		}
+	}
+
+	if (mode == MODE_REPLAY && !replay_file) {
+		printf("Replay mode needs a capture file\n");
+		return -1;
+	}
+	if (phrase_ms <= 0) {
+		printf("Invalid phrase duration\n");
+		return -1;
+	}
+	if (!cert_file != !key_file) {
+		printf("TLS needs both a certificate and a key\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void usage()
+{
+	printf("Usage: msspeech-mock-server [OPTION...]\n");
+	printf("  -p PORT\t\tListen port. Default is 8080.\n");
+	printf("  -l MS\t\t\tArtificial latency added to every response. Default is 0.\n");
+	printf("  -m MODE\t\tResponse mode {audio|replay}. Default is audio.\n");
+	printf("  -s FILE\t\tPhrase texts, one per line, for audio mode.\n");
+	printf("  -r FILE\t\tReplay service messages from a capture file.\n");
+	printf("  -H MS\t\t\tAudio between hypotheses in audio mode. Default is 500.\n");
+	printf("  -P MS\t\t\tAudio per phrase in audio mode. Default is 3000.\n");
+	printf("  -c FILE\t\tTLS certificate, enables wss.\n");
+	printf("  -k FILE\t\tTLS private key.\n");
+	printf("  -d\t\t\tProduce debug output.\n");
+
+	exit(1);
+}
+
+int main(int argc, char * argv[])
+{
+	if (parse_opt(argc, argv))
+		usage();
+
+	if (script_file && load_script(script_file)) {
+		printf("Unable to load script %s\n", script_file);
+		return 1;
+	}
+	if (replay_file && load_replay(replay_file)) {
+		printf("Unable to load capture %s\n", replay_file);
+		return 1;
+	}
+
+	// every socket is a file descriptor
+	struct rlimit limit;
+	if (!getrlimit(RLIMIT_NOFILE, &limit)) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+
+	signal(SIGINT, &on_signal);
+	signal(SIGTERM, &on_signal);
+	signal(SIGPIPE, SIG_IGN);
+	lws_set_log_level(log_level, NULL);
+
+	struct lws_context_creation_info info;
+	memset(&info, 0, sizeof(info));
+	info.port = port;
+	info.protocols = protocols;
+	info.gid = -1;
+	info.uid = -1;
+	info.ssl_cert_filepath = cert_file;
+	info.ssl_private_key_filepath = key_file;
+	if (cert_file)
+		info.options |= LWS_SERVER_OPTION_DO_SSL_GLOBAL_INIT;
+
+	struct lws_context *context = lws_create_context(&info);
+	if (!context) {
+		printf("Unable to create server context\n");
+		return 1;
+	}
+
+	printf("Listening on port %d\n", port);
+	uint64_t report_at = monotonic_us() + 10000000;
+	while (!done) {
+		lws_service(context, 5);
+
+		uint64_t now = monotonic_us();
+		for (session_t *session = sessions; session; session = session->next) {
+			if (session->responses && session->responses->due_us <= now)
+				lws_callback_on_writable(session->wsi);
+		}
+
+		if (now >= report_at) {
+			printf("sessions: %lu active, %lu total, turns: %lu\n", num_sessions, total_sessions, total_turns);
+			report_at = now + 10000000;
+		}
+	}
+
+	lws_context_destroy(context);
+
+	return 0;
+}